@@ -13,8 +13,7 @@ char* g_prompt_label_str = NULL;
 int g_prompt_label_len = 0;
 int g_width = 0;
 int g_height = 0;
-FILE* fdebug = NULL;
-struct timespec tdebug;
+int g_trace_level = ATTO_TRACE_DEBUG;
 
 /**
  * Program entry point
@@ -23,9 +22,9 @@ int main(int argc, char** argv) {
     lua_State* L;
     buffer_t* buffer;
 
-    // Open debug file
+    // Dump trace ring on exit
     if (ATTO_DEBUG) {
-        fdebug = fopen("debug.log", "w");
+        atexit(_trace_dump_at_exit);
     }
 
     // Run tests
@@ -33,12 +32,17 @@ int main(int argc, char** argv) {
         exit(test_run());
     }
 
+    // Run benchmarks
+    if (argc >= 2 && !strcmp(argv[1], "-B")) {
+        exit(bench_run());
+    }
+
     // Init ncurses
-    ATTO_DEBUG_PRINTF("%s\n", "Init ncurses");
+    ATTO_TRACE(ATTO_TRACE_INFO, "%s\n", "Init ncurses");
     _main_init_ncurses(&g_width, &g_height);
 
     // Init Lua API
-    ATTO_DEBUG_PRINTF("%s\n", "Init Lua API");
+    ATTO_TRACE(ATTO_TRACE_INFO, "%s\n", "Init Lua API");
     L = NULL;
     lapi_init(&L);
     if (ATTO_DEBUG) {
@@ -47,21 +51,21 @@ int main(int argc, char** argv) {
     }
 
     // Init layout
-    ATTO_DEBUG_PRINTF("%s\n", "Init layout");
+    ATTO_TRACE(ATTO_TRACE_INFO, "%s\n", "Init layout");
     refresh();
     _layout_init(L, NULL);
     bview_set_active(g_bview_edit);
     _script_init(L);
 
     // Show screen once
-    ATTO_DEBUG_PRINTF("%s\n", "Resize and render layout");
+    ATTO_TRACE(ATTO_TRACE_INFO, "%s\n", "Resize and render layout");
     _layout_resize(g_width, g_height);
     _bview_update_viewport(g_bview_active, 0, 0);
     bview_update(g_bview_active);
     doupdate();
 
     // Run Lua user script
-    ATTO_DEBUG_PRINTF("%s\n", "Run Lua script");
+    ATTO_TRACE(ATTO_TRACE_INFO, "%s\n", "Run Lua script");
     _main_run_lua_script(L);
 
     // Load file from argv
@@ -71,11 +75,11 @@ int main(int argc, char** argv) {
     }
 
     // Enter main loop
-    ATTO_DEBUG_PRINTF("%s\n", "Enter main loop");
+    ATTO_TRACE(ATTO_TRACE_INFO, "%s\n", "Enter main loop");
     _main_loop(L, g_width, g_height);
 
     // End ncurses
-    ATTO_DEBUG_PRINTF("%s\n", "End ncurses");
+    ATTO_TRACE(ATTO_TRACE_INFO, "%s\n", "End ncurses");
     endwin();
 
     return EXIT_SUCCESS;
@@ -83,12 +87,11 @@ int main(int argc, char** argv) {
 
 void _main_loop(lua_State* L, int width, int height) {
     int do_exit;
-    char* keyc;
+    int key;
     int keys[ATTO_KEYS_LEN];
     int luafn;
 
     // Start loop
-    keyc = (char*)calloc(ATTO_KEYC_LEN + 1, sizeof(char));
     do_exit = 0;
     for (;!do_exit;) {
 
@@ -99,84 +102,97 @@ void _main_loop(lua_State* L, int width, int height) {
         doupdate();
 
         // Get input
-        _main_get_input(keyc, keys);
-        if (!strcmp(keyc, "q")) {
+        key = _main_get_input(keys);
+        if (key == 'q') {
             break;
         }
 
         // Handle resize
-        if (!strcmp(keyc, "resize")) {
+        if (key == KEY_RESIZE) {
             _main_handle_resize(L, &width, &height);
             continue;
         }
 
         // Map input to function
-        luafn = _main_map_input_to_function(g_bview_active, keyc);
+        luafn = _main_map_input_to_function(g_bview_active, key);
         if (luafn == LUA_REFNIL) {
             continue;
         }
 
         // Invoke function
-        do_exit = _main_invoke_function(luafn, g_bview_active, L, width, height, keyc, keys);
+        do_exit = _main_invoke_function(luafn, g_bview_active, L, width, height, key, keys);
         do_exit = 0; // TODO remove
     }
-
-    free(keyc);
 }
 
-void _main_get_input(char* keyc, int* keys) {
+/**
+ * Read a key and return it packed as an int, e.g., ATTO_KEY_META | 'x' for
+ * escape followed by x. Set keys to the raw chars read.
+ */
+int _main_get_input(int* keys) {
     int ch;
     int i;
-    ch = wgetch(g_bview_active->win_buffer);
+    ch = _main_get_input_while_styling(g_bview_active);
     for (i = 0; i < ATTO_KEYS_LEN; i++) keys[i] = 0;
     keys[0] = ch;
     if (ch == 10 || ch == 13) {
-        sprintf(keyc, "%s", "enter");
+        return 13;
     } else if (ch == 8) {
-        sprintf(keyc, "%s", "backspace");
-    } else if (ch == 9) {
-        sprintf(keyc, "%s", "tab");
+        return KEY_BACKSPACE;
     } else if (ch == 27) {
         ch = wgetch(g_bview_active->win_buffer);
+        if (ch == ERR) {
+            // Escape on its own
+            return 27;
+        }
         keys[1] = ch;
-        sprintf(keyc, "M%c", ch);
-    } else if (ch > 0 && ch < 32) {
-        sprintf(keyc, "C%c", (ch + 'A' - 1));
-    } else if (ch >= 32 && ch <= 126) {
-        sprintf(keyc, "%c", ch);
-    } else if (ch == KEY_DOWN) {
-        sprintf(keyc, "%s", "down");
-    } else if (ch == KEY_UP) {
-        sprintf(keyc, "%s", "up");
-    } else if (ch == KEY_LEFT) {
-        sprintf(keyc, "%s", "left");
-    } else if (ch == KEY_RIGHT) {
-        sprintf(keyc, "%s", "right");
-    } else if (ch == KEY_HOME) {
-        sprintf(keyc, "%s", "home");
-    } else if (ch == KEY_BACKSPACE) {
-        sprintf(keyc, "%s", "backspace");
-    } else if (ch == KEY_DC) {
-        sprintf(keyc, "%s", "delete");
-    } else if (ch == KEY_END) {
-        sprintf(keyc, "%s", "end");
-    } else if (ch == KEY_RESIZE) {
-        sprintf(keyc, "%s", "resize");
-    } else if (ch == KEY_NPAGE) {
-        sprintf(keyc, "%s", "pagedown");
-    } else if (ch == KEY_PPAGE) {
-        sprintf(keyc, "%s", "pageup");
-    } else if (ch == 522) {
-        sprintf(keyc, "%s", "alt-down");
-    } else if (ch == 563) {
-        sprintf(keyc, "%s", "alt-up");
-    } else if (ch == 542) {
-        sprintf(keyc, "%s", "alt-left");
-    } else if (ch == 557) {
-        sprintf(keyc, "%s", "alt-right");
-    } else {
-        sprintf(keyc, "%s", "");
+        return ATTO_KEY_META | ch;
+    } else if (ch > 0 && ch <= 126) {
+        return ch;
+    } else if (ch >= KEY_MIN) {
+        return ch;
     }
+    return 0;
+}
+
+/**
+ * Wait for a key. While there is none, keep the styler thread busy with
+ * off-screen lines of bview's buffer and repaint when styles for the
+ * viewport come in.
+ */
+int _main_get_input_while_styling(bview_t* bview) {
+    int ch;
+    int style_line;
+    buffer_t* buffer;
+    buffer = bview->buffer;
+    ch = ERR;
+    if (buffer->sjob || buffer->style_line < buffer->line_count) {
+        wtimeout(bview->win_buffer, ATTO_STYLE_POLL_MS);
+        while ((ch = wgetch(bview->win_buffer)) == ERR
+            && (buffer->sjob || buffer->style_line < buffer->line_count)
+        ) {
+            style_line = buffer->style_line;
+            _buffer_style_async(buffer, buffer->style_line + ATTO_STYLE_IDLE_CHUNK_LINES);
+            if (style_line < bview->viewport_y + bview->viewport_h && buffer->style_line > style_line) {
+                bview_update(bview);
+                bview_update_cursor(bview);
+                doupdate();
+            }
+        }
+        wtimeout(bview->win_buffer, -1);
+        if (ch == ERR) {
+            // Styling is done; trim span storage of lines out of view
+            _buffer_compact_sspans(
+                buffer,
+                ATTO_MAX(0, bview->viewport_y - ATTO_SSPAN_COMPACT_MARGIN),
+                bview->viewport_y + bview->viewport_h + ATTO_SSPAN_COMPACT_MARGIN
+            );
+        }
+    }
+    if (ch == ERR) {
+        ch = wgetch(bview->win_buffer);
+    }
+    return ch;
 }
 
 void _main_init_ncurses(int* width, int* height) {
@@ -191,6 +207,15 @@ void _main_init_ncurses(int* width, int* height) {
 }
 
 void _main_run_lua_script(lua_State* L) {
+#ifdef ATTO_LUAJIT
+    // Give scripts FFI access to the buffer API as atto_ffi
+    if (luaL_dofile(L, "atto_ffi.lua") != LUA_OK) {
+        endwin();
+        printf("Error in lua script: %s\n", lua_tostring(L, -1));
+        exit(EXIT_FAILURE);
+    }
+    lua_setglobal(L, "atto_ffi");
+#endif
     if (luaL_dofile(L, "atto.lua") != LUA_OK) {
         endwin();
         printf("Error in lua script: %s\n", lua_tostring(L, -1));
@@ -205,26 +230,12 @@ void _main_handle_resize(lua_State* L, int* width, int* height) {
     lua_pushinteger(L, *height);
 }
 
-int _main_map_input_to_function(bview_t* bview, char* keyc) {
-    kbinding_t* binding;
-    keymap_node_t* node;
-    keymap_t* keymap;
-    for (node = bview->keymap_tail; node; node = node->prev) {
-        keymap = node->keymap;
-        HASH_FIND_STR(keymap->bindings, keyc, binding);
-        if (binding) {
-            return binding->fn;
-        } else if (keymap->default_fn != LUA_REFNIL) {
-            return keymap->default_fn;
-        } else if (keymap->is_fall_through_allowed) {
-            continue;
-        }
-        break;
-    }
-    return LUA_REFNIL;
+int _main_map_input_to_function(bview_t* bview, int key) {
+    return _keymap_dispatch(bview->keymap_tail, &bview->kpending, key);
 }
 
-int _main_invoke_function(int luafn, bview_t* bview, lua_State* L, int width, int height, char* keyc, int* keys) {
+int _main_invoke_function(int luafn, bview_t* bview, lua_State* L, int width, int height, int key, int* keys) {
+    char keyc[ATTO_KEYC_LEN];
     int luaerrc;
     char* luaerr;
     int do_exit;
@@ -281,9 +292,12 @@ int _main_invoke_function(int luafn, bview_t* bview, lua_State* L, int width, in
     lua_pushinteger(L, height);
     lua_setfield(L, -2, "height");
 
-    lua_pushstring(L, keyc);
+    lua_pushlstring(L, keyc, _keymap_get_key_name(key, keyc));
     lua_setfield(L, -2, "keyc");
 
+    lua_pushinteger(L, key);
+    lua_setfield(L, -2, "key");
+
     lua_pushinteger(L, keys[0]);
     lua_setfield(L, -2, "key1");
 
@@ -318,7 +332,7 @@ int _main_lapi_debug(lua_State* L) {
     int retval;
     char* msg;
     msg = (char*)luaL_checkstring(L, 1);
-    ATTO_DEBUG_PRINTF("Lua: %s\n", msg);
+    ATTO_TRACE(ATTO_TRACE_INFO, "Lua: %s\n", msg);
     retval = ATTO_RC_OK;
     lua_pushinteger(L, retval);
     return 1;
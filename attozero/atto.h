@@ -11,11 +11,18 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <ncurses.h>
 #include <pcre.h>
+#ifdef ATTO_LUAJIT
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#else
 #include <lua5.2/lua.h>
 #include <lua5.2/lauxlib.h>
 #include <lua5.2/lualib.h>
+#endif
 #include "ext/uthash/uthash.h"
 #include "ext/uthash/utarray.h"
 #include "ext/uthash/utlist.h"
@@ -26,12 +33,31 @@
 #define ATTO_RC_ERR 1
 #define ATTO_KEYS_LEN 2
 #define ATTO_KEYC_LEN 16
+#define ATTO_KEY_META 0x10000
+#define ATTO_KEY_CHORD_LEN 4
 #define ATTO_SRULE_TYPE_SINGLE 0
 #define ATTO_SRULE_TYPE_MULTI 1
 #define ATTO_SRULE_TYPE_RANGE 2
 #define ATTO_BUFFER_DATA_ALLOC_INCR 1024
 #define ATTO_LINE_OFFSET_ALLOC_INCR 64
 #define ATTO_SSPAN_RANGE_ALLOC_INCR 10
+#define ATTO_SSPAN_COMPACT_MARGIN 1000
+#define ATTO_SPOOL_MIN_SPANS 4
+#define ATTO_SPOOL_CLASSES 7
+#define ATTO_SPOOL_SLAB_SIZE (64 * 1024)
+#define ATTO_STYLE_LOOKAHEAD_LINES 32
+#define ATTO_STYLE_IDLE_CHUNK_LINES 256
+#define ATTO_STYLE_POLL_MS 10
+#define ATTO_REGEX_CACHE_SIZE 64
+#define ATTO_COLOR_PAIR_START 2
+#define ATTO_COLOR_PAIR_MAX 256 // COLOR_PAIR() only has room for 8 bits
+#define ATTO_SLEXER_MAX_RULES 128
+#define ATTO_SLEXER_MAX_GROUPS 256
+#define ATTO_REGEX_JIT_STACK_MIN (32 * 1024)
+#define ATTO_REGEX_JIT_STACK_MAX (512 * 1024)
+#define ATTO_SJOB_STATE_QUEUED 0
+#define ATTO_SJOB_STATE_RUNNING 1
+#define ATTO_SJOB_STATE_DONE 2
 #define ATTO_MIN(a,b) (((a) < (b)) ? (a) : (b))
 #define ATTO_MAX(a,b) (((a) > (b)) ? (a) : (b))
 
@@ -54,10 +80,17 @@ typedef struct mark_s mark_t; // A mark in a buffer
 typedef struct srule_s srule_t; // A style rule
 typedef struct srule_node_s srule_node_t; // A node in a list of styles
 typedef struct sspan_s sspan_t; // A styled span of text
+typedef struct cregex_s cregex_t; // A compiled regex in the regex cache
+typedef struct cpair_s cpair_t; // An ncurses color pair in the color pair cache
+typedef struct slexer_s slexer_t; // Single-line style rules combined into one regex
+typedef struct spainter_s spainter_t; // Scratch space for building a line's sspans
+typedef struct spool_s spool_t; // A pool of sspan arrays
 typedef struct keymap_s keymap_t; // A map of inputs to functions
 typedef struct keymap_node_s keymap_node_t; // A node in a list of keymaps
 typedef struct kbinding_s kbinding_t; // A single binding in a keymap
 typedef struct hook_s hook_t; // An event hook
+typedef struct sjob_s sjob_t; // A background styling job
+typedef struct trace_entry_s trace_entry_t; // An entry in the trace ring
 
 /**
  * Buffer
@@ -71,10 +104,18 @@ struct buffer_s {
     int blines_size;
     mark_t* marks;
     srule_node_t* styles;
+    slexer_t* slexer; // Single-line styles combined, or NULL to apply them in turn
+    spool_t* sspool; // Storage for blines' sspans
     blistener_t* listeners;
     int has_unsaved_changes;
     int line_count;
     int byte_count;
+    int style_line; // Lines before this have up-to-date styles
+    int style_sync_line; // Lines from style_sync_line to style_sync_end were styled before
+    int style_sync_end; // the last edit and are reused once restyling catches up to them
+    int version; // Incremented on every edit
+    sjob_t* sjob; // Styling job in progress on the styler thread, if any
+    int sjob_edit_line; // Lines from here on were edited after sjob was submitted
 };
 buffer_t* buffer_new();
 int buffer_read(buffer_t* self, char* filename);
@@ -86,6 +127,9 @@ int buffer_delete(buffer_t* self, int offset, int len);
 int buffer_get_line(buffer_t* self, int line, int from_col, char* usebuf, int usebuf_len, char** ret_line, int* ret_len);
 int buffer_get_line_offset_len(buffer_t* self, int line, int from_col, int* ret_offset, int* ret_len);
 int buffer_get_substr(buffer_t* self, int offset, int len, char* usebuf, int usebuf_len, char** ret_substr, int* ret_len);
+int buffer_get_line_view(buffer_t* self, int line, int from_col, char** ret_line, int* ret_len, int* ret_version);
+int buffer_get_substr_view(buffer_t* self, int offset, int len, char** ret_substr, int* ret_len, int* ret_version);
+int buffer_check_view(buffer_t* self, int version);
 int buffer_get_line_col(buffer_t* self, int offset, int* ret_line, int* ret_col);
 int buffer_get_offset(buffer_t* self, int line, int col);
 int buffer_search(buffer_t* self, char* needle, int offset);
@@ -95,6 +139,8 @@ int buffer_regex_exec(buffer_t* self, char* regex, int start_offset, int length,
 int _buffer_search(buffer_t* self, char* needle, int offset, int is_reverse);
 int buffer_add_style(buffer_t* self, srule_t* style);
 int buffer_remove_style(buffer_t* self, srule_t* style);
+int buffer_style(buffer_t* self, int until_line);
+int _buffer_style_async(buffer_t* self, int until_line);
 mark_t* buffer_add_mark(buffer_t* self, int offset);
 int buffer_remove_mark(buffer_t* self, mark_t* mark);
 blistener_t* buffer_add_buffer_listener(buffer_t* self, void* listener, blistener_callback_t fn);
@@ -103,7 +149,15 @@ int buffer_destroy(buffer_t* self);
 int _buffer_update_metadata(buffer_t* self, int offset, int line, int col, char* delta, int delta_len);
 int _buffer_update_blines(buffer_t* self, int offset, int dirty_line, int col, char* delta, int delta_len);
 int _buffer_update_marks(buffer_t* self, int offset, int delta);
-int _buffer_update_styles(buffer_t* self, int dirty_line, char* delta, int delta_len, int bail_on_matching_style_hash);
+int _buffer_update_styles(buffer_t* self, int until_line);
+int _buffer_style_line(srule_node_t* styles, slexer_t* slexer, char* data, bline_t* bline, srule_t* open_rule, spainter_t* painter);
+int _buffer_style_sync_skip(buffer_t* self, int line, srule_t* prev_open_rule);
+int _buffer_set_sspans(buffer_t* self, int line, sspan_t* sspans, int sspans_len);
+int _buffer_apply_sjob(buffer_t* self, sjob_t* sjob);
+int _buffer_compact_sspans(buffer_t* self, int keep_from, int keep_until);
+int _buffer_invalidate_styles(buffer_t* self, int line, int line_delta);
+int _buffer_update_slexer(buffer_t* self);
+int _buffer_notify_listeners(buffer_t* self, int line, int col, char* delta, int delta_len);
 int _buffer_expand_line_structs(buffer_t* self);
 
 /**
@@ -112,11 +166,12 @@ int _buffer_expand_line_structs(buffer_t* self);
 struct bline_s {
     int offset;
     int length;
-    int style_hash;
     sspan_t* sspans;
     int sspans_len;
     int sspans_size;
     srule_t* open_rule;
+    int version; // buffer->version when text last changed
+    int sspans_version; // buffer->version of the text sspans were computed for
 };
 
 /**
@@ -155,6 +210,7 @@ struct bview_s {
     int split_is_vertical;
     keymap_node_t* keymaps;
     keymap_node_t* keymap_tail;
+    kbinding_t* kpending;
     mark_t* cursor_list;
     mark_t* cursor;
     bview_t* next;
@@ -169,6 +225,7 @@ int bview_viewport_set(bview_t* self, int line, int col);
 int bview_viewport_set_scope(bview_t* self, int viewport_scope);
 int _bview_update_viewport(bview_t* self, int line, int col);
 int _bview_update_viewport_dimension(bview_t* self, int line, int viewport_h, int* viewport_y);
+int _bview_render_text(bview_t* self, int view_line, int col, char* data, int len);
 bview_t* bview_split(bview_t* self, int is_vertical, float factor);
 bview_t* bview_get_parent(bview_t* self);
 bview_t* bview_get_top_parent(bview_t* self);
@@ -198,16 +255,23 @@ keymap_t* keymap_new(int is_fall_through_allowed);
 int keymap_bind(keymap_t* self, char* keyc, int fn_handler);
 int keymap_bind_default(keymap_t* self, int fn_handler);
 int keymap_destroy(keymap_t* self);
+int _keymap_parse_keyc(char* keyc, int* ret_keys, int max_keys);
+int _keymap_parse_key(char* name, int len);
+int _keymap_get_key_name(int key, char* ret_name);
+int _keymap_dispatch(keymap_node_t* tail, kbinding_t** pending, int key);
+int _keymap_step(kbinding_t* binding, kbinding_t** pending);
 
 /**
- * Keymap binding
+ * Keymap binding. A chord like "CX CS" is a binding for CX whose children
+ * hold the binding for CS.
  */
 struct kbinding_s {
-    char keyc[ATTO_KEYC_LEN];
+    int key;
     int fn;
+    kbinding_t* children;
     UT_hash_handle hh;
 };
-kbinding_t* kbinding_new(char* keyc, int fn);
+kbinding_t* kbinding_new(int key, int fn);
 int kbinding_destroy(kbinding_t* self);
 
 /**
@@ -233,8 +297,8 @@ int mark_move_line(mark_t* self, int line_delta);
 struct srule_s {
     char* regex;
     char* regex_end;
-    pcre* cregex;
-    pcre* cregex_end;
+    cregex_t* cregex;
+    cregex_t* cregex_end;
     mark_t* range_start;
     mark_t* range_end;
     int color;
@@ -253,6 +317,71 @@ srule_t* srule_new_range(mark_t* start, mark_t* end, int color, int bg_color, in
 srule_t* _srule_new(int color, int bg_color, int other_attrs);
 int _srule_destroy(srule_t* self);
 
+/**
+ * Span pool
+ *
+ * Hands out sspan arrays in power-of-2 size classes carved from big slabs
+ * and keeps freed arrays on a free list per class. Not thread-safe; each
+ * buffer and each styling job has its own.
+ */
+struct spool_s {
+    sspan_t* free[ATTO_SPOOL_CLASSES]; // Freed arrays, chained through their first bytes
+    char* slabs;
+    char* slab_next;
+    int slab_left;
+};
+int _spool_get_class(int size);
+sspan_t* _spool_alloc(spool_t* self, int size, int* ret_size);
+int _spool_free(spool_t* self, sspan_t* sspans, int size);
+int _spool_destroy(spool_t* self);
+
+/**
+ * Span painter
+ *
+ * Builds a line's sspans from intervals painted over one another, later
+ * paint winning. Runs are kept sorted and merged as they are painted, so
+ * nothing is tracked per char.
+ */
+struct spainter_s {
+    int* cols; // Run i starts at cols[i] and ends where run i + 1 starts
+    int* attrs;
+    int len;
+    int size;
+    int length; // Line length
+    spool_t* pool; // Where bline sspans are allocated
+    int* tokens; // Scratch for _slexer_paint; start, end and next of each token
+    int tokens_len;
+    int tokens_size;
+};
+int _spainter_reset(spainter_t* self, int length);
+int _spainter_paint(spainter_t* self, int from_col, int to_col, int attrs);
+int _spainter_to_bline(spainter_t* self, bline_t* bline);
+int _spainter_free(spainter_t* self);
+int _spainter_find(spainter_t* self, int col);
+int _spainter_ensure(spainter_t* self, int size);
+int _spainter_ensure_tokens(spainter_t* self, int size);
+
+/**
+ * Style lexer
+ *
+ * The single-line rules at the head of a buffer's styles combined into
+ * alternations, so a line is scanned once instead of once per rule. Where
+ * one rule's matches overlap another's, they are still found and painted
+ * the same as when each rule is applied in turn.
+ */
+struct slexer_s {
+    cregex_t** cregexes; // cregexes[k] combines rules[0] thru rules[k - 1], last rule first; anchored unless k is rules_len
+    srule_t** rules;
+    int* groups; // Capture group of rules[i] in cregexes[k] is groups[k * (k - 1) / 2 + i]
+    int rules_len;
+    int ovector_size;
+    int refs;
+};
+slexer_t* _slexer_new(srule_node_t* styles);
+int _slexer_exec(slexer_t* self, int below, char* data, int length, int offset, int* ret_start, int* ret_end);
+int _slexer_paint(slexer_t* self, char* data, int length, int from_col, spainter_t* painter);
+int _slexer_release(slexer_t* self);
+
 /**
  * Styled span
  */
@@ -261,6 +390,46 @@ struct sspan_s {
     int attrs;
 };
 
+/**
+ * Styling job
+ *
+ * A snapshot of the lines and styles needed to style part of a buffer. Jobs
+ * are run on the styler thread, which never touches the buffer itself.
+ */
+struct sjob_s {
+    int version; // buffer->version when the snapshot was taken
+    int from_line;
+    int until_line;
+    int base_offset; // Buffer offset of data
+    char* data; // Text of lines from_line until until_line
+    bline_t* blines; // Lines from_line until until_line; sspans and open_rule are filled in by the job
+    srule_node_t* styles;
+    slexer_t* slexer;
+    srule_t* range_rules; // Copies of range rules in styles, pointing at range_marks
+    srule_t** range_origs; // Rules that range_rules were copied from
+    mark_t* range_marks;
+    int range_count;
+    spool_t* sspool; // Storage for blines' sspans
+    srule_t* open_rule; // Open rule before from_line
+    int sync_line; // buffer->style_sync_line and style_sync_end; the job
+    int sync_end; // stops once it catches up to the styles already there
+    int state; // ATTO_SJOB_STATE_*
+    sjob_t* next;
+};
+sjob_t* _sjob_new(buffer_t* buffer, int until_line);
+int _sjob_run(sjob_t* self);
+srule_t* _sjob_get_orig_rule(sjob_t* self, srule_t* rule);
+srule_t* _sjob_get_job_rule(sjob_t* self, srule_t* rule);
+int _sjob_destroy(sjob_t* self);
+
+/**
+ * Styler
+ */
+int _styler_submit(sjob_t* sjob);
+int _styler_is_done(sjob_t* sjob);
+int _styler_cancel(sjob_t* sjob);
+void* _styler_main(void* arg);
+
 /**
  * Hook
  */
@@ -289,11 +458,33 @@ int _script_init(lua_State* L);
  */
 int lapi_init(lua_State** L);
 
+/**
+ * Compiled regex
+ */
+struct cregex_s {
+    char* key; // Options and pattern
+    pcre* re;
+    pcre_extra* extra; // Study data incl. JIT code; may be NULL
+    int refs; // Regexes with no refs may be evicted from the cache
+    UT_hash_handle hh;
+};
+
+/**
+ * Cached color pair
+ */
+struct cpair_s {
+    int key; // fg and bg
+    short pair;
+    UT_hash_handle hh;
+};
+
 /**
  * Util functions
  */
 const char* util_memrmem(const char* s, size_t slen, const char* t, size_t tlen);
-pcre* util_compile_regex(char* regex);
+cregex_t* util_compile_regex(char* regex, int options);
+int util_exec_regex(cregex_t* cregex, char* subject, int length, int offset, int options, int* ovector, int ovecsize);
+int util_release_regex(cregex_t* cregex);
 int util_get_ncurses_color_pair(int fg_num, int bg_num);
 int util_file_exists(const char *path);
 int util_memchr_count(int ch, char* str, int len);
@@ -304,10 +495,11 @@ int util_memchr_count(int ch, char* str, int len);
 void _main_init_ncurses(int* width, int* height);
 void _main_run_lua_script(lua_State* L);
 void _main_loop(lua_State* L, int width, int height);
-void _main_get_input(char* keyc, int* keys);
+int _main_get_input(int* keys);
+int _main_get_input_while_styling(bview_t* bview);
 void _main_handle_resize(lua_State* L, int* width, int* height);
-int _main_map_input_to_function(bview_t* bview, char* keyc);
-int _main_invoke_function(int luafn, bview_t* bview, lua_State* L, int width, int height, char* keyc, int* keys);
+int _main_map_input_to_function(bview_t* bview, int key);
+int _main_invoke_function(int luafn, bview_t* bview, lua_State* L, int width, int height, int key, int* keys);
 int _main_lapi_debug(lua_State* L);
 
 /**
@@ -315,6 +507,11 @@ int _main_lapi_debug(lua_State* L);
  */
 int test_run();
 
+/**
+ * Benchmarks
+ */
+int bench_run();
+
 /**
  * Globals
  */
@@ -328,21 +525,45 @@ extern char* g_prompt_label_str;
 extern int g_prompt_label_len;
 extern int g_width;
 extern int g_height;
+extern int g_trace_level;
 
 /**
- * Debug
+ * Trace
+ *
+ * Build with -DATTO_DEBUG=1 (make debug) to compile in everything up to
+ * ATTO_TRACE_SPEW. Otherwise only ATTO_TRACE_ERROR survives and every other
+ * ATTO_TRACE call is eliminated at compile time. Entries go to an in-memory
+ * ring and are only formatted to a file when trace_dump is called.
  */
-extern FILE* fdebug;
-extern struct timespec tdebug;
-#define ATTO_DEBUG 1
-#define ATTO_DEBUG_PRINTF(fmt, ...) \
+#ifndef ATTO_DEBUG
+#define ATTO_DEBUG 0
+#endif
+#define ATTO_TRACE_ERROR 0
+#define ATTO_TRACE_INFO 1
+#define ATTO_TRACE_DEBUG 2
+#define ATTO_TRACE_SPEW 3
+#ifndef ATTO_TRACE_MAX_LEVEL
+#define ATTO_TRACE_MAX_LEVEL (ATTO_DEBUG ? ATTO_TRACE_SPEW : ATTO_TRACE_ERROR)
+#endif
+#define ATTO_TRACE_RING_SIZE 4096 // Must be a power of 2
+#define ATTO_TRACE_MSG_LEN 128
+#define ATTO_TRACE_ENABLED(level) ((level) <= ATTO_TRACE_MAX_LEVEL)
+#define ATTO_TRACE(level, fmt, ...) \
     do { \
-        if (ATTO_DEBUG) { \
-            clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &tdebug); \
-            fprintf(fdebug, "%ld [%s] ", tdebug.tv_nsec, __PRETTY_FUNCTION__); \
-            fprintf(fdebug, fmt, __VA_ARGS__); \
-            fflush(fdebug); \
+        if (ATTO_TRACE_ENABLED(level) && (level) <= g_trace_level) { \
+            _trace_write((level), __func__, fmt, __VA_ARGS__); \
         } \
     } while (0)
+struct trace_entry_s {
+    unsigned long seq; // 0 while unwritten, else (ring position + 1)
+    struct timespec time;
+    int level;
+    const char* func;
+    char msg[ATTO_TRACE_MSG_LEN];
+};
+int trace_set_level(int level);
+int trace_dump(char* filename);
+int _trace_write(int level, const char* func, const char* fmt, ...);
+void _trace_dump_at_exit();
 
 #endif
@@ -41,7 +41,12 @@ keymap_bind(keymap_default, "CA", function(context)
     mark_set(context.cursor, match_offset)
 end)
 keymap_bind(keymap_default, "CE", function(context)
-    local ok, offset, len = buffer_get_line_offset_len(context.buffer, context.line, 0);
+    local ok, offset, len
+    if atto_ffi then
+        len = atto_ffi.buffer(context.buffer).blines[context.line].length
+    else
+        ok, offset, len = buffer_get_line_offset_len(context.buffer, context.line, 0);
+    end
     mark_set_line_col(context.cursor, context.line, len)
 end)
 keymap_bind(keymap_default, "backspace", function(context)
@@ -88,8 +93,7 @@ function prompt(label, default, callback)
 
     keymap_prompt = keymap_new(1)
     keymap_bind(keymap_prompt, "enter", function(context)
-        local buf = string.rep(" ", context.byte_count)
-        ok, response, response_len = buffer_get_line(buffer_prompt, 0, 0, buf, context.byte_count)
+        ok, response, response_len = buffer_get_line_view(buffer_prompt, 0, 0)
         keymap_destroy(bview_keymap_pop(bview_prompt))
         buffer_clear(buffer_prompt)
         bview_set_prompt_label("")
@@ -0,0 +1,227 @@
+#include "atto.h"
+
+#define ATTO_BENCH_LINES 20000
+#define ATTO_BENCH_CALLS 1000000
+
+#define ATTO_BENCH_REPORT(name, bytes, secs) \
+    printf("%24s ... %8.2f MB/s (%.3fs)\n", name, (bytes) / (secs) / (1024 * 1024), secs)
+
+#define ATTO_BENCH_REPORT_CALLS(name, calls, secs) \
+    printf("%24s ... %8.1f ns/call (%.3fs)\n", name, (secs) * 1e9 / (calls), secs)
+
+/**
+ * Return seconds on the monotonic clock
+ */
+double _bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return a buffer of PHP-ish code styled with the rules from atto.lua
+ */
+buffer_t* _bench_php_buffer(int line_count) {
+    buffer_t* buffer;
+    char* lines[] = {
+        "<?php",
+        "class Foo extends Bar {",
+        "    private $baz = array('a' => 1, 'b' => -2);",
+        "    public function qux($x, $y = null) {",
+        "        if ($x->isValid() && $y !== false) { // check it",
+        "            echo \"Hello $x, you are \" . $y['age'] . \" years old\";",
+        "        }",
+        "        foreach ($this->baz as $k => $v) { $total += $v * 1024; }",
+        "        return static::DEFAULT_VALUE;",
+        "    }",
+        "}",
+        ""
+    };
+    int lines_len;
+    int line;
+    char* str;
+    buffer = buffer_new();
+    lines_len = sizeof(lines) / sizeof(char*);
+    for (line = 0; line < line_count; line++) {
+        str = lines[line % lines_len];
+        buffer_insert(buffer, buffer->byte_count, str, strlen(str), NULL, NULL, NULL);
+        buffer_insert(buffer, buffer->byte_count, "\n", 1, NULL, NULL, NULL);
+    }
+    buffer_add_style(buffer, srule_new_single("\\$[a-zA-Z_0-9$]*|[=!<>-]", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("\\b(class|var|const|static|final|private|public|protected|function|switch|case|default|endswitch|if|else|elseif|endif|for|foreach|endfor|endforeach|while|endwhile|new|die|echo|continue|exit)\\b", 0, 0, A_BOLD));
+    buffer_add_style(buffer, srule_new_single("\\b-?[0-9]+\\b", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("\\b(true|false|null)\\b", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("[(){}.,;]", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("(\\$|=>|->|::)", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("(\\[|\\])", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("'([^']|(\\\\'))*'", 0, 0, A_BOLD));
+    buffer_add_style(buffer, srule_new_single("\"([^\"]|(\\\\\"))*\"", 0, 0, A_BOLD));
+    buffer_add_style(buffer, srule_new_single("(#.*|//.*)$", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("(<\\?(php)?|\\?>)", 0, 0, A_NORMAL));
+    buffer_add_style(buffer, srule_new_single("\\s+$", 0, 0, A_NORMAL));
+    return buffer;
+}
+
+/**
+ * Style every line of buffer with slexer (or each rule in turn if NULL).
+ * Return seconds taken.
+ */
+double _bench_style_lines(buffer_t* buffer, slexer_t* slexer) {
+    int line;
+    bline_t* bline;
+    srule_t* open_rule;
+    spainter_t painter;
+    double start;
+
+    memset(&painter, 0, sizeof(spainter_t));
+    painter.pool = buffer->sspool;
+    open_rule = NULL;
+    start = _bench_now();
+    for (line = 0; line < buffer->line_count; line++) {
+        bline = buffer->blines + line;
+        _buffer_style_line(buffer->styles, slexer, buffer->data + bline->offset, bline, open_rule, &painter);
+        open_rule = bline->open_rule;
+    }
+    _spainter_free(&painter);
+    return _bench_now() - start;
+}
+
+/**
+ * Compare single-line styling with rules combined vs applied in turn
+ */
+int bench_slexer() {
+    buffer_t* buffer;
+    double secs_each;
+    double secs_lexer;
+
+    buffer = _bench_php_buffer(ATTO_BENCH_LINES);
+    secs_each = _bench_style_lines(buffer, NULL);
+    secs_lexer = _bench_style_lines(buffer, buffer->slexer);
+    ATTO_BENCH_REPORT("style_each_rule", buffer->byte_count, secs_each);
+    ATTO_BENCH_REPORT("style_slexer", buffer->byte_count, secs_lexer);
+    buffer_destroy(buffer);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Run a chunk of Lua that calls a function ATTO_BENCH_CALLS times
+ * Return seconds taken
+ */
+double _bench_lua_calls(lua_State* L, char* chunk) {
+    double start;
+    if (luaL_loadstring(L, chunk) != LUA_OK) {
+        printf("Could not load chunk: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return 0;
+    }
+    start = _bench_now();
+    if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+        printf("Error running chunk: %s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+    }
+    return _bench_now() - start;
+}
+
+/**
+ * Measure the cost of a call from Lua into the buffer API, against a call
+ * to an empty Lua function
+ */
+int bench_lapi() {
+    lua_State* L;
+    buffer_t* buffer;
+    double secs_empty;
+    double secs_lapi;
+
+    buffer = _bench_php_buffer(100);
+    lapi_init(&L);
+    lua_pushlightuserdata(L, buffer);
+    lua_setglobal(L, "bench_buffer");
+    lua_pushinteger(L, ATTO_BENCH_CALLS);
+    lua_setglobal(L, "bench_calls");
+    secs_empty = _bench_lua_calls(L,
+        "local f = function(b, l, c) end "
+        "for i = 1, bench_calls do f(bench_buffer, i % 100, 0) end"
+    );
+    secs_lapi = _bench_lua_calls(L,
+        "local f = buffer_get_line_offset_len "
+        "for i = 1, bench_calls do f(bench_buffer, i % 100, 0) end"
+    );
+    ATTO_BENCH_REPORT_CALLS("lua_call_empty", ATTO_BENCH_CALLS, secs_empty);
+    ATTO_BENCH_REPORT_CALLS("lua_call_lapi", ATTO_BENCH_CALLS, secs_lapi);
+    lua_close(L);
+    buffer_destroy(buffer);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Replay a mix of typing, movement and chords through a keymap stack like
+ * the one atto.lua sets up
+ */
+int bench_keys() {
+    keymap_t* keymap_edit;
+    keymap_t* keymap_prompt;
+    keymap_node_t node_edit;
+    keymap_node_t node_prompt;
+    kbinding_t* pending;
+    char* names[] = {
+        "CW", "left", "right", "up", "down", "pageup", "pagedown", "tab", "CA",
+        "CE", "backspace", "delete", "enter", "CO", "CR", "CX CS", "CX CC", "Mx"
+    };
+    int replay[] = {
+        'h', 'e', 'l', 'l', 'o', ' ', KEY_LEFT, KEY_RIGHT, 13, 24, 19, 'w',
+        KEY_BACKSPACE, 23, ATTO_KEY_META | 'x', KEY_DOWN, 5, 24, 3, 'z'
+    };
+    int replay_len;
+    int names_len;
+    int i;
+    int sum;
+    char name[ATTO_KEYC_LEN];
+    double start;
+    double secs_dispatch;
+    double secs_name;
+
+    keymap_edit = keymap_new(0);
+    names_len = sizeof(names) / sizeof(char*);
+    for (i = 0; i < names_len; i++) {
+        keymap_bind(keymap_edit, names[i], i + 1);
+    }
+    keymap_bind_default(keymap_edit, 100);
+    keymap_prompt = keymap_new(1);
+    keymap_bind(keymap_prompt, "enter", 200);
+    node_edit.keymap = keymap_edit;
+    node_edit.prev = NULL;
+    node_prompt.keymap = keymap_prompt;
+    node_prompt.prev = &node_edit;
+    pending = NULL;
+    replay_len = sizeof(replay) / sizeof(int);
+
+    sum = 0;
+    start = _bench_now();
+    for (i = 0; i < ATTO_BENCH_CALLS; i++) {
+        sum += _keymap_dispatch(&node_prompt, &pending, replay[i % replay_len]);
+    }
+    secs_dispatch = _bench_now() - start;
+
+    start = _bench_now();
+    for (i = 0; i < ATTO_BENCH_CALLS; i++) {
+        sum += _keymap_get_key_name(replay[i % replay_len], name);
+    }
+    secs_name = _bench_now() - start;
+
+    ATTO_BENCH_REPORT_CALLS("key_dispatch", ATTO_BENCH_CALLS, secs_dispatch);
+    ATTO_BENCH_REPORT_CALLS("key_name", ATTO_BENCH_CALLS, secs_name);
+    keymap_destroy(keymap_prompt);
+    keymap_destroy(keymap_edit);
+    return sum ? ATTO_RC_OK : ATTO_RC_ERR;
+}
+
+/**
+ * Run all benchmarks
+ */
+int bench_run() {
+    printf("Running all benchmarks\n\n");
+    bench_slexer();
+    bench_lapi();
+    bench_keys();
+    return ATTO_RC_OK;
+}
@@ -11,6 +11,7 @@ buffer_t* buffer_new() {
     buffer->data_size = ATTO_BUFFER_DATA_ALLOC_INCR;
     buffer->blines = (bline_t*)calloc(ATTO_LINE_OFFSET_ALLOC_INCR, sizeof(bline_t));
     buffer->blines_size = ATTO_LINE_OFFSET_ALLOC_INCR;
+    buffer->sspool = (spool_t*)calloc(1, sizeof(spool_t));
     // TODO check calloc retvals
     // TODO prev/next buffer
     return buffer;
@@ -29,7 +30,7 @@ int buffer_read(buffer_t* self, char* filename) {
     // Open file
     f = fopen(filename, "rb");
     if (!f) {
-        ATTO_DEBUG_PRINTF("Could not open file for reading: %s\n", filename);
+        ATTO_TRACE(ATTO_TRACE_ERROR, "Could not open file for reading: %s\n", filename);
         return ATTO_RC_ERR;
     }
 
@@ -43,7 +44,7 @@ int buffer_read(buffer_t* self, char* filename) {
     // Allocate buffer data
     data = (char*)malloc(filesize);
     if (!data) {
-        ATTO_DEBUG_PRINTF("Could not allocate %d bytes for file %s\n", filesize, filename);
+        ATTO_TRACE(ATTO_TRACE_ERROR, "Could not allocate %d bytes for file %s\n", filesize, filename);
         fclose(f);
         return ATTO_RC_ERR;
     }
@@ -74,7 +75,7 @@ int buffer_write(buffer_t* self, char* filename, int is_append) {
     // Open file
     f = fopen(filename, is_append ? "a" : "w");
     if (!f) {
-        ATTO_DEBUG_PRINTF("Could not open file for writing: %s\n", filename);
+        ATTO_TRACE(ATTO_TRACE_ERROR, "Could not open file for writing: %s\n", filename);
         return ATTO_RC_ERR;
     }
 
@@ -115,7 +116,7 @@ int buffer_insert(buffer_t* self, int offset, char* str, int len, int* ret_offse
     int line;
     int col;
 
-    ATTO_DEBUG_PRINTF("[%s]:%d at offset=%d\n", str, len, offset);
+    ATTO_TRACE(ATTO_TRACE_DEBUG, "%d at offset=%d\n", len, offset);
 
     // Sanitize input
     offset = ATTO_MAX(0, ATTO_MIN(offset, self->byte_count));
@@ -178,7 +179,7 @@ int buffer_delete(buffer_t* self, int offset, int len) {
     int col;
     char* delta;
 
-    ATTO_DEBUG_PRINTF("%d at offset=%d\n", len, offset);
+    ATTO_TRACE(ATTO_TRACE_DEBUG, "%d at offset=%d\n", len, offset);
 
     // Nothing to do if byte_count is lt 1
     if (self->byte_count < 1) {
@@ -264,6 +265,56 @@ int buffer_get_line(buffer_t* self, int line, int from_col, char* usebuf, int us
     return buffer_get_substr(self, line_offset, line_len, usebuf, usebuf_len, ret_line, ret_len);
 }
 
+/**
+ * Get a single line from a buffer without copying it. See
+ * buffer_get_substr_view.
+ */
+int buffer_get_line_view(buffer_t* self, int line, int from_col, char** ret_line, int* ret_len, int* ret_version) {
+    int line_offset;
+    int line_len;
+    buffer_get_line_offset_len(self, line, from_col, &line_offset, &line_len);
+    return buffer_get_substr_view(self, line_offset, line_len, ret_line, ret_len, ret_version);
+}
+
+/**
+ * Get a substring of a buffer without copying it. ret_substr points into
+ * the buffer's data and is not NUL-terminated. It is only good until the
+ * next edit; ret_version can be passed to buffer_check_view to make sure.
+ */
+int buffer_get_substr_view(buffer_t* self, int offset, int len, char** ret_substr, int* ret_len, int* ret_version) {
+    // Sanitize inputs
+    offset = ATTO_MIN(ATTO_MAX(offset, 0), self->byte_count);
+    if (len < 0) { // Shortcut for returning til end of buffer
+        len = self->byte_count;
+    }
+    len = ATTO_MIN(ATTO_MAX(len, 0), self->byte_count - offset);
+
+    // Set return values
+    if (ret_substr) {
+        *ret_substr = self->data + offset;
+    }
+    if (ret_len) {
+        *ret_len = len;
+    }
+    if (ret_version) {
+        *ret_version = self->version;
+    }
+
+    return ATTO_RC_OK;
+}
+
+/**
+ * Return ATTO_RC_OK if a view taken at version is still good, else
+ * ATTO_RC_ERR
+ */
+int buffer_check_view(buffer_t* self, int version) {
+    if (version != self->version) {
+        ATTO_TRACE(ATTO_TRACE_ERROR, "Stale view of version %d; buffer is at %d\n", version, self->version);
+        return ATTO_RC_ERR;
+    }
+    return ATTO_RC_OK;
+}
+
 int buffer_get_substr(buffer_t* self, int offset, int len, char* usebuf, int usebuf_len, char** ret_substr, int* ret_len) {
     // Sanitize inputs
     offset = ATTO_MIN(ATTO_MAX(offset, 0), self->byte_count);
@@ -378,10 +429,10 @@ int buffer_search_reverse(buffer_t* self, char* needle, int offset) {
  * Return -1 if not found or if regex is invalid
  */
 int buffer_regex_exec(buffer_t* self, char* regex, int start_offset, int length, int offset, int options, int* ret_len) {
-    pcre* re;
+    cregex_t* re;
     int rc;
     int results[3];
-    re = util_compile_regex(regex);
+    re = util_compile_regex(regex, 0);
     if (!re) {
         return -1;
     }
@@ -391,8 +442,8 @@ int buffer_regex_exec(buffer_t* self, char* regex, int start_offset, int length,
     } else {
         length = ATTO_MIN(ATTO_MAX(length, 0), self->byte_count - start_offset);
     }
-    rc = pcre_exec(re, NULL, self->data + start_offset, length, offset, options, results, 3);
-    pcre_free(re);
+    rc = util_exec_regex(re, self->data + start_offset, length, offset, options, results, 3);
+    util_release_regex(re);
     if (rc < 0) {
         return -1;
     }
@@ -464,6 +515,9 @@ int buffer_add_style(buffer_t* self, srule_t* rule) {
     node = (srule_node_t*)calloc(1, sizeof(srule_node_t));
     node->rule = rule;
     LL_APPEND(self->styles, node);
+    _buffer_update_slexer(self);
+    _buffer_invalidate_styles(self, 0, 0);
+    self->style_sync_line = self->style_sync_end = 0; // Nothing to reuse
     return ATTO_RC_OK;
 }
 
@@ -473,11 +527,39 @@ int buffer_add_style(buffer_t* self, srule_t* rule) {
 int buffer_remove_style(buffer_t* self, srule_t* rule) {
     srule_node_t* elt;
     srule_node_t* tmp;
+
+    // A job in flight still uses rule, which the caller may free next. Its
+    // styles would be invalidated below anyway.
+    if (self->sjob) {
+        _styler_cancel(self->sjob);
+        _sjob_destroy(self->sjob);
+        self->sjob = NULL;
+    }
+
     LL_FOREACH_SAFE(self->styles, elt, tmp) {
         if (elt->rule == rule) {
             LL_DELETE(self->styles, elt);
         }
     }
+    _buffer_update_slexer(self);
+    _buffer_invalidate_styles(self, 0, 0);
+    self->style_sync_line = self->style_sync_end = 0; // Nothing to reuse
+    return ATTO_RC_OK;
+}
+
+/**
+ * Recombine single-line styles after styles change
+ */
+int _buffer_update_slexer(buffer_t* self) {
+    slexer_t* slexer;
+
+    // Make the new lexer first so regexes it shares with the old one are
+    // still in use and stay cached
+    slexer = _slexer_new(self->styles);
+    if (self->slexer) {
+        _slexer_release(self->slexer);
+    }
+    self->slexer = slexer;
     return ATTO_RC_OK;
 }
 
@@ -534,18 +616,19 @@ int buffer_remove_buffer_listener(buffer_t* self, blistener_t* blistener) {
  * Update various metadata of a buffer after it has been edited
  */
 int _buffer_update_metadata(buffer_t* self, int offset, int line, int col, char* delta, int delta_len) {
+    int orig_line_count;
+    int line_delta;
+    int i;
+    orig_line_count = self->line_count;
+    self->version += 1;
     _buffer_update_blines(self, offset, line, col, delta, delta_len);
     _buffer_update_marks(self, offset, delta_len);
-    _buffer_update_styles(self, line, delta, delta_len, 1);
+    line_delta = self->line_count - orig_line_count;
+    for (i = line; i <= line + ATTO_MAX(line_delta, 0) && i < self->line_count; i++) {
+        self->blines[i].version = self->version; // Text is now newer than styles
+    }
+    _buffer_invalidate_styles(self, line, line_delta);
     _buffer_notify_listeners(self, line, col, delta, delta_len);
-
-/*
-char* all;
-buffer_get_substr(self, 0, -1, NULL, 0, &all, NULL);
-ATTO_DEBUG_PRINTF("buffer_data=[%s]\n", all);
-free(all);
-*/
-
     return ATTO_RC_OK;
 }
 
@@ -581,7 +664,7 @@ int _buffer_update_blines(buffer_t* self, int dirty_offset, int dirty_line, int
 
     // Count newlines in delta
     newline_delta = util_memchr_count('\n', delta, abs(delta_len)) * (delta_len > 0 ? 1 : -1);
-ATTO_DEBUG_PRINTF("newline_delta=%d\n", newline_delta);
+    ATTO_TRACE(ATTO_TRACE_SPEW, "newline_delta=%d\n", newline_delta);
 
     // If there are no newlines in delta...
     if (newline_delta == 0) {
@@ -594,8 +677,7 @@ ATTO_DEBUG_PRINTF("newline_delta=%d\n", newline_delta);
         }
 
         // Done!
-goto winners;
-        //return ATTO_RC_OK;
+        return ATTO_RC_OK;
     }
 
     // If we get here, it means newlines are present in the delta
@@ -611,35 +693,47 @@ goto winners;
             sizeof(bline_t) * self->blines_size
         );
     }
-ATTO_DEBUG_PRINTF("orig_line_count=%d new_line_count=%d\n", orig_line_count, self->line_count);
+    ATTO_TRACE(ATTO_TRACE_SPEW, "orig_line_count=%d new_line_count=%d\n", orig_line_count, self->line_count);
 
     // 2. Shift blines up or down
     offset = self->blines[dirty_line].offset; // Save orig offset
     shift_dest = newline_delta > 0 ? (dirty_line + 1 + newline_delta) : (dirty_line);
     shift_src = newline_delta > 0 ? (dirty_line + 1) : (dirty_line - newline_delta);
     shift_size = newline_delta > 0 ? (orig_line_count - dirty_line - 1) : (orig_line_count - dirty_line + newline_delta);
+    if (newline_delta < 0) {
+        // Lines shifted over are gone; give back their sspans
+        for (line = shift_dest; line < shift_src; line++) {
+            _spool_free(self->sspool, self->blines[line].sspans, self->blines[line].sspans_size);
+        }
+    }
     if (shift_size > 0) {
         memmove(
             self->blines + shift_dest,
             self->blines + shift_src,
             sizeof(bline_t) * shift_size
         );
-ATTO_DEBUG_PRINTF("shifted bline block of size %d @ %d to %d\n", shift_size, shift_src, shift_dest);
+        ATTO_TRACE(ATTO_TRACE_SPEW, "shifted bline block of size %d @ %d to %d\n", shift_size, shift_src, shift_dest);
     }
 
-    // 3. Alloc sspans for new lines
+    // 3. Clear sspans of new lines and of slots vacated by the shift. These
+    // still point at sspans of lines that moved. sspans are allocated when
+    // a line is first styled. The last new line ends where dirty_line used
+    // to, so new lines take on the rule dirty_line left open. Restyling
+    // compares against that to tell when it has caught up (see
+    // _buffer_style_sync_skip).
     if (newline_delta > 0) {
         line = dirty_line + 1;
-        line_stop = line + newline_delta + 1;
+        line_stop = line + newline_delta;
     } else {
-        line = orig_line_count;
-        line_stop = self->blines_size;
+        line = orig_line_count + newline_delta;
+        line_stop = orig_line_count;
     }
-ATTO_DEBUG_PRINTF("resetting spans from=%d until=%d\n", line, line_stop);
+    ATTO_TRACE(ATTO_TRACE_SPEW, "resetting spans from=%d until=%d\n", line, line_stop);
     for (; line < line_stop; line++) {
-        self->blines[line].sspans_size = ATTO_SSPAN_RANGE_ALLOC_INCR;
-        self->blines[line].sspans = (sspan_t*)calloc(ATTO_SSPAN_RANGE_ALLOC_INCR, sizeof(sspan_t));
+        self->blines[line].sspans = NULL;
+        self->blines[line].sspans_size = 0;
         self->blines[line].sspans_len = 0;
+        self->blines[line].open_rule = newline_delta > 0 ? self->blines[dirty_line].open_rule : NULL;
     }
 
     // 4. Invalidate styles
@@ -686,10 +780,6 @@ ATTO_DEBUG_PRINTF("resetting spans from=%d until=%d\n", line, line_stop);
     // Set length of last line
     self->blines[line].length = self->byte_count - self->blines[line].offset;
 
-winners: for (line = 0; line < self->line_count; line++) {
-ATTO_DEBUG_PRINTF("bline[%d] o=%d l=%d sspans_len=%d\n", line, self->blines[line].offset, self->blines[line].length, self->blines[line].sspans_len);
-}
-
     return ATTO_RC_OK;
 }
 
@@ -712,274 +802,400 @@ int _buffer_update_marks(buffer_t* self, int offset, int delta) {
 }
 
 /**
- * Apply style rules to lines after dirty_line
+ * Make sure lines before until_line are styled
+ * Lines past until_line are left for later (see _main_get_input)
+ */
+int buffer_style(buffer_t* self, int until_line) {
+    until_line = ATTO_MIN(until_line, self->line_count);
+    if (self->style_line >= until_line) {
+        return ATTO_RC_OK;
+    }
+    return _buffer_update_styles(self, until_line);
+}
+
+/**
+ * Like buffer_style, but styling happens on the styler thread. Finished
+ * results are applied on the next call, so keep calling (see
+ * _main_get_input_while_styling) until style_line reaches until_line.
+ */
+int _buffer_style_async(buffer_t* self, int until_line) {
+    // Apply results of a finished job
+    if (self->sjob && _styler_is_done(self->sjob)) {
+        _buffer_apply_sjob(self, self->sjob);
+        _sjob_destroy(self->sjob);
+        self->sjob = NULL;
+    }
+
+    // Submit a new job if there is more to style
+    until_line = ATTO_MIN(until_line, self->line_count);
+    if (!self->sjob && self->style_line < until_line) {
+        self->sjob = _sjob_new(self, until_line);
+        self->sjob_edit_line = until_line;
+        _styler_submit(self->sjob);
+    }
+
+    return ATTO_RC_OK;
+}
+
+/**
+ * Mark styles stale starting at line after an edit that changed line count
+ * by line_delta. Nothing is restyled here; see buffer_style.
+ */
+int _buffer_invalidate_styles(buffer_t* self, int line, int line_delta) {
+    int changed_end;
+
+    // Lines line thru changed_end hold edited text
+    changed_end = line + ATTO_MAX(line_delta, 0);
+
+    if (line < self->style_line) {
+        // Lines after the edit that were styled become a sync window. They
+        // are reused as-is once restyling reaches them and finds the same
+        // styles it found before.
+        self->style_sync_line = changed_end + 1;
+        self->style_sync_end = self->style_line + line_delta;
+        self->style_line = line;
+    } else if (line < self->style_sync_end) {
+        // Edit is inside or before the sync window; keep the part after it
+        if (line < self->style_sync_line) {
+            self->style_sync_line = ATTO_MAX(self->style_sync_line + line_delta, changed_end + 1);
+        } else {
+            self->style_sync_line = changed_end + 1;
+        }
+        self->style_sync_end += line_delta;
+    }
+
+    // Results of a pending job are no good from line on
+    self->sjob_edit_line = ATTO_MIN(self->sjob_edit_line, line);
+
+    // Clamp to line_count
+    self->style_line = ATTO_MIN(self->style_line, self->line_count);
+    self->style_sync_end = ATTO_MIN(self->style_sync_end, self->line_count);
+    self->style_sync_line = ATTO_MIN(self->style_sync_line, self->style_sync_end);
+
+    ATTO_TRACE(ATTO_TRACE_SPEW, "style_line=%d sync=%d-%d\n", self->style_line, self->style_sync_line, self->style_sync_end);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Apply style rules to lines from self->style_line until until_line
  */
-int _buffer_update_styles(buffer_t* self, int dirty_line, char* delta, int delta_len, int bail_on_matching_style) {
+int _buffer_update_styles(buffer_t* self, int until_line) {
     int line;
     bline_t* bline;
-    srule_node_t* node;
-    int* char_attrs;
-    int char_attrs_size;
+    spainter_t painter;
     srule_t* open_rule;
+    srule_t* prev_open_rule;
+
+    // Update styles starting from style_line
+    memset(&painter, 0, sizeof(spainter_t));
+    painter.pool = self->sspool;
+    line = self->style_line;
+    open_rule = line > 0 ? self->blines[line - 1].open_rule : NULL;
+
+    ATTO_TRACE(ATTO_TRACE_SPEW, "style_line=%d until_line=%d open_rule=%p\n", line, until_line, open_rule);
+    for (; line < until_line; line++) {
+        bline = (self->blines + line);
+        prev_open_rule = bline->open_rule;
+        _buffer_style_line(self->styles, self->slexer, self->data + bline->offset, bline, open_rule, &painter);
+        bline->sspans_version = self->version;
+        ATTO_TRACE(ATTO_TRACE_SPEW, "line=%d sspans_len=%d open_rule=%p\n", line, bline->sspans_len, bline->open_rule);
+        line = _buffer_style_sync_skip(self, line, prev_open_rule);
+        open_rule = self->blines[line].open_rule;
+    }
+
+    // Remember how far we got
+    self->style_line = line;
+
+    _spainter_free(&painter);
+
+    return ATTO_RC_OK;
+}
+
+/**
+ * Style a single line of text, data, with styles given the rule left open
+ * by the previous line. If slexer is set, it stands in for the single-line
+ * rules it combines from the head of styles. Sets bline->sspans and
+ * bline->open_rule. Spans are painted with painter, which is reused from
+ * line to line. Does not touch the buffer, so this is safe to call from the
+ * styler thread. Returns 1 if the line's styles changed, else 0.
+ */
+int _buffer_style_line(srule_node_t* styles, slexer_t* slexer, char* data, bline_t* bline, srule_t* open_rule, spainter_t* painter) {
+    srule_node_t* node;
     srule_t* rule;
     int matches[3];
     int style_from_col;
-    int col;
     int re_offset;
     int multi_start;
+    int lexed_count;
     mark_t* range_start;
     mark_t* range_end;
-    int attr_col;
     int rc;
-    int line_style_changed;
-    int sspans_len;
 
-    // Update styles starting from dirty_line
-    char_attrs_size = 0;
-    char_attrs = NULL;
-    open_rule = dirty_line > 0 ? self->blines[dirty_line - 1].open_rule : NULL;
+    _spainter_reset(painter, bline->length);
+    style_from_col = 0;
 
-ATTO_DEBUG_PRINTF("line[%d].open_rule = %p\n", dirty_line - 1, open_rule);
-    for (line = dirty_line; line < self->line_count; line++) {
-        bline = (self->blines + line);
-        style_from_col = 0;
+    // Nothing to style if length is zero; open_rule carries over
+    if (bline->length < 1) {
+        bline->open_rule = open_rule;
+        goto make_sspans;
+    }
 
-        // Nothing to style if length is zero
-        if (bline->length < 1) {
-            if (open_rule && !bline->open_rule) {
-                bline->open_rule = open_rule;
+    // If there's an open rule, see if it ends on this line
+    if (open_rule) {
+        // See if open_rule ends on this line
+        if (open_rule->type == ATTO_SRULE_TYPE_MULTI) {
+            // See if cregex_end is on this line
+            if (util_exec_regex(open_rule->cregex_end, data, bline->length, 0, 0, matches, 3) >= 0) {
+                // Match!
+                // matches[1] will be set by util_exec_regex
+            } else {
+                // No match
+                matches[1] = -1;
             }
-            goto reduce_char_attrs;
-        }
-
-        // Expand char_attrs if needed
-        if (char_attrs_size < bline->length) {
-ATTO_DEBUG_PRINTF("%s\n", "resized char_attrs");
-            char_attrs_size = bline->length;
-            if (char_attrs) {
-                char_attrs = (int*)realloc(char_attrs, char_attrs_size * sizeof(int));
+        } else if (open_rule->type == ATTO_SRULE_TYPE_RANGE) {
+            // See if range_end is on this line
+            range_end = open_rule->range_start->offset < open_rule->range_end->offset ? open_rule->range_end : open_rule->range_start;
+            if (range_end->offset >= bline->offset
+                && range_end->offset < bline->offset + bline->length
+            ) {
+                // Match!
+                matches[1] = range_end->col;
             } else {
-                char_attrs = (int*)malloc(char_attrs_size * sizeof(int));
+                // No match
+                matches[1] = -1;
             }
         }
-        memset(char_attrs, 0, sizeof(int) * char_attrs_size);
-
-        // If there's an open rule, see if it ends on this line
-        if (open_rule) {
-ATTO_DEBUG_PRINTF("%s\n", "open_rule!");
-            // See if open_rule ends on this line
-            if (open_rule->type == ATTO_SRULE_TYPE_MULTI) {
-                // See if cregex_end is on this line
-                if (pcre_exec(open_rule->cregex_end, NULL, self->data + bline->offset, bline->length, 0, 0, matches, 3) >= 0) {
-                    // Match!
-                    // matches[1] will be set by pcre_exec
-                } else {
-                    // No match
-                    matches[1] = -1;
-                }
-            } else if (open_rule->type == ATTO_SRULE_TYPE_RANGE) {
-                // See if range_end is on this line
-                range_end = open_rule->range_start->offset < open_rule->range_end->offset ? open_rule->range_end : open_rule->range_start;
-                if (range_end->offset >= bline->offset
-                    && range_end->offset < bline->offset + bline->length
-                ) {
-                    // Match!
-                    matches[1] = range_end->col;
-                } else {
-                    // No match
-                    matches[1] = -1;
-                }
-            }
 
-            // If we have a match:
-            //    This means open_rule ends on this line. We will allow other rules to apply, but we need to
-            //    make sure we don't mess with the beginning of the line that is styled with open_rule.
-            //
-            // If we do not have a match:
-            //    This means open_rule does not end on this and will remain open. We take a shortcut in this
-            //    case and style the entire line with open_rule.
-            if (matches[1] != -1) {
-                // We have a match!
-
-                // Style attrs up until matches[1]
-ATTO_DEBUG_PRINTF("%s\n", "open_rule found");
-                for (col = 0; col < matches[1]; col++) char_attrs[col] = open_rule->attrs;
-                style_from_col = matches[1]; // Don't let other rules mess with chars before matches[1]
-
-                // Close open_rule
-                bline->open_rule = NULL;
-                open_rule = NULL;
-            } else {
-                // No match
+        // If we have a match:
+        //    This means open_rule ends on this line. We will allow other rules to apply, but we need to
+        //    make sure we don't mess with the beginning of the line that is styled with open_rule.
+        //
+        // If we do not have a match:
+        //    This means open_rule does not end on this and will remain open. We take a shortcut in this
+        //    case and style the entire line with open_rule.
+        if (matches[1] != -1) {
+            // We have a match!
+
+            // Style attrs up until matches[1]
+            _spainter_paint(painter, 0, matches[1], open_rule->attrs);
+            style_from_col = matches[1]; // Don't let other rules mess with chars before matches[1]
+
+            // Close open_rule
+            bline->open_rule = NULL;
+            open_rule = NULL;
+        } else {
+            // No match
 
-                // This entire is styled by open_rule
-ATTO_DEBUG_PRINTF("%s\n", "open_rule not found");
-                for (col = 0; col < bline->length; col++) char_attrs[col] = open_rule->attrs;
+            // This entire is styled by open_rule
+            _spainter_paint(painter, 0, bline->length, open_rule->attrs);
 
-                // Leave open_rule open
-                bline->open_rule = open_rule;
+            // Leave open_rule open
+            bline->open_rule = open_rule;
 
-                // We're done styling this line
-                goto reduce_char_attrs;
-            }
-        } else if (bline->open_rule) {
-            bline->open_rule = NULL;
+            // We're done styling this line
+            goto make_sspans;
         }
+    } else if (bline->open_rule) {
+        bline->open_rule = NULL;
+    }
 
-        // Apply style rules
-        LL_FOREACH(self->styles, node) {
-            re_offset = 0;
-            rule = node->rule;
-            if (rule->type == ATTO_SRULE_TYPE_SINGLE) {
-                // Apply single line style rule
-                while (re_offset < bline->length) {
-                    if ((rc = pcre_exec(rule->cregex, NULL, self->data + bline->offset, bline->length, re_offset, 0, matches, 3)) < 0) {
-if (re_offset > 0) ATTO_DEBUG_PRINTF("No match for rule[%s] at offset=%d len=%d rc=%d\n", rule->regex, re_offset, bline->length - re_offset, rc);
-                        // No match
-                        break;
-                    }
-                    // Match! Style matches[0] until matches[1] with rule->attrs as long as we're past style_from_col
-                    if (matches[0] >= style_from_col) {
-ATTO_DEBUG_PRINTF("This rule touched: %s [%d:%d] with %d\n", rule->regex, matches[0], matches[1] - 1, rule->attrs);
-                        for (col = matches[0]; col < matches[1]; col++) char_attrs[col] = rule->attrs;
-                    }
-                    re_offset = matches[1]; // Advance regex cursor
-                }
-            } else if (rule->type == ATTO_SRULE_TYPE_MULTI) {
-                // Apply multi line style rule
-                while (re_offset < bline->length) {
-                    if (pcre_exec(rule->cregex, NULL, self->data + bline->offset, bline->length, re_offset, 0, matches, 3) < 0) {
-                        // No match
-                        break;
-                    }
-                    // Match! Are we before style_from_col?
-                    if (matches[0] < style_from_col) {
-                        // This part of the line is already styled; continue on
-                        re_offset = matches[0] + 1; // Advance regex cursor
-                        continue;
-                    }
-                    // Now find cregex_end
-                    multi_start = matches[0];
-                    re_offset = matches[1]; // Advance regex_cursor
-                    if (pcre_exec(rule->cregex_end, NULL, self->data + bline->offset, bline->length, re_offset, 0, matches, 3) < 0) {
-                        // No match for cregex_end; it might end on another line
-
-                        // Style the rest of the line with rule
-ATTO_DEBUG_PRINTF("No match for cregex_end, setting line[%d].open_rule to %p\n", line, rule);
-if (bline->length > 100) {
-ATTO_DEBUG_PRINTF("big len=%d\n", bline->length);
-endwin();
-exit(1);
-}
-                        for (col = multi_start; col < bline->length; col++) char_attrs[col] = rule->attrs;
-
-                        // Leave rule open
-                        open_rule = rule;
-                        bline->open_rule = rule;
-
-                        // We're done styling this line
-                        goto reduce_char_attrs;
-                    } else {
-                        // Match! Style multi_start until matches[1] with rule->attrs
-ATTO_DEBUG_PRINTF("%s\n", "cregex -> cregex_end found");
-                        for (col = multi_start; col < matches[1]; col++) char_attrs[col] = rule->attrs;
-                        re_offset = matches[1]; // Advance regex cursor
-                    }
+    // Apply the single-line style rules at the head of styles in one pass
+    lexed_count = 0;
+    if (slexer) {
+        _slexer_paint(slexer, data, bline->length, style_from_col, painter);
+    }
+
+    // Apply style rules
+    LL_FOREACH(styles, node) {
+        re_offset = 0;
+        rule = node->rule;
+        if (slexer && lexed_count < slexer->rules_len) {
+            // Already applied above
+            lexed_count += 1;
+            continue;
+        }
+        if (rule->type == ATTO_SRULE_TYPE_SINGLE) {
+            // Apply single line style rule
+            while (re_offset < bline->length) {
+                if ((rc = util_exec_regex(rule->cregex, data, bline->length, re_offset, 0, matches, 3)) < 0) {
+                    // No match
+                    break;
                 }
-            } else if (rule->type == ATTO_SRULE_TYPE_RANGE) {
-                // Apply range style rule
-
-                // Account for range_end before range_start
-                range_start = rule->range_start->offset < rule->range_end->offset ? rule->range_start : rule->range_end;
-                range_end = range_start == rule->range_start ? rule->range_end : rule->range_start;
-                if (range_start->offset >= bline->offset
-                    && range_start->offset < bline->offset + bline->length
-                    // TODO Should we disallow a range to apply if range_start->offset is < style_from_col?
-                ) {
-                    // Range starts on this line!
-                    if (range_end->offset < bline->offset + bline->length) {
-                        // Range ends on this line! Style range_start->col until range_end->col with rule->attrs
-ATTO_DEBUG_PRINTF("%s\n", "range -> range_end found");
-                        for (col = range_start->col; col < range_end->col; col++) char_attrs[col] = rule->attrs;
-                    } else {
-                        // Range ends on another line
-
-                        // Style the rest of the line with rule
-ATTO_DEBUG_PRINTF("%s\n", "range_end not found");
-                        for (col = range_start->col; col < bline->length; col++) char_attrs[col] = rule->attrs;
-
-                        // Leave rule open
-                        open_rule = rule;
-                        bline->open_rule = rule;
-
-                        // We're done styling this line
-                        goto reduce_char_attrs;
-                    }
+                // Match! Style matches[0] until matches[1] with rule->attrs as long as we're past style_from_col
+                if (matches[0] >= style_from_col) {
+                    _spainter_paint(painter, matches[0], matches[1], rule->attrs);
                 }
+                re_offset = matches[1]; // Advance regex cursor
             }
-        }
-ATTO_DEBUG_PRINTF("line=%d char_attrs[\n", line);
-for (col = 0; col < bline->length; col++) ATTO_DEBUG_PRINTF("    %d\n", char_attrs[col]);
-ATTO_DEBUG_PRINTF("%s\n", "]");
-
-        // Now we need to convert char_attrs to an array of sspan_t
-        // I.e., AAAABBBCDDDDDDDD -> {4,A},{3,B},{1,C},{8,D}
-reduce_char_attrs: (void)self;
-        attr_col = 0;
-        sspans_len = 0;
-        line_style_changed = 0;
-        for (col = 1; col < bline->length + 1; col++) {
-            if (col == bline->length || char_attrs[attr_col] != char_attrs[col]) {
-                // Style attr_col thru col-1 with char_attrs[attr_col]
-                sspans_len += 1;
-
-                // Resize sspans if needed
-                if (bline->sspans_size < sspans_len) {
-                    bline->sspans_size += ATTO_SSPAN_RANGE_ALLOC_INCR;
-                    bline->sspans = (sspan_t*)realloc(bline->sspans, sizeof(sspan_t) * bline->sspans_size);
-                    line_style_changed = 1;
+        } else if (rule->type == ATTO_SRULE_TYPE_MULTI) {
+            // Apply multi line style rule
+            while (re_offset < bline->length) {
+                if (util_exec_regex(rule->cregex, data, bline->length, re_offset, 0, matches, 3) < 0) {
+                    // No match
+                    break;
                 }
-
-                // Fill in span
-                if (bline->sspans[sspans_len - 1].length != col - attr_col
-                    || bline->sspans[sspans_len - 1].attrs != char_attrs[attr_col]
-                ) {
-                    bline->sspans[sspans_len - 1].length = col - attr_col;
-                    bline->sspans[sspans_len - 1].attrs = char_attrs[attr_col];
-                    line_style_changed = 1;
+                // Match! Are we before style_from_col?
+                if (matches[0] < style_from_col) {
+                    // This part of the line is already styled; continue on
+                    re_offset = matches[0] + 1; // Advance regex cursor
+                    continue;
                 }
+                // Now find cregex_end
+                multi_start = matches[0];
+                re_offset = matches[1]; // Advance regex_cursor
+                if (util_exec_regex(rule->cregex_end, data, bline->length, re_offset, 0, matches, 3) < 0) {
+                    // No match for cregex_end; it might end on another line
+
+                    // Style the rest of the line with rule
+                    _spainter_paint(painter, multi_start, bline->length, rule->attrs);
 
-                // Advance attr_col
-                attr_col = col;
+                    // Leave rule open
+                    bline->open_rule = rule;
+
+                    // We're done styling this line
+                    goto make_sspans;
+                } else {
+                    // Match! Style multi_start until matches[1] with rule->attrs
+                    _spainter_paint(painter, multi_start, matches[1], rule->attrs);
+                    re_offset = matches[1]; // Advance regex cursor
+                }
             }
-        }
+        } else if (rule->type == ATTO_SRULE_TYPE_RANGE) {
+            // Apply range style rule
+
+            // Account for range_end before range_start
+            range_start = rule->range_start->offset < rule->range_end->offset ? rule->range_start : rule->range_end;
+            range_end = range_start == rule->range_start ? rule->range_end : rule->range_start;
+            if (range_start->offset >= bline->offset
+                && range_start->offset < bline->offset + bline->length
+                // TODO Should we disallow a range to apply if range_start->offset is < style_from_col?
+            ) {
+                // Range starts on this line!
+                if (range_end->offset < bline->offset + bline->length) {
+                    // Range ends on this line! Style range_start->col until range_end->col with rule->attrs
+                    _spainter_paint(painter, range_start->col, range_end->col, rule->attrs);
+                } else {
+                    // Range ends on another line
 
-        if (sspans_len != bline->sspans_len) {
-            bline->sspans_len = sspans_len;
-            line_style_changed = 1;
-        }
+                    // Style the rest of the line with rule
+                    _spainter_paint(painter, range_start->col, bline->length, rule->attrs);
 
-        if (line != dirty_line && bail_on_matching_style && bline->sspans_len > 0 && !line_style_changed) {
-            // TODO fix this or use exact comparison instead of hash
-            // This line is styled the same way as it was before.
-            // We're done!
-            break;
+                    // Leave rule open
+                    bline->open_rule = rule;
+
+                    // We're done styling this line
+                    goto make_sspans;
+                }
+            }
         }
+    }
 
-char* bull;
-buffer_get_line(self, line, 0, NULL, 0, &bull, NULL);
-ATTO_DEBUG_PRINTF("line=%d str=[%s] blinep=%p spansp=%p sspans[\n", line, bull, bline, bline->sspans);
-for (col = 0; col < sspans_len; col++) ATTO_DEBUG_PRINTF("    len=%d attrs=%d\n", bline->sspans[col].length, bline->sspans[col].attrs);
-ATTO_DEBUG_PRINTF("%s\n", "]");
-free(bull);
+    // Copy painted runs to bline
+make_sspans:
+    return _spainter_to_bline(painter, bline);
+}
+
+/**
+ * Called after line is restyled. prev_open_rule is the rule line left open
+ * before it was restyled. If line's text is unchanged since then, or it is
+ * the edited line right before the sync window, and it still leaves the
+ * same rule open, every line after it in the window would come out styled
+ * the same as before. In that case return the end of the window as the
+ * last line styled. Else return line.
+ */
+int _buffer_style_sync_skip(buffer_t* self, int line, srule_t* prev_open_rule) {
+    if (line >= self->style_sync_line - 1
+        && line < self->style_sync_end
+        && self->blines[line].open_rule == prev_open_rule
+    ) {
+        ATTO_TRACE(ATTO_TRACE_SPEW, "synced at line=%d skipping to %d\n", line, self->style_sync_end);
+        line = ATTO_MAX(line, self->style_sync_end - 1);
+        self->style_sync_line = self->style_sync_end;
+    }
+    return line;
+}
 
+/**
+ * Copy sspans onto line. Returns 1 if they differ from what was there,
+ * else 0.
+ */
+int _buffer_set_sspans(buffer_t* self, int line, sspan_t* sspans, int sspans_len) {
+    bline_t* bline;
+    sspan_t* new_sspans;
+    int new_size;
+    bline = self->blines + line;
+    if (sspans_len == bline->sspans_len
+        && (sspans_len < 1 || memcmp(bline->sspans, sspans, sizeof(sspan_t) * sspans_len) == 0)
+    ) {
+        return 0;
+    }
+    if (bline->sspans_size < sspans_len) {
+        new_sspans = _spool_alloc(self->sspool, sspans_len, &new_size);
+        _spool_free(self->sspool, bline->sspans, bline->sspans_size);
+        bline->sspans = new_sspans;
+        bline->sspans_size = new_size;
     }
+    if (sspans_len > 0) {
+        memcpy(bline->sspans, sspans, sizeof(sspan_t) * sspans_len);
+    }
+    bline->sspans_len = sspans_len;
+    return 1;
+}
 
-    // Free char_attrs
-    if (char_attrs) {
-        free(char_attrs);
+/**
+ * Apply results of a finished styling job. Only lines that were not edited
+ * since the job's snapshot was taken are applied.
+ */
+int _buffer_apply_sjob(buffer_t* self, sjob_t* sjob) {
+    int line;
+    int until_line;
+    srule_t* prev_open_rule;
+    bline_t* result;
+
+    until_line = ATTO_MIN(sjob->until_line, self->sjob_edit_line);
+    ATTO_TRACE(ATTO_TRACE_SPEW, "version=%d/%d style_line=%d until_line=%d\n", sjob->version, self->version, self->style_line, until_line);
+    for (line = self->style_line; line < until_line; line++) {
+        result = sjob->blines + (line - sjob->from_line);
+        prev_open_rule = self->blines[line].open_rule;
+        _buffer_set_sspans(self, line, result->sspans, result->sspans_len);
+        self->blines[line].open_rule = _sjob_get_orig_rule(sjob, result->open_rule);
+        self->blines[line].sspans_version = sjob->version;
+        line = _buffer_style_sync_skip(self, line, prev_open_rule);
     }
+    self->style_line = line;
+    return ATTO_RC_OK;
+}
 
+/**
+ * Give back sspan storage that lines outside keep_from thru keep_until do
+ * not use: arrays of unstyled lines are freed and oversized arrays are
+ * moved to the smallest size class that fits. Styles are kept as they are.
+ */
+int _buffer_compact_sspans(buffer_t* self, int keep_from, int keep_until) {
+    int line;
+    bline_t* bline;
+    sspan_t* sspans;
+    int sspans_size;
+    for (line = 0; line < self->line_count; line++) {
+        if (line == keep_from) {
+            line = keep_until - 1;
+            continue;
+        }
+        bline = self->blines + line;
+        if (!bline->sspans) {
+            continue;
+        } else if (bline->sspans_len < 1) {
+            _spool_free(self->sspool, bline->sspans, bline->sspans_size);
+            bline->sspans = NULL;
+            bline->sspans_size = 0;
+        } else if (_spool_get_class(bline->sspans_len) != _spool_get_class(bline->sspans_size)) {
+            sspans = _spool_alloc(self->sspool, bline->sspans_len, &sspans_size);
+            memcpy(sspans, bline->sspans, sizeof(sspan_t) * bline->sspans_len);
+            _spool_free(self->sspool, bline->sspans, bline->sspans_size);
+            bline->sspans = sspans;
+            bline->sspans_size = sspans_size;
+        }
+    }
     return ATTO_RC_OK;
 }
 
@@ -99,7 +99,7 @@ int _bview_update_viewport_dimension(bview_t* self, int line, int viewport_h, in
  */
 int bview_update(bview_t* self) {
     int view_line;
-    char* line_str;
+    char* line_data;
     int line_num;
     char* line_num_str;
     int line_len;
@@ -112,17 +112,22 @@ int bview_update(bview_t* self) {
     int i;
     int offset;
     int length;
+    int visible_len;
+    int from_col;
+    int to_col;
     sspan_t* span;
 
     // TODO determine min display geom and bail if too small
 
     is_viewport_x_on_cursor_only = 1; // TODO make configurable
-    line_str = (char*)calloc(self->viewport_w + 1, sizeof(char));
     line_num_str = (char*)calloc(self->lines_width + 1, sizeof(char));
 
     // Make line_format
     line_format[1] = '0' + ATTO_MAX(ATTO_MIN(self->lines_width, 9), 0);
 
+    // Style lines in viewport plus some look-ahead on the styler thread
+    _buffer_style_async(self->buffer, self->viewport_y + self->viewport_h + ATTO_STYLE_LOOKAHEAD_LINES);
+
     // Render each line in viewport
     for (view_line = 0; view_line < self->viewport_h; view_line++) {
         line_num = self->viewport_y + view_line;
@@ -130,14 +135,15 @@ int bview_update(bview_t* self) {
         bline = NULL;
         if (line_num < 0 || line_num >= self->buffer->line_count) {
             // No line exists here
-            memset(line_str, ' ', self->viewport_w);
+            line_data = NULL;
+            line_len = 0;
             memset(line_num_str, ' ', self->lines_width);
             line_num_str[self->lines_width - 1] = '~';
             margin_left = ' ';
             margin_right = ' ';
         } else {
-            // TODO styles
-            buffer_get_line(self->buffer, line_num, viewport_x, line_str, self->viewport_w, NULL, &line_len);
+            // Render straight from buffer data; nothing below edits the buffer
+            buffer_get_line_view(self->buffer, line_num, viewport_x, &line_data, &line_len, NULL);
             bline = (self->buffer->blines + line_num);
             memset(line_num_str, ' ', self->lines_width);
             snprintf(line_num_str, self->lines_width + 1, line_format, line_num + 1); // TODO 0-indexed lines option
@@ -151,16 +157,9 @@ int bview_update(bview_t* self) {
 
         // TODO handle tab characters
 
-        // Replace non-ascii characters with '?'
-        // Replace tabs with tabs
-        for (i = 0; i < self->viewport_w; i++) {
-            if (line_str[i] != '\0' && (line_str[i] < 0x20 || line_str[i] > 0x7e)) {
-                *(line_str + i) = '?';
-            }
-        }
-
-        // Render line
-        if (bline && bline->sspans_len > 0) {
+        // Render line; styles computed for older text are not used
+        visible_len = ATTO_MIN(line_len, self->viewport_w);
+        if (bline && bline->sspans_len > 0 && bline->sspans_version >= bline->version) {
             offset = 0;
             for (i = 0; i < bline->sspans_len; i++) {
                 span = (bline->sspans + i);
@@ -168,33 +167,20 @@ int bview_update(bview_t* self) {
                     // Span not yet in viewport; skip
                     offset += span->length;
                     continue;
-                } else if (offset >= viewport_x + self->viewport_w) {
+                } else if (offset >= viewport_x + visible_len) {
                     // Span past end of viewport; break
                     break;
                 }
-ATTO_DEBUG_PRINTF("render blinep=%p spansp=%p line=%d span=%d attrs=%d\n", bline, bline->sspans, line_num, i, span->attrs);
+                from_col = ATTO_MAX(offset - viewport_x, 0);
+                to_col = ATTO_MIN(offset + span->length - viewport_x, visible_len);
                 wattrset(self->win_buffer, span->attrs);
-                mvwaddnstr(
-                    self->win_buffer,
-                    view_line,
-                    ATTO_MAX(offset - viewport_x, 0),
-                    line_str + ATTO_MAX(offset - viewport_x, 0),
-                    span->length - (
-                        viewport_x > offset
-                        ? viewport_x - offset
-                        : (offset + span->length > viewport_x + self->viewport_w
-                            ? offset + span->length - viewport_x + self->viewport_w
-                            : 0
-                        )
-                    )
-                );
+                _bview_render_text(self, view_line, from_col, line_data + from_col, to_col - from_col);
                 offset += span->length;
             }
             wattrset(self->win_buffer, 0);
         } else {
-if (bline) ATTO_DEBUG_PRINTF("render unstyled line=%d\n", line_num);
             wattrset(self->win_buffer, 0);
-            mvwaddnstr(self->win_buffer, view_line, 0, line_str, self->viewport_w);
+            _bview_render_text(self, view_line, 0, line_data, visible_len);
         }
         wclrtoeol(self->win_buffer);
 
@@ -205,14 +191,14 @@ if (bline) ATTO_DEBUG_PRINTF("render unstyled line=%d\n", line_num);
         wclrtoeol(self->win_margin_right);
     }
 
-    snprintf(
-        line_str,
-        self->viewport_w,
+    mvwprintw(
+        self->win_caption,
+        0,
+        0,
         "[%c] %s",
         self->buffer->has_unsaved_changes ? '*' : '=',
         self->buffer->filename ? self->buffer->filename : "<untitled>"
     );
-    mvwaddnstr(self->win_caption, 0, 0, line_str, self->width);
     wclrtoeol(self->win_caption);
 
     wnoutrefresh(self->win_caption);
@@ -221,7 +207,6 @@ if (bline) ATTO_DEBUG_PRINTF("render unstyled line=%d\n", line_num);
     wnoutrefresh(self->win_margin_left);
     wnoutrefresh(self->win_margin_right);
 
-    free(line_str);
     free(line_num_str);
 
     // Also update child
@@ -232,6 +217,31 @@ if (bline) ATTO_DEBUG_PRINTF("render unstyled line=%d\n", line_num);
     return ATTO_RC_OK;
 }
 
+/**
+ * Render len chars of data at col on view_line, showing non-printable chars
+ * as '?'. data may be borrowed from a buffer so it is never modified.
+ */
+int _bview_render_text(bview_t* self, int view_line, int col, char* data, int len) {
+    int i;
+    int run_start;
+    wmove(self->win_buffer, view_line, col);
+    run_start = 0;
+    for (i = 0; i < len; i++) {
+        if ((unsigned char)data[i] >= 0x20 && (unsigned char)data[i] <= 0x7e) {
+            continue;
+        }
+        if (i > run_start) {
+            waddnstr(self->win_buffer, data + run_start, i - run_start);
+        }
+        waddch(self->win_buffer, '?');
+        run_start = i + 1;
+    }
+    if (i > run_start) {
+        waddnstr(self->win_buffer, data + run_start, i - run_start);
+    }
+    return ATTO_RC_OK;
+}
+
 /**
  * Show cursor
  */
@@ -447,6 +457,7 @@ keymap_t* bview_keymap_pop(bview_t* self) {
         DL_DELETE(self->keymaps, popped_node);
         popped = popped_node->keymap;
         self->keymap_tail = popped_node->prev;
+        self->kpending = NULL;
         free(popped_node);
     }
     return popped;
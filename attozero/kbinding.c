@@ -3,17 +3,24 @@
 /**
  * Allocate a new key binding
  */
-kbinding_t* kbinding_new(char* keyc, int fn) {
+kbinding_t* kbinding_new(int key, int fn) {
     kbinding_t* kbinding;
     kbinding = (kbinding_t*)calloc(1, sizeof(kbinding_t));
-    snprintf(kbinding->keyc, ATTO_KEYC_LEN, "%s", keyc);
+    kbinding->key = key;
     kbinding->fn = fn;
     return kbinding;
 }
 
 /**
- * Free a keybinding
+ * Free a keybinding and the rest of any chords it starts
  */
 int kbinding_destroy(kbinding_t* self) {
+    kbinding_t* child;
+    kbinding_t* tmp;
+    HASH_ITER(hh, self->children, child, tmp) {
+        HASH_DEL(self->children, child);
+        kbinding_destroy(child);
+    }
     free(self);
+    return ATTO_RC_OK;
 }
@@ -1,5 +1,32 @@
 #include "atto.h"
 
+/**
+ * Names of keys that are not a printable char, C<char> or M<key name>
+ */
+static struct {
+    char* name;
+    int key;
+} keymap_key_names[] = {
+    { "enter", 13 },
+    { "tab", 9 },
+    { "backspace", KEY_BACKSPACE },
+    { "down", KEY_DOWN },
+    { "up", KEY_UP },
+    { "left", KEY_LEFT },
+    { "right", KEY_RIGHT },
+    { "home", KEY_HOME },
+    { "delete", KEY_DC },
+    { "end", KEY_END },
+    { "resize", KEY_RESIZE },
+    { "pagedown", KEY_NPAGE },
+    { "pageup", KEY_PPAGE },
+    { "alt-down", 522 },
+    { "alt-up", 563 },
+    { "alt-left", 542 },
+    { "alt-right", 557 },
+    { NULL, 0 }
+};
+
 /**
  * Allocate a new keymap
  */
@@ -12,12 +39,32 @@ keymap_t* keymap_new(int is_fall_through_allowed) {
 }
 
 /**
- * Bind keyc to fn_handler
+ * Bind keyc to fn_handler. keyc is a key name like "CW" or a chord of
+ * space-separated key names like "CX CS".
  */
 int keymap_bind(keymap_t* self, char* keyc, int fn_handler) {
+    kbinding_t** bindings;
     kbinding_t* binding;
-    binding = kbinding_new(keyc, fn_handler);
-    HASH_ADD_STR(self->bindings, keyc, binding);
+    int keys[ATTO_KEY_CHORD_LEN];
+    int keys_len;
+    int i;
+
+    keys_len = _keymap_parse_keyc(keyc, keys, ATTO_KEY_CHORD_LEN);
+    if (keys_len < 1) {
+        return ATTO_RC_ERR;
+    }
+
+    // Walk down the trie, adding nodes for the chord as needed
+    bindings = &self->bindings;
+    for (i = 0; i < keys_len; i++) {
+        HASH_FIND_INT(*bindings, &keys[i], binding);
+        if (!binding) {
+            binding = kbinding_new(keys[i], LUA_REFNIL);
+            HASH_ADD_INT(*bindings, key, binding);
+        }
+        bindings = &binding->children;
+    }
+    binding->fn = fn_handler;
     return ATTO_RC_OK;
 }
 
@@ -36,8 +83,139 @@ int keymap_destroy(keymap_t* self) {
     kbinding_t* binding;
     kbinding_t* tmp;
     HASH_ITER(hh, self->bindings, binding, tmp) {
+        HASH_DEL(self->bindings, binding);
         kbinding_destroy(binding);
     }
     free(self);
     return ATTO_RC_OK;
 }
+
+/**
+ * Parse keyc into up to max_keys packed keys. Key names are separated by a
+ * single space; a space right after a separator is the space key.
+ * Return the number of keys, or 0 if keyc is not valid
+ */
+int _keymap_parse_keyc(char* keyc, int* ret_keys, int max_keys) {
+    int keys_len;
+    int len;
+    char* end;
+
+    keys_len = 0;
+    while (*keyc) {
+        if (keys_len >= max_keys) {
+            return 0;
+        }
+        end = strchr(keyc + 1, ' ');
+        len = end ? end - keyc : strlen(keyc);
+        if ((ret_keys[keys_len++] = _keymap_parse_key(keyc, len)) < 0) {
+            return 0;
+        }
+        keyc += len;
+        if (*keyc == ' ') {
+            keyc += 1;
+        }
+    }
+    return keys_len;
+}
+
+/**
+ * Return the packed key for the first len chars of name, or -1 if it is not
+ * a key name
+ */
+int _keymap_parse_key(char* name, int len) {
+    int i;
+    int key;
+    for (i = 0; keymap_key_names[i].name; i++) {
+        if (!strncmp(keymap_key_names[i].name, name, len) && !keymap_key_names[i].name[len]) {
+            return keymap_key_names[i].key;
+        }
+    }
+    if (len == 1) {
+        return name[0];
+    } else if (len == 2 && name[0] == 'C' && name[1] >= '@' && name[1] <= '_') {
+        return name[1] - 'A' + 1;
+    } else if (len >= 2 && name[0] == 'M') {
+        // Meta and any other key name, e.g., Mx, MCW or Mdown
+        key = _keymap_parse_key(name + 1, len - 1);
+        return key < 0 || (key & ATTO_KEY_META) ? -1 : ATTO_KEY_META | key;
+    }
+    return -1;
+}
+
+/**
+ * Write the name of key to ret_name, which must hold ATTO_KEYC_LEN chars
+ * Return the length of the name
+ */
+int _keymap_get_key_name(int key, char* ret_name) {
+    int i;
+    int len;
+    for (i = 0; keymap_key_names[i].name; i++) {
+        if (keymap_key_names[i].key == key) {
+            len = strlen(keymap_key_names[i].name);
+            memcpy(ret_name, keymap_key_names[i].name, len + 1);
+            return len;
+        }
+    }
+    len = 0;
+    if (key & ATTO_KEY_META) {
+        // M followed by the name of the key without meta
+        len = _keymap_get_key_name(key & ~ATTO_KEY_META, ret_name + 1);
+        if (len < 1 || len + 2 > ATTO_KEYC_LEN) {
+            ret_name[0] = '\0';
+            return 0;
+        }
+        ret_name[0] = 'M';
+        return len + 1;
+    } else if (key > 0 && key < 32) {
+        ret_name[len++] = 'C';
+        ret_name[len++] = (char)(key + 'A' - 1);
+    } else if (key >= 32 && key <= 126) {
+        ret_name[len++] = (char)key;
+    }
+    ret_name[len] = '\0';
+    return len;
+}
+
+/**
+ * Map key to a function through the keymap stack ending at tail. If a chord
+ * is in progress, pending is where it is in its keymap's trie.
+ * Return LUA_REFNIL if there is nothing to invoke yet
+ */
+int _keymap_dispatch(keymap_node_t* tail, kbinding_t** pending, int key) {
+    kbinding_t* binding;
+    keymap_node_t* node;
+    keymap_t* keymap;
+
+    // Continue a chord; a key that breaks it is dropped
+    if (*pending) {
+        HASH_FIND_INT((*pending)->children, &key, binding);
+        *pending = NULL;
+        return binding ? _keymap_step(binding, pending) : LUA_REFNIL;
+    }
+
+    for (node = tail; node; node = node->prev) {
+        keymap = node->keymap;
+        HASH_FIND_INT(keymap->bindings, &key, binding);
+        if (binding) {
+            return _keymap_step(binding, pending);
+        } else if (keymap->default_fn != LUA_REFNIL) {
+            return keymap->default_fn;
+        } else if (keymap->is_fall_through_allowed) {
+            continue;
+        }
+        break;
+    }
+    return LUA_REFNIL;
+}
+
+/**
+ * Return binding's function, or start waiting for the rest of a chord if
+ * binding has children. Longer chords win over a binding for their prefix.
+ */
+int _keymap_step(kbinding_t* binding, kbinding_t** pending) {
+    if (binding->children) {
+        *pending = binding;
+        return LUA_REFNIL;
+    }
+    return binding->fn;
+}
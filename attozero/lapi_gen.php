@@ -1,6 +1,7 @@
 <?php
 
-$lines = explode("\n", file_get_contents('atto.h'));
+$atto_h = file_get_contents('atto.h');
+$lines = explode("\n", $atto_h);
 ob_start();
 
 $all_funcs = array();
@@ -15,7 +16,7 @@ foreach ($lines as $line) {
         if (preg_match('/^(_|lapi_|util_)/', $func_name)) {
             continue;
         }
-        $all_funcs[] = array(null, $func_rtype, $func_name, $func_args);
+        $all_funcs[] = array(null, $func_rtype, $func_name, $func_args, $matches[3]);
     }
 }
 
@@ -92,9 +93,15 @@ foreach ($all_funcs as $func) {
     echo "    retval = {$func_name}(" . implode(', ', $call_args) . ");\n";
     $push_type = c_to_lua_type($func_rtype);
     echo "    lua_push{$push_type}(L, retval);\n";
+    $is_view = preg_match('/_view$/', $func_name);
     foreach ($ret_args as $ret_arg) {
         $push_type = c_to_lua_type($ret_arg[0]);
-        echo "    lua_push{$push_type}(L, {$ret_arg[1]});\n";
+        if ($is_view && $push_type == 'string') {
+            // Views are not NUL-terminated; Lua copies ret_len bytes
+            echo "    lua_pushlstring(L, {$ret_arg[1]}, ret_len);\n";
+        } else {
+            echo "    lua_push{$push_type}(L, {$ret_arg[1]});\n";
+        }
     }
     echo "    return " . (1 + count($ret_args)) . ";\n";
     echo "}\n\n";
@@ -104,6 +111,39 @@ $lapi_c = ob_get_clean();
 
 file_put_contents('lapi.c', $lapi_c);
 
+// FFI bindings for LuaJIT builds (make luajit)
+ob_start();
+echo "-- Generated by lapi_gen.php from atto.h\n";
+echo "local ffi = require(\"ffi\")\n\n";
+echo "ffi.cdef[[\n";
+echo "typedef long time_t;\n";
+preg_match_all('/^typedef [^;]+;/ms', $atto_h, $matches);
+foreach ($matches[0] as $typedef) {
+    echo strip_c_comments($typedef) . "\n";
+}
+foreach (array('sspan_s', 'bline_s', 'buffer_s', 'mark_s') as $struct_name) {
+    if (preg_match('/^struct ' . $struct_name . ' \{.*?^\};/ms', $atto_h, $matches)) {
+        echo strip_c_comments($matches[0]) . "\n";
+    }
+}
+foreach ($all_funcs as $func) {
+    list(, $func_rtype, $func_name, , $func_args_str) = $func;
+    echo "{$func_rtype} {$func_name}({$func_args_str});\n";
+}
+echo "]]\n\n";
+echo "local atto_ffi = { C = ffi.C }\n\n";
+echo "-- Scripts get buffers, marks and bviews as lightuserdata; cast them to\n";
+echo "-- typed pointers to read fields or call ffi.C directly\n";
+foreach (array('buffer', 'bline', 'mark', 'bview') as $type) {
+    echo "function atto_ffi.{$type}(ud) return ffi.cast(\"{$type}_t*\", ud) end\n";
+}
+echo "\nreturn atto_ffi\n";
+file_put_contents('atto_ffi.lua', ob_get_clean());
+
+function strip_c_comments($code) {
+    return rtrim(preg_replace('@\s*//[^\n]*@', '', $code));
+}
+
 function c_to_lua_type($type, $identifier = '') {
     $type = str_replace('*', '', $type);
     if ($type == 'char') {
@@ -0,0 +1,198 @@
+#include "atto.h"
+
+/**
+ * Combine the single-line rules at the head of styles into regexes that find
+ * them all in one pass. Return NULL if there is nothing to gain or the rules
+ * do not combine, in which case each rule is applied in turn.
+ */
+slexer_t* _slexer_new(srule_node_t* styles) {
+    slexer_t* self;
+    srule_node_t* node;
+    srule_t* rules[ATTO_SLEXER_MAX_RULES];
+    int rules_len;
+    int regex_len;
+    char* regex;
+    char* cur;
+    char group_name[16];
+    int capture_count;
+    int i;
+    int k;
+
+    // Collect the single-line rules before the first multi-line or range
+    // rule, as those must still be applied after them. Rules whose matches
+    // depend on where matching starts are applied on their own.
+    rules_len = 0;
+    regex_len = 0;
+    LL_FOREACH(styles, node) {
+        if (node->rule->type != ATTO_SRULE_TYPE_SINGLE
+            || rules_len >= ATTO_SLEXER_MAX_RULES
+            || strstr(node->rule->regex, "\\G")
+            || strstr(node->rule->regex, "\\K")
+            || strstr(node->rule->regex, "(?R")
+        ) {
+            break;
+        }
+        rules[rules_len++] = node->rule;
+        regex_len += strlen(node->rule->regex) + 16;
+    }
+    if (rules_len < 2) {
+        return NULL;
+    }
+
+    // Make cregexes[k] = (?<r{k-1}>regex_k-1)|...|(?<r0>regex_0) for each k.
+    // Later rules go first so they win when rules match at the same column.
+    // All but the last are anchored with \G, as PCRE_ANCHORED at exec time
+    // does not run JIT code. Appending a rule leaves the anchored regexes of
+    // the rules before it unchanged, so those come from the regex cache.
+    self = (slexer_t*)calloc(1, sizeof(slexer_t));
+    self->rules = (srule_t**)malloc(sizeof(srule_t*) * rules_len);
+    self->cregexes = (cregex_t**)calloc(rules_len + 1, sizeof(cregex_t*));
+    self->groups = (int*)malloc(sizeof(int) * (rules_len * (rules_len + 1) / 2));
+    self->refs = 1;
+    regex = (char*)malloc(regex_len + 1);
+    for (k = 1; k <= rules_len; k++) {
+        self->rules[k - 1] = rules[k - 1];
+        self->rules_len = k;
+        cur = regex;
+        if (k < rules_len) {
+            cur += sprintf(cur, "\\G(?:");
+        }
+        for (i = k - 1; i >= 0; i--) {
+            cur += sprintf(cur, "%s(?<r%d>%s)", i < k - 1 ? "|" : "", i, rules[i]->regex);
+        }
+        if (k < rules_len) {
+            cur += sprintf(cur, ")");
+        }
+        if (!(self->cregexes[k] = util_compile_regex(regex, 0))) {
+            break;
+        }
+
+        // Rules may have named groups of their own, so look up which group
+        // each rule is rather than counting
+        for (i = 0; i < k; i++) {
+            sprintf(group_name, "r%d", i);
+            self->groups[k * (k - 1) / 2 + i] = pcre_get_stringnumber(self->cregexes[k]->re, group_name);
+        }
+    }
+    free(regex);
+    if (!self->cregexes[rules_len]
+        || pcre_fullinfo(self->cregexes[rules_len]->re, NULL, PCRE_INFO_CAPTURECOUNT, &capture_count) != 0
+        || capture_count > ATTO_SLEXER_MAX_GROUPS
+    ) {
+        _slexer_release(self);
+        return NULL;
+    }
+    self->ovector_size = (capture_count + 1) * 3;
+    return self;
+}
+
+/**
+ * Find a match of any of the first below rules. With all rules, find the
+ * next match at or after offset; with fewer, only a match at offset. Set
+ * ret_start and ret_end to where it is. Of rules that match at the same
+ * column, the last one is found.
+ * Return the index of the rule that matched, or -1 if none did
+ * Safe to call from the styler thread
+ */
+int _slexer_exec(slexer_t* self, int below, char* data, int length, int offset, int* ret_start, int* ret_end) {
+    int ovector[(ATTO_SLEXER_MAX_GROUPS + 1) * 3];
+    int* groups;
+    int i;
+    if (util_exec_regex(self->cregexes[below], data, length, offset, 0, ovector, self->ovector_size) < 0) {
+        return -1;
+    }
+    *ret_start = ovector[0];
+    *ret_end = ovector[1];
+    groups = self->groups + below * (below - 1) / 2;
+    for (i = below - 1; i >= 0; i--) {
+        if (ovector[groups[i] * 2] != -1) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Paint the lexer's rules on a line of data exactly as applying each rule in
+ * turn would, but with a single pass over the line. Matches that start
+ * before from_col are not painted.
+ * Safe to call from the styler thread
+ */
+int _slexer_paint(slexer_t* self, char* data, int length, int from_col, spainter_t* painter) {
+    int cursors[ATTO_SLEXER_MAX_RULES]; // Where each rule's next match may start
+    int heads[ATTO_SLEXER_MAX_RULES];
+    int tails[ATTO_SLEXER_MAX_RULES];
+    int* token;
+    int rule;
+    int col;
+    int start;
+    int end;
+    int i;
+
+    for (i = 0; i < self->rules_len; i++) {
+        cursors[i] = 0;
+        heads[i] = -1;
+        tails[i] = -1;
+    }
+
+    // Stop at each column where any rule matches. Every rule that matches
+    // there, found last rule first, makes a token unless the column is
+    // inside the rule's own last token, same as when the rule is applied on
+    // its own. Tokens are threaded into a list per rule.
+    painter->tokens_len = 0;
+    col = 0;
+    while (col < length && (rule = _slexer_exec(self, self->rules_len, data, length, col, &start, &end)) >= 0) {
+        col = start;
+        do {
+            if (col < cursors[rule]) {
+                continue;
+            }
+            cursors[rule] = end;
+            _spainter_ensure_tokens(painter, painter->tokens_len + 1);
+            token = painter->tokens + painter->tokens_len * 3;
+            token[0] = col;
+            token[1] = end;
+            token[2] = -1;
+            if (tails[rule] == -1) {
+                heads[rule] = painter->tokens_len;
+            } else {
+                painter->tokens[tails[rule] * 3 + 2] = painter->tokens_len;
+            }
+            tails[rule] = painter->tokens_len;
+            painter->tokens_len += 1;
+        } while (rule > 0 && (rule = _slexer_exec(self, rule, data, length, col, &start, &end)) >= 0);
+        col += 1;
+    }
+
+    // Paint rule by rule so later rules win where tokens overlap
+    for (rule = 0; rule < self->rules_len; rule++) {
+        for (i = heads[rule]; i != -1; i = token[2]) {
+            token = painter->tokens + i * 3;
+            if (token[0] >= from_col) {
+                _spainter_paint(painter, token[0], token[1], self->rules[rule]->attrs);
+            }
+        }
+    }
+    return ATTO_RC_OK;
+}
+
+/**
+ * Drop a reference to a lexer, freeing it when there are none left
+ */
+int _slexer_release(slexer_t* self) {
+    int k;
+    self->refs -= 1;
+    if (self->refs > 0) {
+        return ATTO_RC_OK;
+    }
+    for (k = 1; k <= self->rules_len; k++) {
+        if (self->cregexes[k]) {
+            util_release_regex(self->cregexes[k]);
+        }
+    }
+    free(self->cregexes);
+    free(self->rules);
+    free(self->groups);
+    free(self);
+    return ATTO_RC_OK;
+}
@@ -0,0 +1,173 @@
+#include "atto.h"
+
+/**
+ * Start painting a line of length chars, all with attrs 0
+ */
+int _spainter_reset(spainter_t* self, int length) {
+    self->length = length;
+    self->len = 0;
+    if (length < 1) {
+        return ATTO_RC_OK;
+    }
+    _spainter_ensure(self, 1);
+    self->cols[0] = 0;
+    self->attrs[0] = 0;
+    self->len = 1;
+    return ATTO_RC_OK;
+}
+
+/**
+ * Paint from_col until to_col with attrs, overwriting whatever is there
+ */
+int _spainter_paint(spainter_t* self, int from_col, int to_col, int attrs) {
+    int i;
+    int k;
+    int rep_cols[3];
+    int rep_attrs[3];
+    int rep_len;
+    int tail_len;
+    int merge_from;
+    int merge_to;
+
+    from_col = ATTO_MAX(from_col, 0);
+    to_col = ATTO_MIN(to_col, self->length);
+    if (from_col >= to_col) {
+        return ATTO_RC_OK;
+    }
+
+    // Runs i thru k are touched
+    i = _spainter_find(self, from_col);
+    k = _spainter_find(self, to_col - 1);
+
+    // Replace them with what's left of run i, the new run, and what's left
+    // of run k
+    rep_len = 0;
+    if (self->cols[i] < from_col) {
+        rep_cols[rep_len] = self->cols[i];
+        rep_attrs[rep_len++] = self->attrs[i];
+    }
+    rep_cols[rep_len] = from_col;
+    rep_attrs[rep_len++] = attrs;
+    if (to_col < self->length && (k + 1 >= self->len || self->cols[k + 1] > to_col)) {
+        rep_cols[rep_len] = to_col;
+        rep_attrs[rep_len++] = self->attrs[k];
+    }
+    _spainter_ensure(self, self->len - (k - i + 1) + rep_len);
+    tail_len = self->len - (k + 1);
+    memmove(self->cols + i + rep_len, self->cols + k + 1, sizeof(int) * tail_len);
+    memmove(self->attrs + i + rep_len, self->attrs + k + 1, sizeof(int) * tail_len);
+    memcpy(self->cols + i, rep_cols, sizeof(int) * rep_len);
+    memcpy(self->attrs + i, rep_attrs, sizeof(int) * rep_len);
+    self->len = i + rep_len + tail_len;
+
+    // Merge neighbors with the same attrs
+    merge_from = ATTO_MAX(i, 1);
+    merge_to = ATTO_MIN(i + rep_len, self->len - 1);
+    for (k = merge_to; k >= merge_from; k--) {
+        if (self->attrs[k] == self->attrs[k - 1]) {
+            memmove(self->cols + k, self->cols + k + 1, sizeof(int) * (self->len - k - 1));
+            memmove(self->attrs + k, self->attrs + k + 1, sizeof(int) * (self->len - k - 1));
+            self->len -= 1;
+        }
+    }
+
+    return ATTO_RC_OK;
+}
+
+/**
+ * Copy painted runs to bline as sspans
+ * Return 1 if bline's sspans changed, else 0
+ */
+int _spainter_to_bline(spainter_t* self, bline_t* bline) {
+    int i;
+    int length;
+    int line_style_changed;
+    int sspans_size;
+    sspan_t* sspans;
+
+    line_style_changed = 0;
+    if (bline->sspans_size < self->len) {
+        // Move to a bigger array; spans are allocated on first style
+        sspans = _spool_alloc(self->pool, self->len, &sspans_size);
+        if (bline->sspans_len > 0) {
+            memcpy(sspans, bline->sspans, sizeof(sspan_t) * bline->sspans_len);
+        }
+        _spool_free(self->pool, bline->sspans, bline->sspans_size);
+        bline->sspans = sspans;
+        bline->sspans_size = sspans_size;
+        line_style_changed = 1;
+    }
+    for (i = 0; i < self->len; i++) {
+        length = (i + 1 < self->len ? self->cols[i + 1] : self->length) - self->cols[i];
+        if (bline->sspans[i].length != length || bline->sspans[i].attrs != self->attrs[i]) {
+            bline->sspans[i].length = length;
+            bline->sspans[i].attrs = self->attrs[i];
+            line_style_changed = 1;
+        }
+    }
+    if (bline->sspans_len != self->len) {
+        bline->sspans_len = self->len;
+        line_style_changed = 1;
+    }
+    return line_style_changed;
+}
+
+/**
+ * Free a painter's storage
+ */
+int _spainter_free(spainter_t* self) {
+    if (self->cols) {
+        free(self->cols);
+        free(self->attrs);
+    }
+    if (self->tokens) {
+        free(self->tokens);
+    }
+    memset(self, 0, sizeof(spainter_t));
+    return ATTO_RC_OK;
+}
+
+/**
+ * Return the index of the run that col is in
+ */
+int _spainter_find(spainter_t* self, int col) {
+    int lo;
+    int hi;
+    int mid;
+    lo = 0;
+    hi = self->len - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (self->cols[mid] <= col) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/**
+ * Make room for at least size runs
+ */
+int _spainter_ensure(spainter_t* self, int size) {
+    if (self->size >= size) {
+        return ATTO_RC_OK;
+    }
+    self->size = ATTO_MAX(size, self->size + ATTO_SSPAN_RANGE_ALLOC_INCR);
+    self->cols = (int*)realloc(self->cols, sizeof(int) * self->size);
+    self->attrs = (int*)realloc(self->attrs, sizeof(int) * self->size);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Make room for at least size lexer tokens
+ */
+int _spainter_ensure_tokens(spainter_t* self, int size) {
+    if (self->tokens_size >= size) {
+        return ATTO_RC_OK;
+    }
+    self->tokens_size = ATTO_MAX(size, self->tokens_size * 2);
+    self->tokens = (int*)realloc(self->tokens, sizeof(int) * 3 * self->tokens_size);
+    return ATTO_RC_OK;
+}
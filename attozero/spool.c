@@ -0,0 +1,93 @@
+#include "atto.h"
+
+/**
+ * Return the size class for an array of size sspans, or -1 if it is too
+ * big to pool
+ */
+int _spool_get_class(int size) {
+    int class;
+    int class_size;
+    class_size = ATTO_SPOOL_MIN_SPANS;
+    for (class = 0; class < ATTO_SPOOL_CLASSES; class++) {
+        if (size <= class_size) {
+            return class;
+        }
+        class_size <<= 1;
+    }
+    return -1;
+}
+
+/**
+ * Allocate an array of at least size sspans. Set ret_size to how many it
+ * can actually hold.
+ */
+sspan_t* _spool_alloc(spool_t* self, int size, int* ret_size) {
+    int class;
+    int class_size;
+    int block_size;
+    sspan_t* sspans;
+    char* slab;
+
+    class = _spool_get_class(size);
+    if (class < 0) {
+        // Too big to pool
+        *ret_size = size;
+        return (sspan_t*)malloc(sizeof(sspan_t) * size);
+    }
+    class_size = ATTO_SPOOL_MIN_SPANS << class;
+    *ret_size = class_size;
+
+    // Reuse a freed array if there is one
+    if (self->free[class]) {
+        sspans = self->free[class];
+        self->free[class] = *(sspan_t**)sspans;
+        return sspans;
+    }
+
+    // Else carve one out of the current slab, starting a new slab if needed
+    block_size = sizeof(sspan_t) * class_size;
+    if (self->slab_left < block_size) {
+        slab = (char*)malloc(ATTO_SPOOL_SLAB_SIZE);
+        *(char**)slab = self->slabs; // Slabs are chained through their first bytes
+        self->slabs = slab;
+        self->slab_next = slab + sizeof(sspan_t) * ATTO_SPOOL_MIN_SPANS;
+        self->slab_left = ATTO_SPOOL_SLAB_SIZE - sizeof(sspan_t) * ATTO_SPOOL_MIN_SPANS;
+    }
+    sspans = (sspan_t*)self->slab_next;
+    self->slab_next += block_size;
+    self->slab_left -= block_size;
+    return sspans;
+}
+
+/**
+ * Return an array of size sspans (as set by _spool_alloc) to the pool
+ */
+int _spool_free(spool_t* self, sspan_t* sspans, int size) {
+    int class;
+    if (!sspans) {
+        return ATTO_RC_OK;
+    }
+    class = _spool_get_class(size);
+    if (class < 0) {
+        free(sspans);
+        return ATTO_RC_OK;
+    }
+    *(sspan_t**)sspans = self->free[class];
+    self->free[class] = sspans;
+    return ATTO_RC_OK;
+}
+
+/**
+ * Free every slab in the pool at once. Arrays too big to pool are not
+ * freed; callers free those with _spool_free.
+ */
+int _spool_destroy(spool_t* self) {
+    char* slab;
+    while (self->slabs) {
+        slab = self->slabs;
+        self->slabs = *(char**)slab;
+        free(slab);
+    }
+    memset(self, 0, sizeof(spool_t));
+    return ATTO_RC_OK;
+}
@@ -5,8 +5,8 @@
  */
 srule_t* srule_new_single(char* regex, int color, int bg_color, int other_attrs) {
     srule_t* srule;
-    pcre* re;
-    re = util_compile_regex(regex);
+    cregex_t* re;
+    re = util_compile_regex(regex, 0);
     if (!re) {
         return NULL;
     }
@@ -22,14 +22,15 @@ srule_t* srule_new_single(char* regex, int color, int bg_color, int other_attrs)
  */
 srule_t* srule_new_multi(char* regex_start, char* regex_end, int color, int bg_color, int other_attrs) {
     srule_t* srule;
-    pcre* re;
-    pcre* re_end;
-    re = util_compile_regex(regex_start);
+    cregex_t* re;
+    cregex_t* re_end;
+    re = util_compile_regex(regex_start, 0);
     if (!re) {
         return NULL;
     }
-    re_end = util_compile_regex(regex_end);
+    re_end = util_compile_regex(regex_end, 0);
     if (!re_end) {
+        util_release_regex(re);
         return NULL;
     }
     srule = _srule_new(color, bg_color, other_attrs);
@@ -72,10 +73,10 @@ srule_t* _srule_new(int color, int bg_color, int other_attrs) {
  */
 int srule_destroy(srule_t* self) {
     if (self->cregex) {
-        pcre_free(self->cregex);
+        util_release_regex(self->cregex);
     }
     if (self->cregex_end) {
-        pcre_free(self->cregex_end);
+        util_release_regex(self->cregex_end);
     }
     if (self->regex) {
         free(self->regex);
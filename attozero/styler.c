@@ -0,0 +1,269 @@
+#include "atto.h"
+
+static pthread_once_t styler_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t styler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t styler_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t styler_done_cond = PTHREAD_COND_INITIALIZER;
+static sjob_t* styler_queue = NULL;
+static int styler_is_running = 0;
+
+static void _styler_init();
+
+/**
+ * Snapshot what is needed to style buffer from style_line until until_line
+ */
+sjob_t* _sjob_new(buffer_t* buffer, int until_line) {
+    sjob_t* self;
+    srule_node_t* node;
+    srule_t* rule;
+    srule_t* open_rule;
+    bline_t* last;
+    int line_count;
+    int style_count;
+    int data_len;
+    int i;
+
+    self = (sjob_t*)calloc(1, sizeof(sjob_t));
+    self->version = buffer->version;
+    self->from_line = buffer->style_line;
+    self->until_line = until_line;
+    line_count = until_line - self->from_line;
+
+    // Copy text
+    last = buffer->blines + until_line - 1;
+    self->base_offset = buffer->blines[self->from_line].offset;
+    data_len = (last->offset + last->length) - self->base_offset;
+    self->data = (char*)malloc(data_len + 1);
+    memcpy(self->data, buffer->data + self->base_offset, data_len);
+    self->data[data_len] = '\0';
+
+    // Copy line offsets and lengths; styles are filled in by _sjob_run
+    self->blines = (bline_t*)calloc(line_count, sizeof(bline_t));
+    self->sspool = (spool_t*)calloc(1, sizeof(spool_t));
+    for (i = 0; i < line_count; i++) {
+        self->blines[i].offset = buffer->blines[self->from_line + i].offset;
+        self->blines[i].length = buffer->blines[self->from_line + i].length;
+    }
+
+    // Share the lexer; it does not change once made
+    self->slexer = buffer->slexer;
+    if (self->slexer) {
+        self->slexer->refs += 1;
+    }
+
+    // Copy styles. Range rules are copied along with their marks as marks
+    // move around while the job runs.
+    open_rule = self->from_line > 0 ? buffer->blines[self->from_line - 1].open_rule : NULL;
+    self->open_rule = open_rule;
+    style_count = 0;
+    LL_FOREACH(buffer->styles, node) {
+        style_count += 1;
+    }
+    if (style_count > 0) {
+        self->styles = (srule_node_t*)calloc(style_count, sizeof(srule_node_t));
+        self->range_rules = (srule_t*)calloc(style_count, sizeof(srule_t));
+        self->range_origs = (srule_t**)calloc(style_count, sizeof(srule_t*));
+        self->range_marks = (mark_t*)calloc(style_count * 2, sizeof(mark_t));
+    }
+    i = 0;
+    LL_FOREACH(buffer->styles, node) {
+        rule = node->rule;
+        if (rule->type == ATTO_SRULE_TYPE_RANGE) {
+            self->range_rules[self->range_count] = *rule;
+            self->range_origs[self->range_count] = rule;
+            self->range_marks[self->range_count * 2] = *rule->range_start;
+            self->range_marks[self->range_count * 2 + 1] = *rule->range_end;
+            rule = self->range_rules + self->range_count;
+            rule->range_start = self->range_marks + self->range_count * 2;
+            rule->range_end = self->range_marks + self->range_count * 2 + 1;
+            self->range_count += 1;
+        }
+        self->styles[i].rule = rule;
+        self->styles[i].next = i + 1 < style_count ? self->styles + i + 1 : NULL;
+        i += 1;
+    }
+    self->open_rule = _sjob_get_job_rule(self, open_rule);
+
+    // Copy the rules left open by lines in the sync window, before they are
+    // restyled, so the job can tell when it catches up to them
+    self->sync_line = buffer->style_sync_line;
+    self->sync_end = buffer->style_sync_end;
+    for (i = ATTO_MAX(self->sync_line - 1, self->from_line); i < ATTO_MIN(self->sync_end, until_line); i++) {
+        self->blines[i - self->from_line].open_rule = _sjob_get_job_rule(self, buffer->blines[i].open_rule);
+    }
+
+    return self;
+}
+
+/**
+ * Style the lines in a job
+ * Invoked on the styler thread
+ */
+int _sjob_run(sjob_t* self) {
+    int line;
+    bline_t* bline;
+    srule_t* open_rule;
+    srule_t* prev_open_rule;
+    spainter_t painter;
+
+    memset(&painter, 0, sizeof(spainter_t));
+    painter.pool = self->sspool;
+    open_rule = self->open_rule;
+    for (line = 0; line < self->until_line - self->from_line; line++) {
+        bline = self->blines + line;
+        prev_open_rule = bline->open_rule;
+        _buffer_style_line(self->styles, self->slexer, self->data + (bline->offset - self->base_offset), bline, open_rule, &painter);
+        open_rule = bline->open_rule;
+        if (self->from_line + line >= self->sync_line - 1
+            && self->from_line + line < self->sync_end
+            && open_rule == prev_open_rule
+        ) {
+            // Caught up; the rest is styled the same as before. Lines
+            // after this one are not applied (see _buffer_apply_sjob).
+            self->until_line = self->from_line + line + 1;
+            break;
+        }
+    }
+
+    _spainter_free(&painter);
+
+    return ATTO_RC_OK;
+}
+
+/**
+ * Map a buffer's rule to the rule used in a job
+ */
+srule_t* _sjob_get_job_rule(sjob_t* self, srule_t* rule) {
+    int i;
+    for (i = 0; i < self->range_count; i++) {
+        if (self->range_origs[i] == rule) {
+            return self->range_rules + i;
+        }
+    }
+    return rule;
+}
+
+/**
+ * Map a rule in a job back to the buffer's rule
+ */
+srule_t* _sjob_get_orig_rule(sjob_t* self, srule_t* rule) {
+    if (rule >= self->range_rules && rule < self->range_rules + self->range_count) {
+        return self->range_origs[rule - self->range_rules];
+    }
+    return rule;
+}
+
+/**
+ * Free a job
+ */
+int _sjob_destroy(sjob_t* self) {
+    int i;
+    for (i = 0; i < self->until_line - self->from_line; i++) {
+        _spool_free(self->sspool, self->blines[i].sspans, self->blines[i].sspans_size);
+    }
+    _spool_destroy(self->sspool);
+    free(self->sspool);
+    free(self->blines);
+    free(self->data);
+    if (self->slexer) {
+        _slexer_release(self->slexer);
+    }
+    if (self->styles) {
+        free(self->styles);
+        free(self->range_rules);
+        free(self->range_origs);
+        free(self->range_marks);
+    }
+    free(self);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Queue a job for the styler thread, starting the thread if needed
+ */
+int _styler_submit(sjob_t* sjob) {
+    pthread_once(&styler_once, _styler_init);
+    if (!styler_is_running) {
+        // No styler thread; do it here
+        _sjob_run(sjob);
+        sjob->state = ATTO_SJOB_STATE_DONE;
+        return ATTO_RC_OK;
+    }
+    pthread_mutex_lock(&styler_mutex);
+    sjob->state = ATTO_SJOB_STATE_QUEUED;
+    LL_APPEND(styler_queue, sjob);
+    pthread_cond_signal(&styler_cond);
+    pthread_mutex_unlock(&styler_mutex);
+    ATTO_TRACE(ATTO_TRACE_SPEW, "version=%d from_line=%d until_line=%d\n", sjob->version, sjob->from_line, sjob->until_line);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Return 1 if the styler thread is done with a job, else 0
+ */
+int _styler_is_done(sjob_t* sjob) {
+    int is_done;
+    pthread_mutex_lock(&styler_mutex);
+    is_done = sjob->state == ATTO_SJOB_STATE_DONE ? 1 : 0;
+    pthread_mutex_unlock(&styler_mutex);
+    return is_done;
+}
+
+/**
+ * Take a job off the queue, or wait for the styler thread to finish it if it
+ * already started. Afterwards the job is done and no longer touches the
+ * rules it was made from.
+ */
+int _styler_cancel(sjob_t* sjob) {
+    pthread_mutex_lock(&styler_mutex);
+    if (sjob->state == ATTO_SJOB_STATE_QUEUED) {
+        LL_DELETE(styler_queue, sjob);
+        sjob->state = ATTO_SJOB_STATE_DONE;
+    }
+    while (sjob->state != ATTO_SJOB_STATE_DONE) {
+        pthread_cond_wait(&styler_done_cond, &styler_mutex);
+    }
+    pthread_mutex_unlock(&styler_mutex);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Styler thread main loop
+ */
+void* _styler_main(void* arg) {
+    sjob_t* sjob;
+    while (1) {
+        // Wait for a job
+        pthread_mutex_lock(&styler_mutex);
+        while (!styler_queue) {
+            pthread_cond_wait(&styler_cond, &styler_mutex);
+        }
+        sjob = styler_queue;
+        LL_DELETE(styler_queue, sjob);
+        sjob->state = ATTO_SJOB_STATE_RUNNING;
+        pthread_mutex_unlock(&styler_mutex);
+
+        // Run it
+        _sjob_run(sjob);
+
+        // Let the main thread know it's done
+        pthread_mutex_lock(&styler_mutex);
+        sjob->state = ATTO_SJOB_STATE_DONE;
+        pthread_cond_broadcast(&styler_done_cond);
+        pthread_mutex_unlock(&styler_mutex);
+    }
+    return NULL;
+}
+
+/**
+ * Start the styler thread
+ */
+static void _styler_init() {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, _styler_main, NULL) != 0) {
+        ATTO_TRACE(ATTO_TRACE_ERROR, "Could not start styler thread: %s\n", strerror(errno));
+        return;
+    }
+    pthread_detach(thread);
+    styler_is_running = 1;
+}
@@ -8,6 +8,26 @@
 #define ATTO_TEST_ASSERT(expr, fail_msg) do { \
     if (!(expr)) return fail_msg; } while (0)
 
+/**
+ * Return a new buffer of n copies of line, newline separated
+ */
+buffer_t* _test_buffer_of_lines(int n, char* line) {
+    buffer_t* b;
+    char* data;
+    int line_len;
+    int i;
+    line_len = strlen(line);
+    data = (char*)malloc((line_len + 1) * n + 1);
+    for (i = 0; i < n; i++) {
+        memcpy(data + (line_len + 1) * i, line, line_len);
+        data[(line_len + 1) * i + line_len] = '\n';
+    }
+    b = buffer_new();
+    buffer_set(b, data, n > 0 ? (line_len + 1) * n - 1 : 0);
+    free(data);
+    return b;
+}
+
 /**
  * Test basic buffer edits
  */
@@ -81,6 +101,31 @@ char* test_buffer_simple() {
     return NULL;
 }
 
+/**
+ * Test borrowing text from a buffer
+ */
+char* test_buffer_view() {
+    buffer_t* b;
+    char* data;
+    int len;
+    int version;
+
+    b = buffer_new();
+    buffer_set(b, "hello\nworld", 11);
+    buffer_get_line_view(b, 1, 1, &data, &len, &version);
+    ATTO_TEST_ASSERT(len == 4, "line view should be 4 chars");
+    ATTO_TEST_ASSERT(strncmp(data, "orld", 4) == 0, "line view should be orld");
+    ATTO_TEST_ASSERT(data == b->data + 7, "line view should point into buffer");
+    ATTO_TEST_ASSERT(buffer_check_view(b, version) == ATTO_RC_OK, "view should be good before edit");
+    buffer_get_substr_view(b, 3, 100, &data, &len, NULL);
+    ATTO_TEST_ASSERT(len == 8, "substr view should be clamped to 8 chars");
+    buffer_insert(b, 0, "x", 1, NULL, NULL, NULL);
+    ATTO_TEST_ASSERT(buffer_check_view(b, version) == ATTO_RC_ERR, "view should be stale after edit");
+
+    buffer_destroy(b);
+    return NULL;
+}
+
 /**
  * Test basic mark features
  */
@@ -108,6 +153,377 @@ char* test_mark_simple() {
     return NULL;
 }
 
+/**
+ * Test that styling is bounded and picks up where it left off
+ */
+char* test_buffer_style() {
+    buffer_t* b;
+    srule_t* rule_num;
+    srule_t* rule_comment;
+
+    b = _test_buffer_of_lines(100, "x = 1;");
+    rule_num = srule_new_single("[0-9]+", 0, 0, A_BOLD);
+    buffer_add_style(b, rule_num);
+    ATTO_TEST_ASSERT(b->style_line == 0, "style_line should be 0 after adding a style");
+
+    buffer_style(b, 10);
+    ATTO_TEST_ASSERT(b->style_line == 10, "style_line should be 10");
+    ATTO_TEST_ASSERT(b->blines[0].sspans_len == 3, "line 0 should have 3 spans");
+    ATTO_TEST_ASSERT(b->blines[0].sspans[1].length == 1, "span 1 of line 0 should be 1 char");
+    ATTO_TEST_ASSERT(b->blines[0].sspans[1].attrs == A_BOLD, "span 1 of line 0 should be bold");
+    ATTO_TEST_ASSERT(b->blines[50].sspans_len == 0, "line 50 should not be styled yet");
+
+    buffer_style(b, 20);
+    ATTO_TEST_ASSERT(b->style_line == 20, "style_line should be 20");
+
+    buffer_insert(b, b->blines[2].offset, "2", 1, NULL, NULL, NULL);
+    ATTO_TEST_ASSERT(b->style_line == 2, "style_line should be 2 after edit");
+    buffer_style(b, 4);
+    ATTO_TEST_ASSERT(b->style_line == 20, "style_line should skip ahead to 20");
+    ATTO_TEST_ASSERT(b->blines[2].sspans[1].attrs == 0, "line 2 should start unstyled");
+
+    rule_comment = srule_new_multi("/\\*", "\\*/", 0, 0, A_UNDERLINE);
+    buffer_add_style(b, rule_comment);
+    buffer_insert(b, b->blines[5].offset, "/*", 2, NULL, NULL, NULL);
+    buffer_style(b, 30);
+    ATTO_TEST_ASSERT(b->style_line == 30, "style_line should be 30");
+    ATTO_TEST_ASSERT(b->blines[29].open_rule == rule_comment, "line 29 should be in a comment");
+    ATTO_TEST_ASSERT(b->blines[29].sspans[0].attrs == A_UNDERLINE, "line 29 should be underlined");
+    ATTO_TEST_ASSERT(b->blines[4].open_rule == NULL, "line 4 should not be in a comment");
+
+    buffer_destroy(b);
+    return NULL;
+}
+
+/**
+ * Test that restyling stops once it catches up to styles from before an edit
+ */
+char* test_buffer_style_sync() {
+    buffer_t* b;
+    sjob_t* sjob;
+    srule_t* rule_comment;
+
+    b = _test_buffer_of_lines(100, "x = 1;");
+    rule_comment = srule_new_multi("/\\*", "\\*/", 0, 0, A_UNDERLINE);
+    buffer_add_style(b, srule_new_single("[0-9]+", 0, 0, A_BOLD));
+    buffer_add_style(b, rule_comment);
+    buffer_style(b, 100);
+
+    buffer_insert(b, b->blines[50].offset, "\n", 1, NULL, NULL, NULL);
+    ATTO_TEST_ASSERT(b->style_line == 50, "style_line should be 50 after edit");
+    buffer_style(b, 52);
+    ATTO_TEST_ASSERT(b->style_line == 101, "style_line should skip to the end");
+
+    buffer_insert(b, b->blines[60].offset, "/*", 2, NULL, NULL, NULL);
+    buffer_style(b, 61);
+    ATTO_TEST_ASSERT(b->style_line == 61, "style_line should not skip while a comment is open");
+    buffer_style(b, 101);
+    ATTO_TEST_ASSERT(b->blines[100].open_rule == rule_comment, "last line should be in a comment");
+
+    buffer_insert(b, b->blines[62].offset, "*/", 2, NULL, NULL, NULL);
+    buffer_style(b, 63);
+    ATTO_TEST_ASSERT(b->style_line == 63, "style_line should be 63");
+    ATTO_TEST_ASSERT(b->blines[62].open_rule == NULL, "comment should be closed on line 62");
+    ATTO_TEST_ASSERT(b->blines[63].open_rule == rule_comment, "line 63 should keep its stale style until restyled");
+    buffer_style(b, 101);
+    ATTO_TEST_ASSERT(b->blines[100].open_rule == NULL, "last line should not be in a comment");
+
+    // Jobs stop early too
+    buffer_insert(b, b->blines[20].offset, "\n", 1, NULL, NULL, NULL);
+    sjob = _sjob_new(b, b->line_count);
+    b->sjob_edit_line = b->line_count;
+    _sjob_run(sjob);
+    ATTO_TEST_ASSERT(sjob->until_line == 22, "job should stop after line 21");
+    _buffer_apply_sjob(b, sjob);
+    _sjob_destroy(sjob);
+    ATTO_TEST_ASSERT(b->style_line == b->line_count, "style_line should skip to the end");
+
+    buffer_destroy(b);
+    return NULL;
+}
+
+/**
+ * Test styling on the styler thread
+ */
+char* test_buffer_style_async() {
+    buffer_t* b;
+    int tries;
+    sjob_t* sjob;
+    srule_t* rule_num;
+
+    b = _test_buffer_of_lines(100, "x = 1;");
+    rule_num = srule_new_single("[0-9]+", 0, 0, A_BOLD);
+    buffer_add_style(b, rule_num);
+
+    for (tries = 0; tries < 1000 && b->style_line < 50; tries++) {
+        _buffer_style_async(b, 50);
+        usleep(1000);
+    }
+    ATTO_TEST_ASSERT(b->style_line == 50, "style_line should be 50");
+    ATTO_TEST_ASSERT(b->sjob == NULL, "there should be no job left");
+    ATTO_TEST_ASSERT(b->blines[49].sspans_len == 3, "line 49 should have 3 spans");
+    ATTO_TEST_ASSERT(b->blines[49].sspans[1].attrs == A_BOLD, "span 1 of line 49 should be bold");
+
+    // Edit line 60 after the snapshot of lines 50 thru 70 is taken
+    sjob = _sjob_new(b, 70);
+    b->sjob_edit_line = 70;
+    buffer_insert(b, b->blines[60].offset, "1", 1, NULL, NULL, NULL);
+    _sjob_run(sjob);
+    _buffer_apply_sjob(b, sjob);
+    _sjob_destroy(sjob);
+    ATTO_TEST_ASSERT(b->style_line == 60, "style_line should stop at edited line 60");
+    ATTO_TEST_ASSERT(b->blines[59].sspans_version >= b->blines[59].version, "line 59 styles should be current");
+    ATTO_TEST_ASSERT(b->blines[60].sspans_version < b->blines[60].version, "line 60 styles should be stale");
+
+    // Removing a style waits out the job using it, so it can be freed
+    _buffer_style_async(b, 100);
+    buffer_remove_style(b, rule_num);
+    ATTO_TEST_ASSERT(b->sjob == NULL, "removing a style should drop the job");
+    srule_destroy(rule_num);
+    for (tries = 0; tries < 1000 && b->style_line < 100; tries++) {
+        _buffer_style_async(b, 100);
+        usleep(1000);
+    }
+    ATTO_TEST_ASSERT(b->blines[99].sspans_len == 1, "line 99 should have no styles");
+
+    buffer_destroy(b);
+    return NULL;
+}
+
+/**
+ * Test the regex cache
+ */
+char* test_util_regex() {
+    cregex_t* re;
+    cregex_t* re2;
+    int matches[3];
+    int i;
+    char pattern[16];
+
+    re = util_compile_regex("[0-9]{2,}", 0);
+    ATTO_TEST_ASSERT(re != NULL, "regex should compile");
+    re2 = util_compile_regex("[0-9]{2,}", 0);
+    ATTO_TEST_ASSERT(re == re2, "same regex should come from cache");
+    ATTO_TEST_ASSERT(re->refs == 2, "regex should have 2 refs");
+    ATTO_TEST_ASSERT(util_exec_regex(re, "abc 123", 7, 0, 0, matches, 3) >= 0, "regex should match");
+    ATTO_TEST_ASSERT(matches[0] == 4 && matches[1] == 7, "match should be 4 thru 7");
+    util_release_regex(re2);
+
+    // Fill the cache; re is still in use so it must survive
+    for (i = 0; i < ATTO_REGEX_CACHE_SIZE * 2; i++) {
+        snprintf(pattern, sizeof(pattern), "x%d", i);
+        util_release_regex(util_compile_regex(pattern, 0));
+    }
+    ATTO_TEST_ASSERT(util_compile_regex("[0-9]{2,}", 0) == re, "regex in use should not be evicted");
+    util_release_regex(re);
+    util_release_regex(re);
+    return NULL;
+}
+
+/**
+ * Test that combined single-line rules style like rules applied in turn
+ */
+char* test_buffer_slexer() {
+    buffer_t* b;
+    bline_t bline_each;
+    bline_t bline_lexer;
+    spainter_t painter;
+    spool_t pool;
+    char* data;
+    int i;
+    int col;
+
+    data = "x = 12; yy = 3; // 45";
+    b = buffer_new();
+    buffer_set(b, data, strlen(data));
+    buffer_add_style(b, srule_new_single("[0-9]+", 0, 0, A_BOLD));
+    ATTO_TEST_ASSERT(b->slexer == NULL, "one rule should not be combined");
+    buffer_add_style(b, srule_new_single("[a-z]+", 0, 0, A_UNDERLINE));
+    buffer_add_style(b, srule_new_single("(?<eq>=)", 0, 0, A_REVERSE)); // Named groups must not shift the rules' groups
+    buffer_add_style(b, srule_new_single("//.*", 0, 0, A_DIM));
+    ATTO_TEST_ASSERT(b->slexer != NULL, "rules should be combined");
+    ATTO_TEST_ASSERT(b->slexer->rules_len == 4, "lexer should have 4 rules");
+
+    memset(&painter, 0, sizeof(spainter_t));
+    memset(&pool, 0, sizeof(spool_t));
+    painter.pool = &pool;
+    memset(&bline_each, 0, sizeof(bline_t));
+    memset(&bline_lexer, 0, sizeof(bline_t));
+    bline_each.length = bline_lexer.length = strlen(data);
+    _buffer_style_line(b->styles, NULL, data, &bline_each, NULL, &painter);
+    _buffer_style_line(b->styles, b->slexer, data, &bline_lexer, NULL, &painter);
+    ATTO_TEST_ASSERT(bline_lexer.sspans_len == bline_each.sspans_len, "lexer should make the same number of spans");
+    ATTO_TEST_ASSERT(memcmp(bline_lexer.sspans, bline_each.sspans, sizeof(sspan_t) * bline_each.sspans_len) == 0, "lexer should make the same spans");
+    ATTO_TEST_ASSERT(bline_lexer.sspans[bline_lexer.sspans_len - 1].attrs == A_DIM, "comment should be dim");
+    buffer_destroy(b);
+
+    // Rules whose matches overlap, like the ones in atto.lua
+    data = "$class = $x->y('if $z'); // $w";
+    b = buffer_new();
+    buffer_set(b, data, strlen(data));
+    buffer_add_style(b, srule_new_single("\\$[a-zA-Z_0-9$]*|[=!<>-]", 0, 0, A_BOLD));
+    buffer_add_style(b, srule_new_single("\\b(class|if)\\b", 0, 0, A_UNDERLINE));
+    buffer_add_style(b, srule_new_single("(\\$|=>|->|::)", 0, 0, A_REVERSE));
+    buffer_add_style(b, srule_new_single("'[^']*'", 0, 0, A_DIM));
+    ATTO_TEST_ASSERT(b->slexer != NULL && b->slexer->rules_len == 4, "overlapping rules should be combined");
+    bline_each.length = bline_lexer.length = strlen(data);
+    _buffer_style_line(b->styles, NULL, data, &bline_each, NULL, &painter);
+    _buffer_style_line(b->styles, b->slexer, data, &bline_lexer, NULL, &painter);
+    ATTO_TEST_ASSERT(bline_lexer.sspans_len == bline_each.sspans_len, "lexer should make the same number of spans for overlaps");
+    ATTO_TEST_ASSERT(memcmp(bline_lexer.sspans, bline_each.sspans, sizeof(sspan_t) * bline_each.sspans_len) == 0, "lexer should make the same spans for overlaps");
+    for (i = 0, col = 0; col + bline_lexer.sspans[i].length <= 10; col += bline_lexer.sspans[i++].length);
+    ATTO_TEST_ASSERT(bline_lexer.sspans[i].attrs == A_BOLD, "x in $x should keep the style of the longer match");
+
+    _spainter_free(&painter);
+    _spool_destroy(&pool);
+    buffer_destroy(b);
+    return NULL;
+}
+
+/**
+ * Test painting spans against painting each char
+ */
+char* test_spainter() {
+    spainter_t painter;
+    bline_t bline;
+    int chars[64];
+    int i;
+    int j;
+    int col;
+    int from_col;
+    int to_col;
+    int attrs;
+    int length;
+    spool_t pool;
+
+    memset(&painter, 0, sizeof(spainter_t));
+    memset(&pool, 0, sizeof(spool_t));
+    painter.pool = &pool;
+    memset(&bline, 0, sizeof(bline_t));
+    bline.length = 64;
+    srand(1);
+    for (i = 0; i < 200; i++) {
+        _spainter_reset(&painter, bline.length);
+        memset(chars, 0, sizeof(chars));
+        for (j = 0; j < 20; j++) {
+            from_col = rand() % 70;
+            to_col = from_col + rand() % 20;
+            attrs = rand() % 3;
+            _spainter_paint(&painter, from_col, to_col, attrs);
+            for (col = from_col; col < to_col && col < 64; col++) chars[col] = attrs;
+        }
+        _spainter_to_bline(&painter, &bline);
+        col = 0;
+        for (j = 0; j < bline.sspans_len; j++) {
+            ATTO_TEST_ASSERT(bline.sspans[j].length > 0, "spans should not be empty");
+            ATTO_TEST_ASSERT(j == 0 || bline.sspans[j].attrs != bline.sspans[j - 1].attrs, "neighboring spans should differ");
+            for (length = bline.sspans[j].length; length > 0; length--, col++) {
+                ATTO_TEST_ASSERT(col < 64, "spans should not run past the line");
+                ATTO_TEST_ASSERT(chars[col] == bline.sspans[j].attrs, "span attrs should match chars");
+            }
+        }
+        ATTO_TEST_ASSERT(col == 64, "spans should cover the line");
+    }
+
+    _spainter_free(&painter);
+    _spool_destroy(&pool);
+    return NULL;
+}
+
+/**
+ * Test sspan pooling and compaction
+ */
+char* test_spool() {
+    spool_t pool;
+    sspan_t* a;
+    sspan_t* b;
+    int size;
+    buffer_t* buf;
+
+    memset(&pool, 0, sizeof(spool_t));
+    a = _spool_alloc(&pool, 3, &size);
+    ATTO_TEST_ASSERT(size == ATTO_SPOOL_MIN_SPANS, "3 spans should get the smallest class");
+    _spool_free(&pool, a, size);
+    b = _spool_alloc(&pool, 2, &size);
+    ATTO_TEST_ASSERT(a == b, "freed array should be reused");
+    a = _spool_alloc(&pool, 10000, &size);
+    ATTO_TEST_ASSERT(size == 10000, "big arrays should not be pooled");
+    _spool_free(&pool, a, size);
+    _spool_destroy(&pool);
+
+    buf = _test_buffer_of_lines(100, "x = 1;");
+    ATTO_TEST_ASSERT(buf->blines[50].sspans == NULL, "unstyled lines should have no spans");
+    buffer_add_style(buf, srule_new_single("[0-9]+", 0, 0, A_BOLD));
+    buffer_style(buf, 100);
+    ATTO_TEST_ASSERT(buf->blines[50].sspans_size == ATTO_SPOOL_MIN_SPANS, "spans should come from the pool");
+    buffer_delete(buf, buf->blines[10].offset, buf->blines[20].offset - buf->blines[10].offset);
+    ATTO_TEST_ASSERT(buf->line_count == 90, "should be 90 lines after delete");
+    ATTO_TEST_ASSERT(buf->blines[89].sspans_len == 3, "last line should keep its spans");
+    buf->blines[60].sspans_len = 0;
+    _buffer_compact_sspans(buf, 0, 50);
+    ATTO_TEST_ASSERT(buf->blines[60].sspans == NULL, "empty spans out of view should be freed");
+    ATTO_TEST_ASSERT(buf->blines[30].sspans != NULL, "spans in view should be kept");
+
+    buffer_destroy(buf);
+    return NULL;
+}
+
+/**
+ * Test key parsing and chord dispatch through a keymap stack
+ */
+char* test_keymap() {
+    keymap_t* keymap_edit;
+    keymap_t* keymap_prompt;
+    keymap_node_t node_edit;
+    keymap_node_t node_prompt;
+    kbinding_t* pending;
+    int keys[ATTO_KEY_CHORD_LEN];
+    char name[ATTO_KEYC_LEN];
+
+    ATTO_TEST_ASSERT(_keymap_parse_keyc("CX CS", keys, ATTO_KEY_CHORD_LEN) == 2, "CX CS should be 2 keys");
+    ATTO_TEST_ASSERT(keys[0] == 24 && keys[1] == 19, "CX CS should be 24 19");
+    ATTO_TEST_ASSERT(_keymap_parse_keyc("C\\", keys, ATTO_KEY_CHORD_LEN) == 1 && keys[0] == 28, "C\\ should be 28");
+    ATTO_TEST_ASSERT(_keymap_parse_keyc("CX  ", keys, ATTO_KEY_CHORD_LEN) == 2 && keys[1] == ' ', "CX then space should parse");
+    ATTO_TEST_ASSERT(_keymap_parse_keyc("Mx", keys, ATTO_KEY_CHORD_LEN) == 1 && keys[0] == (ATTO_KEY_META | 'x'), "Mx should be meta x");
+    ATTO_TEST_ASSERT(_keymap_parse_keyc("left", keys, ATTO_KEY_CHORD_LEN) == 1 && keys[0] == KEY_LEFT, "left should be KEY_LEFT");
+    ATTO_TEST_ASSERT(_keymap_parse_keyc("bogus", keys, ATTO_KEY_CHORD_LEN) == 0, "bogus should not parse");
+    ATTO_TEST_ASSERT(_keymap_get_key_name(13, name) == 5 && !strcmp(name, "enter"), "13 should be named enter");
+    ATTO_TEST_ASSERT(_keymap_get_key_name(23, name) == 2 && !strcmp(name, "CW"), "23 should be named CW");
+    ATTO_TEST_ASSERT(_keymap_get_key_name('a', name) == 1 && !strcmp(name, "a"), "a should be named a");
+    ATTO_TEST_ASSERT(_keymap_get_key_name(ATTO_KEY_META | KEY_DOWN, name) == 5 && !strcmp(name, "Mdown"), "meta down should be named Mdown");
+    ATTO_TEST_ASSERT(_keymap_parse_keyc("Mdown MCW", keys, ATTO_KEY_CHORD_LEN) == 2, "Mdown MCW should be 2 keys");
+    ATTO_TEST_ASSERT(keys[0] == (ATTO_KEY_META | KEY_DOWN) && keys[1] == (ATTO_KEY_META | 23), "Mdown MCW should be meta down, meta 23");
+
+    keymap_edit = keymap_new(0);
+    keymap_bind(keymap_edit, "CW", 1);
+    keymap_bind(keymap_edit, "CX CS", 2);
+    keymap_bind(keymap_edit, "CX CC", 3);
+    keymap_bind_default(keymap_edit, 4);
+    keymap_prompt = keymap_new(1);
+    keymap_bind(keymap_prompt, "enter", 5);
+    ATTO_TEST_ASSERT(keymap_bind(keymap_prompt, "CA CB CC CD CE", 6) == ATTO_RC_ERR, "too long chord should not bind");
+    node_edit.keymap = keymap_edit;
+    node_edit.prev = NULL;
+    node_prompt.keymap = keymap_prompt;
+    node_prompt.prev = &node_edit;
+    pending = NULL;
+
+    ATTO_TEST_ASSERT(_keymap_dispatch(&node_prompt, &pending, 13) == 5, "enter should map to prompt");
+    ATTO_TEST_ASSERT(_keymap_dispatch(&node_prompt, &pending, 23) == 1, "CW should fall through to edit");
+    ATTO_TEST_ASSERT(_keymap_dispatch(&node_prompt, &pending, 'z') == 4, "z should map to default");
+    ATTO_TEST_ASSERT(_keymap_dispatch(&node_prompt, &pending, 24) == LUA_REFNIL, "CX should wait for more");
+    ATTO_TEST_ASSERT(pending != NULL, "CX should leave a chord pending");
+    ATTO_TEST_ASSERT(_keymap_dispatch(&node_prompt, &pending, 3) == 3, "CX CC should map");
+    ATTO_TEST_ASSERT(pending == NULL, "chord should be done");
+    _keymap_dispatch(&node_prompt, &pending, 24);
+    ATTO_TEST_ASSERT(_keymap_dispatch(&node_prompt, &pending, 'q') == LUA_REFNIL, "broken chord should be dropped");
+    ATTO_TEST_ASSERT(_keymap_dispatch(&node_prompt, &pending, 'q') == 4, "key after broken chord should map");
+
+    keymap_destroy(keymap_prompt);
+    keymap_destroy(keymap_edit);
+    return NULL;
+}
+
 /**
  * Run all tests
  */
@@ -119,7 +535,16 @@ int test_run() {
     printf("Running all tests\n\n");
 
     ATTO_TEST_RUN(buffer_simple, retval, overall);
+    ATTO_TEST_RUN(buffer_view, retval, overall);
     ATTO_TEST_RUN(mark_simple, retval, overall);
+    ATTO_TEST_RUN(buffer_style, retval, overall);
+    ATTO_TEST_RUN(buffer_style_sync, retval, overall);
+    ATTO_TEST_RUN(buffer_style_async, retval, overall);
+    ATTO_TEST_RUN(util_regex, retval, overall);
+    ATTO_TEST_RUN(buffer_slexer, retval, overall);
+    ATTO_TEST_RUN(spainter, retval, overall);
+    ATTO_TEST_RUN(spool, retval, overall);
+    ATTO_TEST_RUN(keymap, retval, overall);
 
     return overall;
 }
@@ -0,0 +1,100 @@
+#include "atto.h"
+#include <stdarg.h>
+
+static trace_entry_t trace_ring[ATTO_TRACE_RING_SIZE];
+static unsigned long trace_head = 0;
+static const char* trace_level_names[] = { "ERROR", "INFO", "DEBUG", "SPEW" };
+
+/**
+ * Set runtime trace level
+ * Levels above ATTO_TRACE_MAX_LEVEL are compiled out and cannot be enabled
+ */
+int trace_set_level(int level) {
+    g_trace_level = ATTO_MAX(ATTO_TRACE_ERROR, ATTO_MIN(level, ATTO_TRACE_SPEW));
+    return ATTO_RC_OK;
+}
+
+/**
+ * Write a trace entry to the ring
+ * Invoked by ATTO_TRACE; safe to call from multiple threads without a lock
+ */
+int _trace_write(int level, const char* func, const char* fmt, ...) {
+    unsigned long seq;
+    trace_entry_t* entry;
+    va_list args;
+
+    // Claim a slot
+    seq = __sync_fetch_and_add(&trace_head, 1);
+    entry = trace_ring + (seq & (ATTO_TRACE_RING_SIZE - 1));
+
+    // Unpublish slot while we fill it in
+    entry->seq = 0;
+    __sync_synchronize();
+
+    clock_gettime(CLOCK_MONOTONIC, &entry->time);
+    entry->level = level;
+    entry->func = func;
+    va_start(args, fmt);
+    vsnprintf(entry->msg, ATTO_TRACE_MSG_LEN, fmt, args);
+    va_end(args);
+
+    // Publish slot
+    __sync_synchronize();
+    entry->seq = seq + 1;
+    return ATTO_RC_OK;
+}
+
+/**
+ * Append the contents of the trace ring to filename, oldest entry first
+ */
+int trace_dump(char* filename) {
+    FILE* f;
+    unsigned long head;
+    unsigned long seq;
+    trace_entry_t* entry;
+    trace_entry_t copy;
+
+    f = fopen(filename, "a");
+    if (!f) {
+        return ATTO_RC_ERR;
+    }
+
+    head = trace_head;
+    seq = head > ATTO_TRACE_RING_SIZE ? head - ATTO_TRACE_RING_SIZE : 0;
+    for (; seq < head; seq++) {
+        entry = trace_ring + (seq & (ATTO_TRACE_RING_SIZE - 1));
+        if (entry->seq != seq + 1) {
+            // Unwritten, being written, or overwritten since we read head
+            continue;
+        }
+
+        // Copy the entry, then make sure no writer claimed it meanwhile
+        __sync_synchronize();
+        copy = *entry;
+        copy.msg[ATTO_TRACE_MSG_LEN - 1] = '\0';
+        __sync_synchronize();
+        if (entry->seq != seq + 1) {
+            continue;
+        }
+
+        fprintf(
+            f,
+            "%ld.%09ld %-5s [%s] %s",
+            (long)copy.time.tv_sec,
+            copy.time.tv_nsec,
+            trace_level_names[copy.level],
+            copy.func,
+            copy.msg
+        );
+    }
+
+    fclose(f);
+    return ATTO_RC_OK;
+}
+
+/**
+ * Dump trace ring to debug.log on exit
+ */
+void _trace_dump_at_exit() {
+    trace_dump("debug.log");
+}
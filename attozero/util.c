@@ -18,52 +18,143 @@ const char* util_memrmem(const char* s, size_t slen, const char* t, size_t tlen)
     return NULL;
 }
 
+static cregex_t* util_regex_cache = NULL;
+static int util_regex_cache_count = 0;
+static __thread pcre_jit_stack* util_jit_stack = NULL;
+static cpair_t* util_cpair_cache = NULL;
+static int util_cpair_count = 0;
+
 /**
- * Given a regex string, return a pcre pointer
+ * Return a JIT stack for the calling thread
+ * Invoked by pcre_exec for JIT-compiled regexes
+ */
+static pcre_jit_stack* _util_get_jit_stack(void* data) {
+    if (!util_jit_stack) {
+        util_jit_stack = pcre_jit_stack_alloc(ATTO_REGEX_JIT_STACK_MIN, ATTO_REGEX_JIT_STACK_MAX);
+    }
+    return util_jit_stack;
+}
+
+/**
+ * Given a regex string, return a compiled and studied regex. Regexes are
+ * cached by options and pattern, so compiling the same regex again is cheap.
+ * Call util_release_regex when done with it.
  * Return NULL on error
  */
-pcre* util_compile_regex(char* regex) {
-    pcre* re;
+cregex_t* util_compile_regex(char* regex, int options) {
+    cregex_t* cregex;
+    cregex_t* evict;
+    cregex_t* tmp;
+    char* key;
     const char* err;
     int erroffset;
+
+    // Look in cache
+    options |= PCRE_NO_AUTO_CAPTURE;
+    if (asprintf(&key, "%x/%s", options, regex) < 0) {
+        return NULL;
+    }
+    HASH_FIND_STR(util_regex_cache, key, cregex);
+    if (cregex) {
+        // Hit; move to back of the eviction line
+        free(key);
+        HASH_DELETE(hh, util_regex_cache, cregex);
+        HASH_ADD_KEYPTR(hh, util_regex_cache, cregex->key, strlen(cregex->key), cregex);
+        cregex->refs += 1;
+        return cregex;
+    }
+
+    // Compile and study
     err = NULL;
     erroffset = 0;
-    re = pcre_compile(regex, PCRE_NO_AUTO_CAPTURE, &err, &erroffset, NULL);
-    if (!re) {
+    cregex = (cregex_t*)calloc(1, sizeof(cregex_t));
+    cregex->re = pcre_compile(regex, options, &err, &erroffset, NULL);
+    if (!cregex->re) {
+        ATTO_TRACE(ATTO_TRACE_INFO, "Could not compile regex %s: %s\n", regex, err);
+        free(cregex);
+        free(key);
         return NULL;
     }
-    return re;
+#ifdef PCRE_STUDY_JIT_COMPILE
+    cregex->extra = pcre_study(cregex->re, PCRE_STUDY_JIT_COMPILE, &err);
+    if (cregex->extra) {
+        pcre_assign_jit_stack(cregex->extra, _util_get_jit_stack, NULL);
+    }
+#else
+    cregex->extra = pcre_study(cregex->re, 0, &err);
+#endif
+    cregex->key = key;
+    cregex->refs = 1;
+
+    // Evict least recently used regexes that are not in use
+    HASH_ITER(hh, util_regex_cache, evict, tmp) {
+        if (util_regex_cache_count < ATTO_REGEX_CACHE_SIZE) {
+            break;
+        } else if (evict->refs > 0) {
+            continue;
+        }
+        HASH_DELETE(hh, util_regex_cache, evict);
+        util_regex_cache_count -= 1;
+        if (evict->extra) {
+            pcre_free_study(evict->extra);
+        }
+        pcre_free(evict->re);
+        free(evict->key);
+        free(evict);
+    }
+
+    HASH_ADD_KEYPTR(hh, util_regex_cache, cregex->key, strlen(cregex->key), cregex);
+    util_regex_cache_count += 1;
+    return cregex;
+}
+
+/**
+ * Wrapper for pcre_exec on a compiled regex
+ * Safe to call from any thread
+ */
+int util_exec_regex(cregex_t* cregex, char* subject, int length, int offset, int options, int* ovector, int ovecsize) {
+    return pcre_exec(cregex->re, cregex->extra, subject, length, offset, options, ovector, ovecsize);
+}
+
+/**
+ * Release a regex returned by util_compile_regex. It stays cached until it
+ * is evicted.
+ */
+int util_release_regex(cregex_t* cregex) {
+    cregex->refs -= 1;
+    return ATTO_RC_OK;
 }
 
 /**
  * Returns a color_pair for a fg and bg
- * If it does not already exist, the color pair is created
- * Returns 0 if there are too many color pairs defined
+ * If it does not already exist, the color pair is created. Pairs are never
+ * redefined, since attrs already handed out keep using them.
+ * Returns 0 if color pairs are not available
  */
 int util_get_ncurses_color_pair(int fg_num, int bg_num) {
-    static short pair_count = 0;
-    short pair_start = 2;
-    short pair_end = pair_start + pair_count - 1;
-    short pair;
-    short tmp_fg_num;
-    short tmp_bg_num;
-
-    for (pair = pair_start; pair <= pair_end; pair++) {
-        pair_content(pair, &tmp_fg_num, &tmp_bg_num);
-        if (tmp_fg_num == fg_num && tmp_bg_num == bg_num) {
-            return COLOR_PAIR(pair);
-        }
+    cpair_t* cpair;
+    int key;
+
+    // Look in cache
+    key = (int)(((unsigned int)fg_num & 0xffff) << 16 | ((unsigned int)bg_num & 0xffff));
+    HASH_FIND_INT(util_cpair_cache, &key, cpair);
+    if (cpair) {
+        return COLOR_PAIR(cpair->pair);
     }
 
-    pair = pair_start + pair_count;
-    if (pair >= COLOR_PAIRS) {
-        // Too many pairs defined
+    if (ATTO_COLOR_PAIR_START + util_cpair_count >= ATTO_MIN(COLOR_PAIRS, ATTO_COLOR_PAIR_MAX)) {
+        // All pairs are taken
         return 0;
     }
 
-    init_pair(pair, fg_num, bg_num);
-    pair_count += 1;
-    return COLOR_PAIR(pair);
+    // Define a new pair
+    cpair = (cpair_t*)calloc(1, sizeof(cpair_t));
+    cpair->pair = ATTO_COLOR_PAIR_START + util_cpair_count;
+    util_cpair_count += 1;
+    cpair->key = key;
+    init_pair(cpair->pair, fg_num, bg_num);
+    HASH_ADD_INT(util_cpair_cache, key, cpair);
+    return COLOR_PAIR(cpair->pair);
 }
 
 /**
@@ -1,6 +1,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 #include "ext/bstrlib/bstrlib.h"
 #include "ext/uthash/utarray.h"
@@ -11,7 +17,6 @@
 
 extern FILE* fdebug;
 extern lua_State* lua_state;
-extern control_t* buffer_view_head;
 
 /**
  * Make a new buffer
@@ -28,8 +33,10 @@ buffer_t* buffer_new() {
     utarray_new(buffer->line_offsets, &ut_int_icd);
     utarray_push_back(buffer->line_offsets, &zero); // 0 -> 0
     buffer->buffer_listener_head = NULL;
+    buffer->buffer_view_head = NULL;
     buffer->buffer_id = buffer_id;
     buffer->rule_adhoc_head = NULL;
+    buffer->key = (void*)buffer;
     buffer_id += 1;
     return buffer;
 }
@@ -58,25 +65,31 @@ int buffer_splice(
     int pre_line_count = buffer->line_count;
     int buffer_offset = buffer_get_buffer_offset(buffer, line, offset);
     int new_buffer_offset;
-    bstring insert_str = bfromcstr(str);
-    int chars_to_insert = blength(insert_str);
+    int chars_to_insert = strlen(str);
     int line_delta;
+    struct tagbstring insert_str;
 
+    if (chars_to_delete > blength(buffer->buffer) - buffer_offset) {
+        chars_to_delete = blength(buffer->buffer) - buffer_offset;
+    }
     if (chars_to_delete > 0) {
         // Delete chars_to_delete chars at buffer_offset
         bdelete(buffer->buffer, buffer_offset, chars_to_delete);
+    } else {
+        chars_to_delete = 0;
     }
-    // Insert insert_str at buffer_offset
-    binsert(buffer->buffer, buffer_offset, insert_str, ' ');
+    // Insert str at buffer_offset
+    btfromblk(insert_str, str, chars_to_insert);
+    binsert(buffer->buffer, buffer_offset, &insert_str, ' ');
 
-    // Update char_count
-    buffer->char_count = buffer->char_count + chars_to_insert - chars_to_delete;
-    if (buffer->char_count < 0) {
-        buffer->char_count = 0;
-    }
+    // Patch line offsets around the edit and update counts
+    buffer_update_line_offsets(buffer, buffer_offset, chars_to_delete, str, chars_to_insert);
 
-    // Calculate line offsets
-    buffer_calc_line_offsets(buffer);
+    // Remember the edit so listeners can patch their own offsets
+    buffer->edit_version += 1;
+    buffer->edit_offset = buffer_offset;
+    buffer->edit_deleted = chars_to_delete;
+    buffer->edit_inserted = chars_to_insert;
 
     // Calculate new_buffer_offset
     new_buffer_offset = buffer_offset + chars_to_insert;
@@ -174,45 +187,152 @@ int buffer_get_buffer_offset(buffer_t* buffer, int line, int offset) {
  */
 int buffer_calc_line_offsets(buffer_t* buffer) {
 
-    int look_offset = 0;
-    int newline_offset = 0;
-    int line_count = 0;
-    int* line_offset_elem;
-    bstring newline = bfromcstr("\n");
+    int zero = 0;
 
-    while (1) {
-        line_count += 1;
-        // Find next newline
-        newline_offset = binstr(buffer->buffer, look_offset, newline);
-        if (newline_offset == BSTR_ERR) {
-            // No more newlines; break
-            break;
-        }
-        newline_offset += 1; // Increment to get to first char of line
+    utarray_clear(buffer->line_offsets);
+    utarray_push_back(buffer->line_offsets, &zero); // 0 -> 0
+    buffer_scan_line_offsets(buffer, 0, blength(buffer->buffer));
 
-        if (utarray_len(buffer->line_offsets) < line_count + 1) {
-            // Resize array if necessary
-            utarray_resize(buffer->line_offsets, line_count + 1);
-        }
+    // Update line_count and char_count
+    buffer->line_count = utarray_len(buffer->line_offsets);
+    buffer->char_count = blength(buffer->buffer);
 
-        // Let buffer->line_offsets[line_count - 1] = newline_offset
-        line_offset_elem = (int*)utarray_eltptr(buffer->line_offsets, line_count);
-        *line_offset_elem = newline_offset;
+    return 0;
+}
 
-        // Advance look_offset
-        look_offset = newline_offset;
+/**
+ * Append to buffer->line_offsets the start of every line that begins after
+ * a newline in buffer->buffer between start_offset and end_offset
+ *
+ * @param buffer_t* buffer
+ * @param int start_offset
+ * @param int end_offset exclusive
+ */
+int buffer_scan_line_offsets(buffer_t* buffer, int start_offset, int end_offset) {
+
+    char* data = (char*)buffer->buffer->data;
+    char* cur = data + start_offset;
+    char* end = data + end_offset;
+    int line_offset;
+
+    // libc's memchr compares a vector of bytes at a time
+    while (cur < end && (cur = (char*)memchr(cur, '\n', end - cur)) != NULL) {
+        cur += 1;
+        line_offset = cur - data;
+        utarray_push_back(buffer->line_offsets, &line_offset);
     }
 
-    // Resize
-    utarray_resize(buffer->line_offsets, line_count);
+    return 0;
+}
 
-    // Update line_count and char_count
-	buffer->line_count = line_count;
+/**
+ * Patch buffer->line_offsets after chars_deleted chars at buffer_offset were
+ * replaced by the chars_inserted chars of inserted
+ *
+ * Only entries for lines after buffer_offset are touched: entries for
+ * deleted newlines are dropped, entries for inserted newlines are added,
+ * and the rest are shifted by the size delta.
+ *
+ * @param buffer_t* buffer
+ * @param int buffer_offset offset of the edit
+ * @param int chars_deleted
+ * @param const char* inserted
+ * @param int chars_inserted
+ */
+int buffer_update_line_offsets(buffer_t* buffer, int buffer_offset, int chars_deleted, const char* inserted, int chars_inserted) {
+
+    int first;
+    int last;
+    int added = 0;
+    int old_len;
+    int new_len;
+    int delta = chars_inserted - chars_deleted;
+    int i;
+    int* offsets;
+    const char* cur;
+    const char* end = inserted + chars_inserted;
+
+    // Entries first thru last-1 start after a deleted newline
+    old_len = utarray_len(buffer->line_offsets);
+    first = buffer_get_line_at_offset(buffer, buffer_offset) + 1;
+    last = buffer_get_line_at_offset(buffer, buffer_offset + chars_deleted) + 1;
+
+    for (cur = inserted; (cur = memchr(cur, '\n', end - cur)) != NULL; cur++) {
+        added += 1;
+    }
+
+    // Make room for (or close the gap left by) the changed entries
+    new_len = old_len - (last - first) + added;
+    if (new_len > old_len) {
+        utarray_resize(buffer->line_offsets, new_len);
+    }
+    offsets = (int*)utarray_front(buffer->line_offsets);
+    memmove(offsets + first + added, offsets + last, (old_len - last) * sizeof(int));
+    if (new_len < old_len) {
+        utarray_resize(buffer->line_offsets, new_len);
+        offsets = (int*)utarray_front(buffer->line_offsets);
+    }
+
+    // Add entries for inserted newlines, then shift the tail
+    i = first;
+    for (cur = inserted; (cur = memchr(cur, '\n', end - cur)) != NULL; cur++) {
+        offsets[i++] = buffer_offset + (cur - inserted) + 1;
+    }
+    for (i = first + added; i < new_len; i++) {
+        offsets[i] += delta;
+    }
+
+    buffer->line_count = new_len;
     buffer->char_count = blength(buffer->buffer);
 
     return 0;
 }
 
+/**
+ * Given a buffer offset, return the line it is on
+ *
+ * Recently found lines are checked first, then line_offsets is searched.
+ *
+ * @param buffer_t* buffer
+ * @param int buffer_offset
+ * @return int last line that starts at or before buffer_offset
+ */
+int buffer_get_line_at_offset(buffer_t* buffer, int buffer_offset) {
+
+    int lo = 0;
+    int hi = utarray_len(buffer->line_offsets) - 1;
+    int mid;
+    int i;
+    int cached;
+    int* offsets = (int*)utarray_front(buffer->line_offsets);
+
+    // Try recently found lines first. Entries may be stale after an edit,
+    // but a hit is checked against the current offsets so it is still right.
+    for (i = 0; i < BUFFER_LINE_CACHE_SIZE; i++) {
+        cached = buffer->line_cache[i];
+        if (cached <= hi
+            && offsets[cached] <= buffer_offset
+            && (cached == hi || offsets[cached + 1] > buffer_offset)
+        ) {
+            return cached;
+        }
+    }
+
+    // Binary search; offsets[0] is always 0
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (offsets[mid] <= buffer_offset) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    buffer->line_cache[buffer->line_cache_next] = lo;
+    buffer->line_cache_next = (buffer->line_cache_next + 1) % BUFFER_LINE_CACHE_SIZE;
+    return lo;
+}
+
 /**
  * Mark line_start to line_end (inclusive) as having been modified (dirty)
  *
@@ -247,11 +367,8 @@ int buffer_dirty_lines(buffer_t* buffer, int line_start, int line_end, int line_
  */
 int buffer_get_line_and_offset(buffer_t* buffer, int buffer_offset, int* line, int* offset) {
 
-    int prev_start_offset = 0;
-    int cur_line = 0;
-    int last_line_length;
+    int line_length;
     int* start_offset;
-    int* last_line_offset;
 
     if (buffer_offset < 1) {
         // buffer_offset < 1 resolves to line=0,offset=0
@@ -260,120 +377,117 @@ int buffer_get_line_and_offset(buffer_t* buffer, int buffer_offset, int* line, i
         return 0;
     }
 
-    // Loop through line offsets
-    for (
-        start_offset = (int*)utarray_front(buffer->line_offsets);
-        start_offset != NULL;
-        start_offset = (int*)utarray_next(buffer->line_offsets, start_offset)
-    ) {
-        if (*start_offset == buffer_offset) {
-            // buffer_offset is at start of cur_line
-            *line = cur_line;
-            *offset = 0;
-            return 0;
-        } else if (*start_offset > buffer_offset) {
-            // buffer_offset is at some offset on cur_line
-            *line = cur_line - 1;
-            if (*line < 0) {
-                *line = 0;
-            }
-            *offset = buffer_offset - prev_start_offset;
-            if (*offset < 0) {
-                *offset = 0;
-            }
-            return 0;
+    *line = buffer_get_line_at_offset(buffer, buffer_offset);
+    start_offset = (int*)utarray_eltptr(buffer->line_offsets, *line);
+    *offset = buffer_offset - *start_offset;
+    if (*line == buffer->line_count - 1) {
+        // Clamp to the end of the last line
+        line_length = buffer->char_count - *start_offset;
+        if (line_length < *offset) {
+            *offset = line_length;
         }
-        // buffer_offset is on some other line
-        prev_start_offset = *start_offset;
-        cur_line += 1;
-    }
-
-    // If we get here, buffer_offset is somewhere on the last line
-    *line = buffer->line_count - 1;
-    if (*line < 0) {
-        *line = 0;
-    }
-    last_line_offset = (int*)utarray_eltptr(buffer->line_offsets, buffer->line_count - 1);
-    last_line_length = buffer->char_count - *last_line_offset;
-    *offset = buffer_offset - prev_start_offset;
-    if (last_line_length < *offset) {
-        *offset = last_line_length;
     }
     if (*offset < 0) {
         *offset = 0;
     }
-	return 0;
+    return 0;
 
 }
 
 /**
- * Get line(s) from buffer as an array of character arrays
+ * Point data at a line in buffer without copying it
+ *
+ * The view is not NUL-terminated and is only good until the next edit.
  *
  * @param buffer_t* buffer
- * @param int dirty_line_start
- * @param int dirty_line_end
- * @param int* line_count
+ * @param int line
+ * @param char** data start of line
+ * @param int* length length of line without its newline
+ * @return int 0 on success, 1 if there is no such line
  */
-char** buffer_get_lines(buffer_t* buffer, int dirty_line_start, int dirty_line_end, int* line_count) {
+int buffer_get_line_view(buffer_t* buffer, int line, char** data, int* length) {
 
-    int line;
-    char** lines;
+    int* offsets;
 
-    *line_count = 0;
-
-    int line_count_max = dirty_line_end - dirty_line_start + 1;
-    if (line_count_max < 1) {
-        return NULL;
+    if (line < 0 || line >= buffer->line_count) {
+        return 1;
     }
 
-    lines = (char**)malloc(line_count_max * sizeof(char*)); // TODO need to restructure / free this memory
-    for (line = dirty_line_start; line <= dirty_line_end; line++) {
-        *(lines + *line_count) = buffer_get_line(buffer, line);
-        if (*(lines + *line_count) == NULL) {
-            //break;
-        }
-        *line_count += 1;
+    offsets = (int*)utarray_front(buffer->line_offsets);
+    *data = (char*)buffer->buffer->data + offsets[line];
+    if (line + 1 < buffer->line_count) {
+        *length = offsets[line + 1] - 1 - offsets[line];
+    } else {
+        *length = buffer->char_count - offsets[line];
     }
-
-    return lines;
+    return 0;
 
 }
 
 /**
- * Get a single line from buffer as a character array
+ * Point data at a range in buffer without copying it
+ *
+ * The range is clamped to the buffer. Like a line view, it is not
+ * NUL-terminated and is only good until the next edit.
  *
  * @param buffer_t* buffer
- * @param int line
- * @return char* line
+ * @param int start_offset
+ * @param int length
+ * @param char** data start of range
+ * @param int* range_length length after clamping
+ * @return int 0 on success, 1 if start_offset is out of bounds
  */
-char* buffer_get_line(buffer_t* buffer, int line) {
+int buffer_get_range_view(buffer_t* buffer, int start_offset, int length, char** data, int* range_length) {
 
-    int start_offset = 0;
-    int length = 0;
-    bstring line_str;
-
-    if (line < 0 || line >= buffer->line_count) {
-        return NULL;
+    if (start_offset < 0 || start_offset > buffer->char_count) {
+        return 1;
     }
-
-    buffer_get_line_offset_and_length(buffer, line, &start_offset, &length);
-    line_str = bmidstr(buffer->buffer, start_offset, length);
-
-    return line_str != NULL ? (char*)line_str->data : NULL;
+    if (length < 0) {
+        length = 0;
+    } else if (length > buffer->char_count - start_offset) {
+        length = buffer->char_count - start_offset;
+    }
+    *data = (char*)buffer->buffer->data + start_offset;
+    *range_length = length;
+    return 0;
 
 }
 
 /**
- * Get a range from buffer as a character array
+ * Start iterating over lines line_start thru line_end (inclusive)
  *
+ * @param buffer_line_iter_t* iter
  * @param buffer_t* buffer
- * @param int start_offset
- * @param int length
- * @return char* range
+ * @param int line_start
+ * @param int line_end
+ */
+int buffer_line_iter_init(buffer_line_iter_t* iter, buffer_t* buffer, int line_start, int line_end) {
+    iter->buffer = buffer;
+    iter->line = line_start - 1;
+    iter->line_end = line_end;
+    iter->data = NULL;
+    iter->length = 0;
+    return 0;
+}
+
+/**
+ * Advance iter to its next line and point iter->data at it
+ *
+ * Lines past the end of the buffer are yielded with iter->data NULL.
+ *
+ * @param buffer_line_iter_t* iter
+ * @return int 1 if iter is on a line, 0 when done
  */
-char* buffer_get_range(buffer_t* buffer, int start_offset, int length) {
-    bstring line_str = bmidstr(buffer->buffer, start_offset, length);
-    return line_str != NULL ? (char*)line_str->data : NULL;
+int buffer_line_iter_next(buffer_line_iter_t* iter) {
+    iter->line += 1;
+    if (iter->line > iter->line_end) {
+        return 0;
+    }
+    if (buffer_get_line_view(iter->buffer, iter->line, &iter->data, &iter->length)) {
+        iter->data = NULL;
+        iter->length = 0;
+    }
+    return 1;
 }
 
 /**
@@ -410,25 +524,110 @@ int buffer_get_line_offset_and_length(buffer_t* buffer, int line, int* start_off
 /**
  * Load buffer from a file
  *
+ * Regular files are read into a buffer sized from stat, so it is not
+ * reallocated unless the file turns out bigger than stat said. Reads are
+ * at most BUFFER_LOAD_READ_SIZE bytes and each is scanned for line offsets
+ * as soon as it is read, while still in cache.
+ *
  * @param buffer_t* buffer
  * @param char* filename
  */
 int buffer_load_from_file(buffer_t* buffer, char* filename) {
+
     control_t* tmp;
-    FILE* fp = fopen(filename, "r");
-    if (fp == NULL) {
+    int old_char_count = buffer->char_count;
+    bstring old_data = buffer->buffer;
+    bstring data;
+    struct stat file_stat;
+    bool is_sized = FALSE;
+    int alloc_len = BUFFER_LOAD_READ_SIZE;
+    int read_len;
+    ssize_t nread;
+    unsigned char probe;
+    bool is_error = FALSE;
+    int zero = 0;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
         return 1;
     }
-    buffer->buffer = bread((bNread)fread, fp);
-    fclose(fp);
+    if (fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && file_stat.st_size < INT_MAX) {
+        is_sized = TRUE;
+        alloc_len = (int)file_stat.st_size + 1;
+    }
+
+    data = bfromcstralloc(alloc_len, "");
+    buffer->buffer = data;
+    utarray_clear(buffer->line_offsets);
+    utarray_push_back(buffer->line_offsets, &zero); // 0 -> 0
+    while (1) {
+        read_len = MIN(data->mlen - 1 - data->slen, BUFFER_LOAD_READ_SIZE);
+        if (read_len < 1 && is_sized) {
+            // The stat size is only a first guess; files in /proc report 0
+            // and files can grow. Trust it only if there is nothing past it.
+            nread = read(fd, &probe, 1);
+            if (nread < 0 && errno == EINTR) {
+                continue;
+            } else if (nread <= 0) {
+                is_error = nread < 0;
+                break;
+            }
+            is_sized = FALSE;
+            if (data->mlen > INT_MAX / 2
+                || balloc(data, MAX(data->mlen * 2, BUFFER_LOAD_READ_SIZE)) != BSTR_OK
+            ) {
+                is_error = TRUE;
+                break;
+            }
+            data->data[data->slen] = probe;
+            data->slen += 1;
+            buffer_scan_line_offsets(buffer, data->slen - 1, data->slen);
+            continue;
+        } else if (read_len < 1) {
+            if (data->mlen > INT_MAX / 2 || balloc(data, data->mlen * 2) != BSTR_OK) {
+                is_error = TRUE;
+                break;
+            }
+            continue;
+        }
+        nread = read(fd, data->data + data->slen, read_len);
+        if (nread < 0 && errno == EINTR) {
+            continue;
+        } else if (nread <= 0) {
+            is_error = nread < 0;
+            break;
+        }
+        data->slen += nread;
+        buffer_scan_line_offsets(buffer, data->slen - nread, data->slen);
+    }
+    close(fd);
+    if (is_error) {
+        // Put back what was there
+        bdestroy(data);
+        buffer->buffer = old_data;
+        buffer_calc_line_offsets(buffer);
+        return 1;
+    }
+    data->data[data->slen] = '\0';
+
+    bdestroy(old_data);
+    if (buffer->filename) {
+        free(buffer->filename);
+    }
     buffer->filename = strdup(filename);
-    buffer_calc_line_offsets(buffer);
-    tmp = buffer_view_head;
+    buffer->line_count = utarray_len(buffer->line_offsets);
+    buffer->char_count = blength(data);
+
+    // Loading replaces everything
+    buffer->edit_version += 1;
+    buffer->edit_offset = 0;
+    buffer->edit_deleted = old_char_count;
+    buffer->edit_inserted = buffer->char_count;
+    tmp = buffer->buffer_view_head;
     while (tmp) {
-        if (tmp->buffer == buffer) {
-            tmp->is_first_render = TRUE;
-        }
-        tmp = tmp->next_buffer_view;
+        tmp->is_first_render = TRUE;
+        tmp = tmp->next_buffer_view_in_buffer;
     }
     return 0;
 }
@@ -460,16 +659,27 @@ int buffer_write_to_file(buffer_t* buffer, char* filename) {
 /**
  * Find needle in haystack starting from start_offset
  *
+ * The last needle searched for stays compiled, so find-next repeats cost
+ * only the scan.
+ *
  * @param buffer_t* haystack
  * @param char* needle
  * @param int start_offset
+ * @param bool is_caseless
  * @return int found offset or -1 if not found
  */
-int buffer_find_next(buffer_t* haystack, char* needle, int start_offset) {
-    bstring bneedle = bfromcstr(needle);
-    int needle_offset = binstr(haystack->buffer, start_offset, bneedle);
-    if (needle_offset == BSTR_ERR) {
-        return -1;
+int buffer_find_next(buffer_t* haystack, char* needle, int start_offset, bool is_caseless) {
+    static util_search_t* search = NULL;
+    int needle_length = strlen(needle);
+    if (search == NULL
+        || search->is_caseless != is_caseless
+        || search->needle_length != needle_length
+        || (is_caseless ? strncasecmp : strncmp)((char*)search->needle, needle, needle_length) != 0
+    ) {
+        if (search != NULL) {
+            util_search_free(search);
+        }
+        search = util_search_new(needle, needle_length, is_caseless);
     }
-    return needle_offset;
+    return util_search_exec(search, (char*)haystack->buffer->data, haystack->char_count, start_offset);
 }
@@ -7,16 +7,26 @@
 #include "control.h"
 #include "highlighter.h"
 
+#define BUFFER_LINE_CACHE_SIZE 4
+#define BUFFER_LOAD_READ_SIZE (1024 * 1024)
+
 typedef struct buffer_s {
     bstring buffer;
     unsigned int char_count;
     unsigned int line_count;
     UT_array* line_offsets;
     struct buffer_listener_s* buffer_listener_head;
+    struct control_s* buffer_view_head;
     void* key;
     int buffer_id;
     char* filename;
     struct syntax_rule_single_s* rule_adhoc_head;
+    int line_cache[BUFFER_LINE_CACHE_SIZE];
+    int line_cache_next;
+    unsigned int edit_version;
+    int edit_offset;
+    int edit_deleted;
+    int edit_inserted;
 } buffer_t;
 
 typedef void (*buffer_on_dirty_lines_fn)(
@@ -27,6 +37,14 @@ typedef void (*buffer_on_dirty_lines_fn)(
     int line_delta
 );
 
+typedef struct buffer_line_iter_s {
+    struct buffer_s* buffer;
+    int line;
+    int line_end;
+    char* data;
+    int length;
+} buffer_line_iter_t;
+
 typedef struct buffer_listener_s {
     void* listener;
     buffer_on_dirty_lines_fn on_dirty_lines;
@@ -46,14 +64,20 @@ int buffer_splice(
 buffer_t* buffer_new();
 int buffer_get_buffer_offset(buffer_t* buffer, int line, int offset);
 int buffer_calc_line_offsets(buffer_t* buffer);
+int buffer_scan_line_offsets(buffer_t* buffer, int start_offset, int end_offset);
+int buffer_update_line_offsets(buffer_t* buffer, int buffer_offset, int chars_deleted, const char* inserted, int chars_inserted);
+int buffer_get_line_at_offset(buffer_t* buffer, int buffer_offset);
 int buffer_dirty_lines(buffer_t* buffer, int line_start, int line_end, int line_delta);
 int buffer_get_line_and_offset(buffer_t* buffer, int new_buffer_offset, int* new_line, int* new_offset);
 int buffer_add_listener(buffer_t* buffer, buffer_on_dirty_lines_fn on_dirty_lines, void* listener);
 int buffer_load_from_file(buffer_t* buffer, char* filename);
+int buffer_write_to_file(buffer_t* buffer, char* filename);
+int buffer_find_next(buffer_t* haystack, char* needle, int start_offset, bool is_caseless);
 
-char** buffer_get_lines(buffer_t* buffer, int dirty_line_start, int dirty_line_end, int* line_count);
-char* buffer_get_line(buffer_t* buffer, int line);
-char* buffer_get_range(buffer_t* buffer, int start_offset, int length);
+int buffer_get_line_view(buffer_t* buffer, int line, char** data, int* length);
+int buffer_get_range_view(buffer_t* buffer, int start_offset, int length, char** data, int* range_length);
+int buffer_line_iter_init(buffer_line_iter_t* iter, buffer_t* buffer, int line_start, int line_end);
+int buffer_line_iter_next(buffer_line_iter_t* iter);
 int buffer_get_line_offset_and_length(buffer_t* buffer, int line, int* start_offset, int* length);
 
 #endif
@@ -26,6 +26,8 @@ extern control_t* prompt_bar;
 lua_State* lua_state;
 command_t* commands = NULL;
 int input_hook_ref = LUA_REFNIL;
+int paste_hook_ref = LUA_REFNIL;
+int handle_mt_ref = LUA_REFNIL;
 
 int command_init() {
 
@@ -37,15 +39,22 @@ int command_init() {
     luaL_openlibs(lua_state);
     lua_settop(lua_state, 0);
 
+    // Metatable shared by buffer view handles. Handles are checked against
+    // this ref instead of by name to keep commands cheap.
+    lua_newtable(lua_state);
+    handle_mt_ref = luaL_ref(lua_state, LUA_REGISTRYINDEX);
+
     // Register commands
     COMMAND_REGISTER(commands, command_tmp, buffer_read);
     COMMAND_REGISTER(commands, command_tmp, buffer_write);
     COMMAND_REGISTER(commands, command_tmp, buffer_insert);
+    COMMAND_REGISTER(commands, command_tmp, buffer_insert_batch);
     COMMAND_REGISTER(commands, command_tmp, buffer_insert_newline);
     COMMAND_REGISTER(commands, command_tmp, buffer_insert_tab);
     COMMAND_REGISTER(commands, command_tmp, buffer_delete_before);
     COMMAND_REGISTER(commands, command_tmp, buffer_delete_after);
     COMMAND_REGISTER(commands, command_tmp, buffer_cursor_move);
+    COMMAND_REGISTER(commands, command_tmp, buffer_cursor_move_batch);
     COMMAND_REGISTER(commands, command_tmp, buffer_cursor_home);
     COMMAND_REGISTER(commands, command_tmp, buffer_cursor_end);
     COMMAND_REGISTER(commands, command_tmp, syntax_define);
@@ -55,9 +64,12 @@ int command_init() {
     COMMAND_REGISTER(commands, command_tmp, syntax_edit_rule_adhoc);
     COMMAND_REGISTER(commands, command_tmp, syntax_remove_rule_adhoc);
     COMMAND_REGISTER(commands, command_tmp, input_set_hook);
+    COMMAND_REGISTER(commands, command_tmp, input_set_escape_timeout);
+    COMMAND_REGISTER(commands, command_tmp, input_set_paste_hook);
     COMMAND_REGISTER(commands, command_tmp, buffer_get_prompt_id);
     COMMAND_REGISTER(commands, command_tmp, buffer_get_active_id);
     COMMAND_REGISTER(commands, command_tmp, buffer_set_active_id);
+    COMMAND_REGISTER(commands, command_tmp, buffer_get_handle);
     COMMAND_REGISTER(commands, command_tmp, buffer_get_line);
     COMMAND_REGISTER(commands, command_tmp, buffer_clear);
     COMMAND_REGISTER(commands, command_tmp, buffer_splice);
@@ -107,13 +119,43 @@ int command_handle_keychord(keychord_t* keychord) {
     return 0;
 }
 
+int command_handle_paste(bstring paste) {
+    int error_code;
+    int new_line = 0;
+    int new_offset = 0;
+    control_t* control;
+
+    // Without a hook, insert the whole paste at the cursor in one splice
+    if (paste_hook_ref == LUA_REFNIL) {
+        control = control_get_active_buffer_view();
+        if (!control || blength(paste) < 1) {
+            return 1;
+        }
+        buffer_splice(control->buffer, control->cursor_line, control->cursor_offset, bdata(paste), 0, &new_line, &new_offset);
+        control_set_cursor(control, new_line, new_offset, TRUE);
+        return 0;
+    }
+
+    lua_rawgeti(lua_state, LUA_REGISTRYINDEX, paste_hook_ref);
+    lua_pushlstring(lua_state, bdata(paste), blength(paste));
+    error_code = lua_pcall(lua_state, 1, 0, 0);
+    if (error_code != 0) {
+        lua_pop(lua_state, 1);
+    }
+    return 0;
+}
+
 control_t* command_get_buffer_view_by_id_at_arg(lua_State* L, int argn) {
 
     int buffer_id = 0;
     control_t* buffer_view;
 
-    buffer_id = luaL_checkint(L, argn);
-    buffer_view = control_get_buffer_view_by_id(buffer_id);
+    if (lua_type(L, argn) == LUA_TUSERDATA) {
+        buffer_view = command_get_buffer_view_by_handle(L, argn);
+    } else {
+        buffer_id = luaL_checkint(L, argn);
+        buffer_view = control_get_buffer_view_by_id(buffer_id);
+    }
 
     if (!buffer_view || !buffer_view->buffer) {
         return NULL;
@@ -122,6 +164,45 @@ control_t* command_get_buffer_view_by_id_at_arg(lua_State* L, int argn) {
 
 }
 
+control_t* command_get_buffer_view_by_handle(lua_State* L, int argn) {
+
+    int is_handle;
+
+    if (!lua_getmetatable(L, argn)) {
+        return NULL;
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, handle_mt_ref);
+    is_handle = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (!is_handle) {
+        return NULL;
+    }
+    return *(control_t**)lua_touserdata(L, argn);
+
+}
+
+int command_execute_buffer_get_handle(lua_State* L) {
+
+    control_t** handle;
+    control_t* buffer_view = command_get_buffer_view_by_id_at_arg(L, 1);
+    if (!buffer_view) {
+        LUA_RETURN_NIL(L);
+    }
+
+    // Buffer views are never freed, so each gets one handle for good and
+    // handles of the same buffer view compare equal
+    if (buffer_view->handle_ref == 0) {
+        handle = (control_t**)lua_newuserdata(L, sizeof(control_t*));
+        *handle = buffer_view;
+        lua_rawgeti(L, LUA_REGISTRYINDEX, handle_mt_ref);
+        lua_setmetatable(L, -2);
+        buffer_view->handle_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    lua_rawgeti(L, LUA_REGISTRYINDEX, buffer_view->handle_ref);
+    return 1;
+
+}
+
 int command_execute_buffer_read(lua_State* L) {
     char* filename;
     control_t* buffer_view = command_get_buffer_view_by_id_at_arg(L, 1);
@@ -182,6 +263,39 @@ int command_execute_buffer_insert(lua_State* L) {
     LUA_RETURN_TRUE(L);
 }
 
+int command_execute_buffer_insert_batch(lua_State* L) {
+
+    // Insert every string in a table with a single splice
+    char* str;
+    int i;
+    int count;
+    int new_line = 0;
+    int new_offset = 0;
+    luaL_Buffer strs;
+    control_t* control = command_get_buffer_view_by_id_at_arg(L, 1);
+    if (!control) {
+        LUA_RETURN_FALSE(L);
+    }
+
+    luaL_checktype(L, 2, LUA_TTABLE);
+    count = lua_rawlen(L, 2);
+    luaL_buffinit(L, &strs);
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(L, 2, i);
+        if (!lua_isstring(L, -1)) {
+            return luaL_argerror(L, 2, "expected a table of strings");
+        }
+        luaL_addvalue(&strs);
+    }
+    luaL_pushresult(&strs);
+    str = (char*)lua_tostring(L, -1);
+
+    buffer_splice(control->buffer, control->cursor_line, control->cursor_offset, str, 0, &new_line, &new_offset);
+    control_set_cursor(control, new_line, new_offset, TRUE);
+
+    LUA_RETURN_TRUE(L);
+}
+
 int command_execute_buffer_insert_newline(lua_State* L) {
 
     int new_line = 0;
@@ -256,26 +370,17 @@ int command_execute_buffer_delete_after(lua_State* L) {
     LUA_RETURN_TRUE(L);
 }
 
-int command_execute_buffer_cursor_move(lua_State* L) {
+int command_buffer_view_cursor_move(control_t* control, int line_delta, int offset_delta) {
 
     int line = 0;
     int offset = 0;
-    int line_delta = 0;
-    int offset_delta = 0;
     int buffer_offset = 0;
     int target_line_offset = 0;
     int target_line_length = 0;
-    control_t* control = command_get_buffer_view_by_id_at_arg(L, 1);
-    if (!control) {
-        LUA_RETURN_FALSE(L);
-    }
 
     line = control->cursor_line;
     offset = control->cursor_offset;
 
-    line_delta = luaL_checkint(L, 2);
-    offset_delta = luaL_checkint(L, 3);
-
     line += line_delta;
     if (line < 0) {
         line = 0;
@@ -294,11 +399,47 @@ int command_execute_buffer_cursor_move(lua_State* L) {
     buffer_offset = buffer_get_buffer_offset(control->buffer, line, offset);
     buffer_get_line_and_offset(control->buffer, buffer_offset, &line, &offset);
 
-    control_set_cursor(control, line, offset, line_delta == 0 ? TRUE : FALSE);
+    return control_set_cursor(control, line, offset, line_delta == 0 ? TRUE : FALSE);
+}
+
+int command_execute_buffer_cursor_move(lua_State* L) {
+
+    control_t* control = command_get_buffer_view_by_id_at_arg(L, 1);
+    if (!control) {
+        LUA_RETURN_FALSE(L);
+    }
+
+    command_buffer_view_cursor_move(control, luaL_checkint(L, 2), luaL_checkint(L, 3));
 
     LUA_RETURN_TRUE(L);
 }
 
+int command_execute_buffer_cursor_move_batch(lua_State* L) {
+
+    // Move the cursor of every buffer view in a table of ids or handles
+    int i;
+    int count;
+    int line_delta = 0;
+    int offset_delta = 0;
+    control_t* control;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    line_delta = luaL_checkint(L, 2);
+    offset_delta = luaL_checkint(L, 3);
+
+    count = lua_rawlen(L, 1);
+    for (i = 1; i <= count; i++) {
+        lua_rawgeti(L, 1, i);
+        control = command_get_buffer_view_by_id_at_arg(L, -1);
+        if (control) {
+            command_buffer_view_cursor_move(control, line_delta, offset_delta);
+        }
+        lua_pop(L, 1);
+    }
+
+    LUA_RETURN_INT(L, count);
+}
+
 int command_execute_buffer_cursor_home(lua_State* L) {
 
     control_t* buffer_view = command_get_buffer_view_by_id_at_arg(L, 1);
@@ -348,6 +489,7 @@ int command_execute_buffer_set_active_id(lua_State* L) {
 int command_execute_buffer_get_line(lua_State* L) {
 
     int line;
+    int length;
     char* str;
     control_t* buffer_view = command_get_buffer_view_by_id_at_arg(L, 1);
     if (!buffer_view) {
@@ -356,9 +498,8 @@ int command_execute_buffer_get_line(lua_State* L) {
 
     line = luaL_checkint(L, 2);
 
-    str = buffer_get_line(buffer_view->buffer, line);
-    if (str) {
-        lua_pushstring(L, str);
+    if (buffer_get_line_view(buffer_view->buffer, line, &str, &length) == 0) {
+        lua_pushlstring(L, str, length);
     } else {
         lua_pushnil(L);
     }
@@ -386,6 +527,7 @@ int command_execute_buffer_find_next(lua_State* L) {
     char* needle;
     int offset;
     int next_offset;
+    bool is_caseless;
     control_t* buffer_view = command_get_buffer_view_by_id_at_arg(L, 1);
     if (!buffer_view) {
         LUA_RETURN_FALSE(L);
@@ -393,8 +535,9 @@ int command_execute_buffer_find_next(lua_State* L) {
 
     needle = luaL_checkstring(L, 2);
     offset = luaL_checkint(L, 3);
+    is_caseless = lua_toboolean(L, 4);
 
-    next_offset = buffer_find_next(buffer_view->buffer, needle, offset);
+    next_offset = buffer_find_next(buffer_view->buffer, needle, offset, is_caseless);
     LUA_RETURN_INT(L, next_offset);
 }
 
@@ -454,6 +597,8 @@ int command_execute_buffer_viewport_get(lua_State* L) {
 int command_execute_buffer_viewport_set(lua_State* L) {
     int line;
     int offset;
+    int line_start_orig;
+    int offset_start_orig;
     control_t* buffer_view = command_get_buffer_view_by_id_at_arg(L, 1);
     if (!buffer_view) {
         LUA_RETURN_FALSE(L);
@@ -462,20 +607,40 @@ int command_execute_buffer_viewport_set(lua_State* L) {
     line = luaL_checkint(L, 2);
     offset = luaL_checkint(L, 3);
 
+    line_start_orig = buffer_view->viewport_line_start;
+    offset_start_orig = buffer_view->viewport_offset_start;
     control_set_viewport(buffer_view, line, offset);
-    control_buffer_view_dirty_lines(
+    command_refresh_viewport(buffer_view, line_start_orig, offset_start_orig);
+
+    LUA_RETURN_TRUE(L);
+}
+
+/**
+ * Redraw a buffer view after its viewport moved, scrolling what is already on
+ * screen when only the line changed
+ *
+ * @param control_t* buffer_view
+ * @param int line_start_orig viewport_line_start before the move
+ * @param int offset_start_orig viewport_offset_start before the move
+ * @return int
+ */
+int command_refresh_viewport(control_t* buffer_view, int line_start_orig, int offset_start_orig) {
+    if (buffer_view->viewport_offset_start == offset_start_orig) {
+        return control_buffer_view_scroll(buffer_view, buffer_view->viewport_line_start - line_start_orig);
+    }
+    return control_buffer_view_dirty_lines(
         buffer_view,
         buffer_view->viewport_line_start,
         buffer_view->viewport_line_end,
         0
     );
-
-    LUA_RETURN_TRUE(L);
 }
 
 int command_execute_buffer_viewport_move(lua_State* L) {
     int line_delta;
     int offset_delta;
+    int line_start_orig;
+    int offset_start_orig;
     control_t* buffer_view = command_get_buffer_view_by_id_at_arg(L, 1);
     if (!buffer_view) {
         LUA_RETURN_FALSE(L);
@@ -484,17 +649,14 @@ int command_execute_buffer_viewport_move(lua_State* L) {
     line_delta = luaL_checkint(L, 2);
     offset_delta = luaL_checkint(L, 3);
 
+    line_start_orig = buffer_view->viewport_line_start;
+    offset_start_orig = buffer_view->viewport_offset_start;
     control_set_viewport(
         buffer_view,
         buffer_view->viewport_line_start + line_delta,
         buffer_view->viewport_offset_start + offset_delta
     );
-    control_buffer_view_dirty_lines(
-        buffer_view,
-        buffer_view->viewport_line_start,
-        buffer_view->viewport_line_end,
-        0
-    );
+    command_refresh_viewport(buffer_view, line_start_orig, offset_start_orig);
 
     LUA_RETURN_TRUE(L);
 }
@@ -512,9 +674,8 @@ int command_execute_buffer_get_range(lua_State* L) {
     start_offset = luaL_checkint(L, 2);
     length = luaL_checkint(L, 3);
 
-    str = buffer_get_range(buffer_view->buffer, start_offset, length);
-    if (str) {
-        lua_pushstring(L, str);
+    if (buffer_get_range_view(buffer_view->buffer, start_offset, length, &str, &length) == 0) {
+        lua_pushlstring(L, str, length);
     } else {
         lua_pushnil(L);
     }
@@ -617,13 +778,28 @@ int command_execute_input_set_hook(lua_State* L) {
     LUA_RETURN_TRUE(L);
 }
 
+int command_execute_input_set_paste_hook(lua_State* L) {
+    luaL_checktype(L, 1, LUA_TFUNCTION);
+    lua_pushvalue(L, 1);
+    paste_hook_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (paste_hook_ref == LUA_REFNIL) {
+        LUA_RETURN_FALSE(L);
+    }
+    LUA_RETURN_TRUE(L);
+}
+
+int command_execute_input_set_escape_timeout(lua_State* L) {
+    input_set_escape_timeout(luaL_checkint(L, 1));
+    LUA_RETURN_TRUE(L);
+}
+
 int command_execute_syntax_define(lua_State* L) {
 
     syntax_t* syntax;
 
     syntax = calloc(1, sizeof(syntax_t));
     syntax->name = strdup(luaL_checkstring(L, 1));
-    syntax->regex_file_pattern = util_pcre_compile(luaL_checkstring(L, 2), NULL, NULL);
+    syntax->regex_file_pattern = util_regex_get((char*)luaL_checkstring(L, 2), 0);
     HASH_ADD_KEYPTR(hh, syntaxes, syntax->name, strlen(syntax->name), syntax);
 
     LUA_RETURN_TRUE(L);
@@ -656,6 +832,7 @@ int command_execute_syntax_add_rule(lua_State* L) {
         rule = &((*rule)->next);
     }
     *rule = syntax_rule_single_new(regex, util_ncurses_getpair(color_fg, color_bg) | other_attrs);
+    syntax->lexer_is_dirty = TRUE;
 
     LUA_RETURN_TRUE(L);
 }
@@ -784,6 +961,7 @@ int command_execute_syntax_remove_rule_adhoc(lua_State* L) {
     }
 
     LL_DELETE(buffer_view->buffer->rule_adhoc_head, rule);
+    syntax_rule_generation += 1;
     LUA_RETURN_TRUE(L);
 }
 
@@ -51,22 +51,29 @@ typedef struct command_s {
 
 int command_init();
 int command_handle_keychord(keychord_t* keychord);
+int command_handle_paste(bstring paste);
 
 control_t* command_get_buffer_view_by_id_at_arg(lua_State* L, int argn);
+control_t* command_get_buffer_view_by_handle(lua_State* L, int argn);
+int command_buffer_view_cursor_move(control_t* control, int line_delta, int offset_delta);
+int command_refresh_viewport(control_t* buffer_view, int line_start_orig, int offset_start_orig);
 
 int command_execute_buffer_read(lua_State* lua_state);
 int command_execute_buffer_write(lua_State* lua_state);
 int command_execute_buffer_insert(lua_State* lua_state);
+int command_execute_buffer_insert_batch(lua_State* lua_state);
 int command_execute_buffer_insert_newline(lua_State* lua_state);
 int command_execute_buffer_insert_tab(lua_State* lua_state);
 int command_execute_buffer_delete_before(lua_State* lua_state);
 int command_execute_buffer_delete_after(lua_State* lua_state);
 int command_execute_buffer_cursor_move(lua_State* lua_state);
+int command_execute_buffer_cursor_move_batch(lua_State* lua_state);
 int command_execute_buffer_cursor_home(lua_State* lua_state);
 int command_execute_buffer_cursor_end(lua_State* lua_state);
 int command_execute_buffer_get_prompt_id(lua_State* L);
 int command_execute_buffer_get_active_id(lua_State* L);
 int command_execute_buffer_set_active_id(lua_State* L);
+int command_execute_buffer_get_handle(lua_State* L);
 int command_execute_buffer_get_line(lua_State* L);
 int command_execute_buffer_get_range(lua_State* L);
 int command_execute_buffer_clear(lua_State* L);
@@ -90,6 +97,8 @@ int command_execute_syntax_add_rule_adhoc(lua_State* L);
 int command_execute_syntax_edit_rule_adhoc(lua_State* L);
 int command_execute_syntax_remove_rule_adhoc(lua_State* L);
 int command_execute_input_set_hook(lua_State* L);
+int command_execute_input_set_escape_timeout(lua_State* L);
+int command_execute_input_set_paste_hook(lua_State* L);
 int command_execute_status_set(lua_State* L);
 
 #endif
@@ -4,6 +4,7 @@
 #include "ext/uthash/uthash.h"
 
 #include "control.h"
+#include "input.h"
 #include "buffer.h"
 #include "highlighter.h"
 #include "util.h"
@@ -17,6 +18,8 @@ control_t* prompt_bar;
 control_t* active;
 control_t* buffer_view_head;
 control_t* buffer_view_tail;
+control_t** buffer_views_by_id = NULL;
+int buffer_views_by_id_size = 0;
 
 int control_init() {
 
@@ -51,6 +54,8 @@ int ncurses_ensure_init() {
     raw();
     noecho();
     keypad(stdscr, TRUE);
+    printf(INPUT_PASTE_ENABLE);
+    fflush(stdout);
     start_color();
     use_default_colors();
     curs_set(1);
@@ -102,13 +107,21 @@ control_t* control_new_buffer_view() {
     control->window_line_num = newwin(1, 1, 1, 1);
     control->window_margin_left = newwin(1, 1, 1, 1);
     control->window_margin_right = newwin(1, 1, 1, 1);
-    control->buffer = buffer_new();
-    buffer_add_listener(control->buffer, control_on_dirty_lines, (void*)control);
+    idlok(control->window, TRUE); // Let ncurses scroll with insert/delete line
+    idlok(control->window_line_num, TRUE);
+    control_buffer_view_attach(control, buffer_new());
     control->resize = control_resize_buffer_view;
     control->render = control_render_buffer_view;
     control->is_first_render = TRUE;
     control->buffer_view_id = buffer_view_id;
     buffer_view_id += 1;
+    if (control->buffer_view_id >= buffer_views_by_id_size) {
+        // Ids are never reused so they index straight into buffer_views_by_id
+        buffer_views_by_id = realloc(buffer_views_by_id, sizeof(control_t*) * (buffer_views_by_id_size + 16));
+        memset(buffer_views_by_id + buffer_views_by_id_size, 0, sizeof(control_t*) * 16);
+        buffer_views_by_id_size += 16;
+    }
+    buffer_views_by_id[control->buffer_view_id] = control;
     if (!buffer_view_head) {
         buffer_view_head = control;
         buffer_view_tail = control;
@@ -202,14 +215,13 @@ int control_resize_buffer_view(control_t* self, int width, int height, int left,
 
 int control_render_buffer_view(control_t* self) {
     if (self->is_first_render) {
-        buffer_dirty_lines(self->buffer, 0, self->buffer->line_count - 1, -1);
-        //control_buffer_view_dirty_lines(self, 0, self->height - 1, FALSE);
+        control_buffer_view_mark_dirty(self, self->viewport_line_start, self->viewport_line_end, -1);
         self->is_first_render = FALSE;
     }
     return 0;
 }
 
-int control_buffer_view_render_line(control_t* self, char* line, int line_on_screen, int line_in_buffer) {
+int control_buffer_view_render_line(control_t* self, char* line, int line_length, int line_on_screen, int line_in_buffer) {
 
     static char line_num_formatted[20]; // TODO #define
     static highlighted_substr_t* highlighted_substrs;
@@ -217,15 +229,15 @@ int control_buffer_view_render_line(control_t* self, char* line, int line_on_scr
     static int i;
 
     // TODO syntax highlighting
-    if (self->highlighter != NULL) {
-        highlighted_substrs = highlighter_highlight(self->highlighter, line, line_in_buffer, &highlighted_substr_count);
+    if (self->highlighter != NULL && line_in_buffer >= 0) {
+        highlighted_substrs = highlighter_highlight(self->highlighter, line, line_length, line_in_buffer, &highlighted_substr_count);
         wmove(self->window, line_on_screen, 0);
         for (i = 0; i < highlighted_substr_count; i++) {
             wattrset(self->window, highlighted_substrs[i].attrs);
             mvwaddnstr(self->window, line_on_screen, highlighted_substrs[i].start_offset, highlighted_substrs[i].substr, highlighted_substrs[i].length);
         }
     } else {
-        mvwaddnstr(self->window, line_on_screen, 0, line, self->width);
+        mvwaddnstr(self->window, line_on_screen, 0, line, MIN(line_length, self->width));
     }
     wclrtoeol(self->window);
 
@@ -262,16 +274,139 @@ int control_buffer_view_clear_lines_from(control_t* self, int clear_line_start)
     return 0;
 }
 
+/**
+ * Attach a buffer view to buffer. Views of the same buffer share its dirty
+ * lines and its highlighter.
+ *
+ * @param control_t* self
+ * @param buffer_t* buffer
+ * @return int
+ */
+int control_buffer_view_attach(control_t* self, buffer_t* buffer) {
+    control_t* tail;
+    self->buffer = buffer;
+    self->next_buffer_view_in_buffer = NULL;
+    if (!buffer->buffer_view_head) {
+        buffer->buffer_view_head = self;
+        buffer_add_listener(buffer, control_on_dirty_lines, NULL);
+        return 0;
+    }
+    tail = buffer->buffer_view_head;
+    while (tail->next_buffer_view_in_buffer) {
+        tail = tail->next_buffer_view_in_buffer;
+    }
+    tail->next_buffer_view_in_buffer = self;
+    self->highlighter = buffer->buffer_view_head->highlighter;
+    return 0;
+}
+
+/**
+ * Mark lines dirty in every view attached to buffer
+ *
+ * @param buffer_t* buffer
+ * @param int line_start
+ * @param int line_end
+ * @param int line_delta negative if lines were removed
+ * @return int
+ */
+int control_buffer_mark_dirty(buffer_t* buffer, int line_start, int line_end, int line_delta) {
+    control_t* cur = buffer->buffer_view_head;
+    while (cur) {
+        control_buffer_view_mark_dirty(cur, line_start, line_end, line_delta);
+        cur = cur->next_buffer_view_in_buffer;
+    }
+    return 0;
+}
+
+/**
+ * Add lines to a view's dirty set, to be rendered on the next flush.
+ * Overlapping or adjacent ranges are merged; once there are
+ * CONTROL_DIRTY_RANGES_MAX ranges, the new one is merged into the nearest.
+ *
+ * @param control_t* self
+ * @param int line_start
+ * @param int line_end
+ * @param int line_delta negative if lines were removed
+ * @return int
+ */
+int control_buffer_view_mark_dirty(control_t* self, int line_start, int line_end, int line_delta) {
+
+    int i;
+    int gap;
+    int nearest = 0;
+    int nearest_gap = -1;
+
+    if (line_delta < 0) {
+        // Lines that used to be at the end of the buffer need clearing
+        self->is_dirty_to_viewport_end = TRUE;
+    }
+    if (line_start > line_end) {
+        return 0;
+    }
+
+    // Absorb every range this one touches
+    i = 0;
+    while (i < self->dirty_range_count) {
+        if (self->dirty_line_starts[i] <= line_end + 1 && line_start <= self->dirty_line_ends[i] + 1) {
+            line_start = MIN(line_start, self->dirty_line_starts[i]);
+            line_end = MAX(line_end, self->dirty_line_ends[i]);
+            self->dirty_range_count -= 1;
+            self->dirty_line_starts[i] = self->dirty_line_starts[self->dirty_range_count];
+            self->dirty_line_ends[i] = self->dirty_line_ends[self->dirty_range_count];
+        } else {
+            i += 1;
+        }
+    }
+
+    if (self->dirty_range_count < CONTROL_DIRTY_RANGES_MAX) {
+        self->dirty_line_starts[self->dirty_range_count] = line_start;
+        self->dirty_line_ends[self->dirty_range_count] = line_end;
+        self->dirty_range_count += 1;
+        return 0;
+    }
+
+    // Full, so grow whichever range is closest
+    for (i = 0; i < self->dirty_range_count; i++) {
+        gap = line_start > self->dirty_line_ends[i]
+            ? line_start - self->dirty_line_ends[i]
+            : self->dirty_line_starts[i] - line_end;
+        if (nearest_gap < 0 || gap < nearest_gap) {
+            nearest_gap = gap;
+            nearest = i;
+        }
+    }
+    self->dirty_line_starts[nearest] = MIN(line_start, self->dirty_line_starts[nearest]);
+    self->dirty_line_ends[nearest] = MAX(line_end, self->dirty_line_ends[nearest]);
+    return 0;
+}
+
+/**
+ * Render a view's dirty lines and empty its dirty set
+ *
+ * @param control_t* self
+ * @return int
+ */
+int control_buffer_view_flush(control_t* self) {
+    int i;
+    if (self->is_dirty_to_viewport_end) {
+        // Lines past the end of the buffer render as empty
+        control_buffer_view_mark_dirty(self, self->buffer->line_count, self->viewport_line_end, 0);
+    }
+    for (i = 0; i < self->dirty_range_count; i++) {
+        control_buffer_view_dirty_lines(self, self->dirty_line_starts[i], self->dirty_line_ends[i], 0);
+    }
+    self->dirty_range_count = 0;
+    self->is_dirty_to_viewport_end = FALSE;
+    return 0;
+}
+
 void control_on_dirty_lines(buffer_t* buffer, void* listener, int line_start, int line_end, int line_delta) {
-    control_buffer_view_dirty_lines((control_t*)listener, line_start, line_end, line_delta);
+    control_buffer_mark_dirty(buffer, line_start, line_end, line_delta);
 }
 
 int control_buffer_view_dirty_lines(control_t* self, int dirty_line_start, int dirty_line_end, int line_delta) {
 
-    char** lines;
-    char* line;
-    int line_count;
-    int i;
+    buffer_line_iter_t iter;
 
     if (self->viewport_line_start > dirty_line_start) {
         dirty_line_start = self->viewport_line_start;
@@ -280,14 +415,14 @@ int control_buffer_view_dirty_lines(control_t* self, int dirty_line_start, int d
         dirty_line_end = self->viewport_line_end;
     }
 
-    lines = buffer_get_lines(self->buffer, dirty_line_start, dirty_line_end, &line_count);
-    for (i = 0; i < line_count; i++) {
-        line = *(lines + i);
+    buffer_line_iter_init(&iter, self->buffer, dirty_line_start, dirty_line_end);
+    while (buffer_line_iter_next(&iter)) {
         control_buffer_view_render_line(
             self,
-            line ? line : "",
-            dirty_line_start + i - self->viewport_line_start,
-            line ? dirty_line_start + i : -1
+            iter.data ? iter.data : "",
+            iter.length,
+            iter.line - self->viewport_line_start,
+            iter.data ? iter.line : -1
         );
     }
 
@@ -303,11 +438,46 @@ int control_buffer_view_dirty_lines(control_t* self, int dirty_line_start, int d
     return 0;
 }
 
+/**
+ * Shift what is on screen by line_delta lines after the viewport has moved
+ * by that much, then render only the newly exposed lines. Falls back to
+ * rendering every line if nothing on screen can be kept.
+ *
+ * @param control_t* self
+ * @param int line_delta lines the viewport moved down (negative for up)
+ * @return int
+ */
+int control_buffer_view_scroll(control_t* self, int line_delta) {
+
+    int height = self->viewport_line_end - self->viewport_line_start + 1;
+
+    if (line_delta == 0 || abs(line_delta) >= height) {
+        return control_buffer_view_dirty_lines(self, self->viewport_line_start, self->viewport_line_end, 0);
+    }
+
+    // Only scroll while blitting so writing the bottom-right cell never does
+    scrollok(self->window, TRUE);
+    scrollok(self->window_line_num, TRUE);
+    wscrl(self->window, line_delta);
+    wscrl(self->window_line_num, line_delta);
+    scrollok(self->window, FALSE);
+    scrollok(self->window_line_num, FALSE);
+
+    if (line_delta > 0) {
+        return control_buffer_view_dirty_lines(self, self->viewport_line_end - line_delta + 1, self->viewport_line_end, 0);
+    }
+    return control_buffer_view_dirty_lines(self, self->viewport_line_start, self->viewport_line_start - line_delta - 1, 0);
+}
+
 int control_render() {
+    control_t* cur;
     title_bar->render(title_bar);
     status_bar->render(status_bar);
     prompt_bar->render(prompt_bar);
     multi_buffer_view->render(multi_buffer_view);
+    for (cur = buffer_view_head; cur; cur = cur->next_buffer_view) {
+        control_buffer_view_flush(cur);
+    }
     control_render_cursor();
     doupdate();
     return 0;
@@ -369,15 +539,10 @@ control_t* control_get_active_buffer_view_from_node(control_t* node) {
 }
 
 control_t* control_get_buffer_view_by_id(int id) {
-    control_t* cur = buffer_view_head;
     if (id < 0) {
         return control_get_active_buffer_view();
-    }
-    while (cur) {
-        if (cur->buffer_view_id == id) {
-            return cur;
-        }
-        cur = cur->next_buffer_view;
+    } else if (id < buffer_views_by_id_size) {
+        return buffer_views_by_id[id];
     }
     return NULL;
 }
@@ -400,6 +565,7 @@ int control_set_cursor(control_t* control, int line, int offset, bool set_target
 
     int viewport_line_delta = 0;
     int viewport_offset_delta = 0;
+    int viewport_line_start_orig = control->viewport_line_start;
     bool viewport_changed = FALSE;
 
     control->cursor_line = line;
@@ -431,7 +597,9 @@ int control_set_cursor(control_t* control, int line, int offset, bool set_target
         viewport_changed = TRUE;
     }
 
-    if (viewport_changed) {
+    if (viewport_changed && viewport_offset_delta == 0) {
+        control_buffer_view_scroll(control, control->viewport_line_start - viewport_line_start_orig);
+    } else if (viewport_changed) {
         control_buffer_view_dirty_lines(control, control->viewport_line_start, control->viewport_line_end, FALSE);
     }
 
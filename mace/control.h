@@ -7,6 +7,7 @@
 
 #define CONTROL_SPLIT_TYPE_HORIZONTAL 0
 #define CONTROL_SPLIT_TYPE_VERTICAL 1
+#define CONTROL_DIRTY_RANGES_MAX 4
 
 typedef struct control_s {
     int width;
@@ -44,6 +45,12 @@ typedef struct control_s {
     bool is_first_render;
     int buffer_view_id;
     struct control_s* next_buffer_view;
+    struct control_s* next_buffer_view_in_buffer;
+    int dirty_line_starts[CONTROL_DIRTY_RANGES_MAX];
+    int dirty_line_ends[CONTROL_DIRTY_RANGES_MAX];
+    int dirty_range_count;
+    bool is_dirty_to_viewport_end;
+    int handle_ref;
 } control_t;
 
 int control_init();
@@ -76,10 +83,15 @@ int control_render_multi_buffer_view(control_t* self);
 int control_render_multi_buffer_view_node(control_t* self);
 int control_render_buffer_view(control_t* self);
 
+int control_buffer_view_attach(control_t* self, struct buffer_s* buffer);
+int control_buffer_mark_dirty(struct buffer_s* buffer, int line_start, int line_end, int line_delta);
+int control_buffer_view_mark_dirty(control_t* self, int line_start, int line_end, int line_delta);
+int control_buffer_view_flush(control_t* self);
 void control_on_dirty_lines(struct buffer_s* buffer, void* listener, int line_start, int line_end, int line_delta);
 int control_buffer_view_dirty_lines(control_t* self, int dirty_line_start, int dirty_line_end, int line_delta);
-int control_buffer_view_render_line(control_t* self, char* line, int line_on_screen, int line_in_buffer);
+int control_buffer_view_render_line(control_t* self, char* line, int line_length, int line_on_screen, int line_in_buffer);
 int control_buffer_view_clear_line(control_t* self, int line);
 int control_buffer_view_clear_lines_from(control_t* self, int clear_line_start);
+int control_buffer_view_scroll(control_t* self, int line_delta);
 
 #endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <pcre.h>
 
@@ -7,18 +8,20 @@
 #include "util.h"
 
 #include "ext/uthash/uthash.h"
+#include "ext/uthash/utlist.h"
 
 extern FILE* fdebug;
 syntax_t* syntaxes = NULL;
-UT_icd syntax_rule_multi_range_icd = { sizeof(syntax_rule_multi_range_t), NULL, NULL, syntax_rule_multi_range_dtor };
+UT_icd syntax_rule_multi_pair_icd = { sizeof(syntax_rule_multi_pair_t), NULL, NULL, NULL };
 int syntax_rule_id = 1;
+int syntax_rule_generation = 1;
+highlighted_substr_t* highlighter_sort_substrs = NULL;
 
 highlighter_t* highlighter_new(buffer_t* buffer, syntax_t* syntax) {
 
     highlighter_t* highlighter = (highlighter_t*)calloc(1, sizeof(highlighter_t));
 
     highlighter->syntax = syntax;
-    highlighter->highlighted_substrs = (highlighted_substr_t*)calloc(MAX_HIGHLIGHTED_SUBSTRS, sizeof(highlighted_substr_t));
     highlighter->buffer = buffer;
 
     buffer_add_listener(buffer, highlighter_on_dirty_lines, (void*)highlighter);
@@ -26,59 +29,91 @@ highlighter_t* highlighter_new(buffer_t* buffer, syntax_t* syntax) {
     return highlighter;
 }
 
-highlighted_substr_t* highlighter_highlight(highlighter_t* self, char* line, int line_in_buffer, int* substr_count) {
+highlighted_substr_t* highlighter_highlight(highlighter_t* self, char* line, int line_length, int line_in_buffer, int* substr_count) {
 
     syntax_rule_single_t* cur_rule;
     syntax_rule_multi_t* cur_multi_rule;
-    int line_length;
     int rc;
     int i;
-    int j;
     int start_offset = 0;
     static int ovector[3];
     static int default_attrs = -1;
-    highlighted_substr_t* temp_workspace_substr = NULL;
-    highlighted_substr_t* current_workspace_substr = NULL;
-    highlighted_substr_t* current_substr = NULL;
-    static highlighted_substr_t* workspace_substrs = NULL;
-    int workspace_substrs_count = 0;
     syntax_rule_multi_workspace_t* multi_workspace = NULL;
-    syntax_rule_multi_range_t* multi_range = NULL;
+    syntax_rule_multi_pair_t* multi_pair = NULL;
+    int pairs_len;
+    int line_offset;
+    int multi_rule_index;
     bool is_adhoc_iter = FALSE;
+    highlighter_cache_key_t cache_key;
+    highlighted_substr_t* cached_substrs;
 
     if (default_attrs == -1) {
          default_attrs = util_ncurses_getpair("default_fg", "default_bg");
     }
-    if (workspace_substrs == NULL) {
-        workspace_substrs = (highlighted_substr_t*)calloc(MAX_HIGHLIGHTED_SUBSTRS, sizeof(highlighted_substr_t));
-    }
 
     *substr_count = 0;
+    self->workspace_substrs_count = 0;
 
     if (self->syntax == NULL) {
         return NULL;
     }
 
-    line_length = strlen(line);
+    // Lines highlight the same if their content, whether they start and end
+    // inside each multi-line rule, and the rules themselves are the same
+    memset(&cache_key, 0, sizeof(highlighter_cache_key_t));
+    line_offset = buffer_get_buffer_offset(self->buffer, line_in_buffer, 0);
+    multi_rule_index = 0;
+    cur_multi_rule = self->syntax->rule_multi_head;
+    while (cur_multi_rule != NULL && multi_rule_index < 32) {
+        multi_workspace = syntax_rule_multi_workspace_find_or_new(cur_multi_rule, self->buffer);
+        highlighter_sync_workspace(multi_workspace, cur_multi_rule, NULL, NULL);
+        pairs_len = utarray_len(multi_workspace->pairs);
+        i = highlighter_find_pair(multi_workspace->pairs, line_offset);
+        multi_pair = i < pairs_len ? (syntax_rule_multi_pair_t*)utarray_eltptr(multi_workspace->pairs, i) : NULL;
+        if (multi_pair != NULL && multi_pair->start_offset < line_offset) {
+            cache_key.entry_state |= 1u << multi_rule_index;
+        }
+        i = highlighter_find_pair(multi_workspace->pairs, line_offset + line_length);
+        multi_pair = i < pairs_len ? (syntax_rule_multi_pair_t*)utarray_eltptr(multi_workspace->pairs, i) : NULL;
+        if (multi_pair != NULL && multi_pair->start_offset < line_offset + line_length) {
+            cache_key.exit_state |= 1u << multi_rule_index;
+        }
+        multi_rule_index += 1;
+        cur_multi_rule = cur_multi_rule->next;
+    }
+    if (cur_multi_rule == NULL) {
+        cache_key.hash = highlighter_hash_line(line, line_length);
+        cache_key.length = line_length;
+        cache_key.rule_generation = syntax_rule_generation;
+        cached_substrs = highlighter_cache_get(self, &cache_key, line, substr_count);
+        if (cached_substrs != NULL) {
+            return cached_substrs;
+        }
+    }
 
     // Default highlighting rule
-    temp_workspace_substr = (workspace_substrs + workspace_substrs_count);
-    temp_workspace_substr->attrs = default_attrs;
-    temp_workspace_substr->substr = line;
-    temp_workspace_substr->start_offset = 0;
-    temp_workspace_substr->end_offset = line_length - 1;
-    temp_workspace_substr->length = line_length;
-    workspace_substrs_count += 1;
+    highlighter_add_substr(self, default_attrs, 0, line_length - 1);
 
     // Single-line highlighting rules
     cur_rule = self->syntax->rule_single_head;
+
+    // If the syntax's leading rules are combined, find them all in one pass
+    if (self->syntax->lexer_is_dirty) {
+        syntax_update_lexer(self->syntax);
+    }
+    if (self->syntax->lexer_rules_len > 0) {
+        highlighter_add_lexer_substrs(self, line, line_length);
+        for (i = 0; i < self->syntax->lexer_rules_len; i++) {
+            cur_rule = cur_rule->next;
+        }
+    }
+
     while (1) {
         while (cur_rule != NULL) {
             start_offset = 0;
             while (1) {
-                rc = pcre_exec(
+                rc = util_regex_exec(
                     cur_rule->regex,
-                    NULL,
                     line,
                     line_length,
                     start_offset,
@@ -91,13 +126,7 @@ highlighted_substr_t* highlighter_highlight(highlighter_t* self, char* line, int
                     break;
                 }
 
-                temp_workspace_substr = (workspace_substrs + workspace_substrs_count);
-                temp_workspace_substr->attrs = cur_rule->attrs;
-                temp_workspace_substr->substr = line + ovector[0];
-                temp_workspace_substr->start_offset = ovector[0];
-                temp_workspace_substr->end_offset = ovector[1] - 1;
-                temp_workspace_substr->length = ovector[1] - ovector[0];
-                workspace_substrs_count += 1;
+                highlighter_add_substr(self, cur_rule->attrs, ovector[0], ovector[1] - 1);
 
                 start_offset = ovector[1];
                 if (start_offset >= line_length) {
@@ -120,103 +149,497 @@ highlighted_substr_t* highlighter_highlight(highlighter_t* self, char* line, int
     cur_multi_rule = self->syntax->rule_multi_head;
     while (cur_multi_rule != NULL) {
         multi_workspace = syntax_rule_multi_workspace_find_or_new(cur_multi_rule, self->buffer);
-        multi_range = (syntax_rule_multi_range_t*)utarray_eltptr(multi_workspace->ranges, line_in_buffer);
-        while (multi_range != NULL && multi_range->active) {
-            temp_workspace_substr = (workspace_substrs + workspace_substrs_count);
-            temp_workspace_substr->attrs = cur_multi_rule->attrs;
-            temp_workspace_substr->substr = line + multi_range->start_offset;
-            temp_workspace_substr->start_offset = multi_range->start_offset;
-            temp_workspace_substr->end_offset = multi_range->end_offset;
-            temp_workspace_substr->length = multi_range->end_offset - multi_range->start_offset;
-            workspace_substrs_count += 1;
-            multi_range = multi_range->next;
+        highlighter_sync_workspace(multi_workspace, cur_multi_rule, NULL, NULL);
+        pairs_len = utarray_len(multi_workspace->pairs);
+        for (
+            i = highlighter_find_pair(multi_workspace->pairs, line_offset);
+            i < pairs_len;
+            i++
+        ) {
+            multi_pair = (syntax_rule_multi_pair_t*)utarray_eltptr(multi_workspace->pairs, i);
+            if (multi_pair->start_offset >= line_offset + line_length) {
+                break;
+            }
+            highlighter_add_substr(
+                self,
+                cur_multi_rule->attrs,
+                MAX(multi_pair->start_offset - line_offset, 0),
+                MIN(multi_pair->end_offset - line_offset, line_length - 1)
+            );
         }
         cur_multi_rule = cur_multi_rule->next;
     }
 
-    // Flatten rule matches
+    // Flatten rule matches; later matches win where they overlap
+    *substr_count = highlighter_flatten(self, line, line_length);
+    if (cache_key.length == line_length && cache_key.rule_generation != 0) {
+        highlighter_cache_put(self, &cache_key, self->highlighted_substrs, *substr_count);
+    }
+
+    return self->highlighted_substrs;
+}
+
+/**
+ * Look up a line's highlighting in the cache. A hit becomes the most
+ * recently used entry.
+ *
+ * @param highlighter_t* self
+ * @param highlighter_cache_key_t* key
+ * @param char* line line to point the returned substrs into
+ * @param int* substr_count set to the number of substrs on a hit
+ * @return highlighted_substr_t* substrs, or NULL on a miss
+ */
+highlighted_substr_t* highlighter_cache_get(highlighter_t* self, highlighter_cache_key_t* key, char* line, int* substr_count) {
+
+    highlighter_cache_entry_t* entry;
+    int i;
+
+    HASH_FIND(hh, self->cache, key, sizeof(highlighter_cache_key_t), entry);
+    if (entry == NULL) {
+        return NULL;
+    }
+    HASH_DELETE(hh, self->cache, entry);
+    HASH_ADD(hh, self->cache, key, sizeof(highlighter_cache_key_t), entry);
+
+    for (i = 0; i < entry->substr_count; i++) {
+        entry->substrs[i].substr = line + entry->substrs[i].start_offset;
+    }
+    *substr_count = entry->substr_count;
+    return entry->substrs;
+}
+
+/**
+ * Cache a line's highlighting, recycling the least recently used entry
+ * once there are HIGHLIGHTER_CACHE_SIZE of them
+ *
+ * @param highlighter_t* self
+ * @param highlighter_cache_key_t* key
+ * @param highlighted_substr_t* substrs
+ * @param int substr_count
+ */
+int highlighter_cache_put(highlighter_t* self, highlighter_cache_key_t* key, highlighted_substr_t* substrs, int substr_count) {
+
+    highlighter_cache_entry_t* entry;
+
+    if (self->cache_count < HIGHLIGHTER_CACHE_SIZE) {
+        entry = (highlighter_cache_entry_t*)calloc(1, sizeof(highlighter_cache_entry_t));
+        self->cache_count += 1;
+    } else {
+        // Front of the hash is the least recently used
+        entry = self->cache;
+        HASH_DELETE(hh, self->cache, entry);
+    }
+
+    if (entry->substrs_size < substr_count) {
+        entry->substrs_size = substr_count;
+        entry->substrs = (highlighted_substr_t*)realloc(entry->substrs, substr_count * sizeof(highlighted_substr_t));
+    }
+    memcpy(entry->substrs, substrs, substr_count * sizeof(highlighted_substr_t));
+    entry->substr_count = substr_count;
+    memcpy(&entry->key, key, sizeof(highlighter_cache_key_t));
+    HASH_ADD(hh, self->cache, key, sizeof(highlighter_cache_key_t), entry);
+    return 0;
+}
+
+/**
+ * Hash a line's content (64-bit FNV-1a)
+ *
+ * @param char* line
+ * @param int line_length
+ * @return uint64_t
+ */
+uint64_t highlighter_hash_line(char* line, int line_length) {
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
     for (i = 0; i < line_length; i++) {
-        for (j = workspace_substrs_count - 1; j >= 0; j--) {
-            temp_workspace_substr = (workspace_substrs + j);
-            if (i >= temp_workspace_substr->start_offset && i <= temp_workspace_substr->end_offset) {
-                if (current_workspace_substr != temp_workspace_substr) {
-                    if (current_substr != NULL) {
-                        current_substr->end_offset = i - 1;
-                        current_substr->length = current_substr->end_offset - current_substr->start_offset + 1;
-                    }
-                    current_substr = (self->highlighted_substrs + *substr_count);
-                    current_substr->start_offset = i;
-                    current_substr->attrs = temp_workspace_substr->attrs;
-                    current_substr->substr = line + i;
-                    current_workspace_substr = temp_workspace_substr;
-                    *substr_count += 1;
-                }
-                break;
+        hash ^= (unsigned char)line[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Add a match covering start_offset thru end_offset (inclusive) to the
+ * highlighter's workspace. Empty matches are skipped.
+ *
+ * @param highlighter_t* self
+ * @param int attrs
+ * @param int start_offset
+ * @param int end_offset
+ */
+int highlighter_add_substr(highlighter_t* self, int attrs, int start_offset, int end_offset) {
+
+    highlighted_substr_t* substr;
+
+    if (end_offset < start_offset) {
+        return 0;
+    }
+    if (self->workspace_substrs_count >= self->workspace_substrs_size) {
+        self->workspace_substrs_size = MAX(HIGHLIGHTER_SUBSTRS_INIT, self->workspace_substrs_size * 2);
+        self->workspace_substrs = (highlighted_substr_t*)realloc(self->workspace_substrs, self->workspace_substrs_size * sizeof(highlighted_substr_t));
+    }
+    substr = self->workspace_substrs + self->workspace_substrs_count;
+    substr->attrs = attrs;
+    substr->substr = NULL;
+    substr->start_offset = start_offset;
+    substr->end_offset = end_offset;
+    substr->length = end_offset - start_offset + 1;
+    self->workspace_substrs_count += 1;
+    return 0;
+}
+
+/**
+ * Flatten the workspace matches into non-overlapping highlighted_substrs.
+ * Where matches overlap, the one added last wins.
+ *
+ * Matches are swept in order of their start offsets while a max-heap (by
+ * the order they were added) holds the ones that have started. The top of
+ * the heap is the winner, and it can only change where a match starts or
+ * where the winner ends, so only those offsets are visited.
+ *
+ * @param highlighter_t* self
+ * @param char* line
+ * @param int line_length
+ * @return int number of highlighted_substrs
+ */
+int highlighter_flatten(highlighter_t* self, char* line, int line_length) {
+
+    int count = self->workspace_substrs_count;
+    int substr_count = 0;
+    int next_order = 0;
+    int heap_len = 0;
+    int offset = 0;
+    int winner;
+    int current = -1;
+    int next_offset;
+    highlighted_substr_t* substrs = self->workspace_substrs;
+    highlighted_substr_t* current_substr = NULL;
+
+    if (count < 1 || line_length < 1) {
+        return 0;
+    }
+
+    // Make room
+    if (self->sweep_size < count) {
+        self->sweep_size = MAX(HIGHLIGHTER_SUBSTRS_INIT, count * 2);
+        self->sweep_order = (int*)realloc(self->sweep_order, self->sweep_size * sizeof(int));
+        self->sweep_heap = (int*)realloc(self->sweep_heap, self->sweep_size * sizeof(int));
+    }
+    if (self->highlighted_substrs_size < count * 2 + 1) {
+        self->highlighted_substrs_size = count * 2 + 1;
+        self->highlighted_substrs = (highlighted_substr_t*)realloc(self->highlighted_substrs, self->highlighted_substrs_size * sizeof(highlighted_substr_t));
+    }
+
+    // Order matches by start offset, then by the order they were added
+    for (next_order = 0; next_order < count; next_order++) {
+        self->sweep_order[next_order] = next_order;
+    }
+    highlighter_sort_substrs = substrs;
+    qsort(self->sweep_order, count, sizeof(int), highlighter_compare_substrs);
+    next_order = 0;
+
+    while (offset < line_length) {
+
+        // Start matches that begin here
+        while (next_order < count && substrs[self->sweep_order[next_order]].start_offset <= offset) {
+            highlighter_heap_push(self->sweep_heap, &heap_len, self->sweep_order[next_order]);
+            next_order += 1;
+        }
+
+        // Drop matches that have ended
+        while (heap_len > 0 && substrs[self->sweep_heap[0]].end_offset < offset) {
+            highlighter_heap_pop(self->sweep_heap, &heap_len);
+        }
+
+        // Start a new run if the winner changed. Where nothing matches, the
+        // current run carries on.
+        winner = heap_len > 0 ? self->sweep_heap[0] : -1;
+        if (winner != -1 && winner != current) {
+            if (current_substr != NULL) {
+                current_substr->end_offset = offset - 1;
+                current_substr->length = current_substr->end_offset - current_substr->start_offset + 1;
             }
+            current_substr = self->highlighted_substrs + substr_count;
+            current_substr->attrs = substrs[winner].attrs;
+            current_substr->start_offset = offset;
+            current_substr->substr = line + offset;
+            current = winner;
+            substr_count += 1;
         }
+
+        // Move to where the winner may change next
+        next_offset = line_length;
+        if (next_order < count) {
+            next_offset = MIN(next_offset, substrs[self->sweep_order[next_order]].start_offset);
+        }
+        if (winner != -1) {
+            next_offset = MIN(next_offset, substrs[winner].end_offset + 1);
+        }
+        offset = next_offset;
     }
     if (current_substr != NULL) {
         current_substr->end_offset = line_length - 1;
         current_substr->length = current_substr->end_offset - current_substr->start_offset + 1;
     }
 
-    return self->highlighted_substrs;
+    return substr_count;
+}
+
+/**
+ * qsort comparator for indexes into highlighter_sort_substrs
+ */
+int highlighter_compare_substrs(const void* a, const void* b) {
+    int ia = *(const int*)a;
+    int ib = *(const int*)b;
+    int diff = highlighter_sort_substrs[ia].start_offset - highlighter_sort_substrs[ib].start_offset;
+    return diff != 0 ? diff : ia - ib;
+}
+
+/**
+ * Push value onto a max-heap of ints
+ *
+ * @param int* heap
+ * @param int* heap_len
+ * @param int value
+ */
+void highlighter_heap_push(int* heap, int* heap_len, int value) {
+    int i = *heap_len;
+    int parent;
+    *heap_len += 1;
+    while (i > 0) {
+        parent = (i - 1) / 2;
+        if (heap[parent] >= value) {
+            break;
+        }
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = value;
+}
+
+/**
+ * Pop the largest value off a max-heap of ints
+ *
+ * @param int* heap
+ * @param int* heap_len
+ */
+void highlighter_heap_pop(int* heap, int* heap_len) {
+    int i = 0;
+    int child;
+    int value;
+    *heap_len -= 1;
+    value = heap[*heap_len];
+    while ((child = i * 2 + 1) < *heap_len) {
+        if (child + 1 < *heap_len && heap[child + 1] > heap[child]) {
+            child += 1;
+        }
+        if (heap[child] <= value) {
+            break;
+        }
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = value;
 }
 
 void highlighter_on_dirty_lines(buffer_t* buffer, void* listener, int line_start, int line_end, int line_delta) {
 
-    int line;
-    bool overlaps_with_multi_range;
+    int change_start;
+    int change_end;
+    int change_line_start;
+    int change_line_end;
     highlighter_t* self = (highlighter_t*)listener;
-    int buffer_offset = buffer_get_buffer_offset(buffer, line_start, 0);
     syntax_rule_multi_t* cur_rule = self->syntax->rule_multi_head;
     syntax_rule_multi_workspace_t* workspace;
-    syntax_rule_multi_range_t* range;
 
     while (cur_rule != NULL) {
         workspace = syntax_rule_multi_workspace_find_or_new(cur_rule, buffer);
-        overlaps_with_multi_range = FALSE;
-        for (line = line_start; line <= line_end; line++) {
-            range = utarray_eltptr(workspace->ranges, line);
-            if (range && range->active) {
-                overlaps_with_multi_range = TRUE;
-                break;
+        highlighter_sync_workspace(workspace, cur_rule, &change_start, &change_end);
+        if (change_start <= change_end) {
+            // Refresh lines whose ranges changed outside of the dirty lines,
+            // which are refreshed anyway
+            change_line_start = buffer_get_line_at_offset(buffer, change_start);
+            change_line_end = buffer_get_line_at_offset(buffer, change_end);
+            if (change_line_start < line_start) {
+                control_buffer_mark_dirty(buffer, change_line_start, MIN(change_line_end, line_start - 1), 0);
+            }
+            if (change_line_end > line_end) {
+                control_buffer_mark_dirty(buffer, MAX(change_line_start, line_end + 1), change_line_end, 0);
             }
-        }
-        if (overlaps_with_multi_range || syntax_rule_multi_lines_contain_match(cur_rule, buffer, line_start, line_end)) {
-            highlighter_update_offsets(buffer, cur_rule->regex_start, buffer_offset, workspace->start_offsets, FALSE);
-            highlighter_update_offsets(buffer, cur_rule->regex_end, buffer_offset, workspace->end_offsets, TRUE);
-            highlighter_update_lines(workspace, line_start, line_end);
         }
         cur_rule = cur_rule->next;
     }
 
 }
 
-int highlighter_update_offsets(buffer_t* buffer, pcre* regex, int look_offset, UT_array* offsets, bool is_end_offset) {
+/**
+ * Bring workspace up to date with its buffer
+ *
+ * If the buffer has had exactly one edit since the last sync, only the
+ * lines around that edit are rescanned. Otherwise the whole buffer is.
+ *
+ * @param syntax_rule_multi_workspace_t* workspace
+ * @param syntax_rule_multi_t* rule rule that owns workspace
+ * @param int* change_start set to the first offset whose range changed
+ * @param int* change_end set to the last offset whose range changed, or
+ * less than change_start if none did
+ */
+int highlighter_sync_workspace(syntax_rule_multi_workspace_t* workspace, syntax_rule_multi_t* rule, int* change_start, int* change_end) {
+
+    int unused_start;
+    int unused_end;
+    buffer_t* buffer = workspace->buffer;
 
-    int* offset;
-    int offset_index = 0;
-    int rc;
-    static int ovector[3];
-    int offsets_len = utarray_len(offsets);
-    look_offset = 0;
-
-    while (0) {
-        if (offset_index < offsets_len) {
-            offset = (int*)utarray_eltptr(offsets, offset_index);
-            if (*offset < look_offset) {
-                offset_index += 1;
-                continue;
-            }
+    if (change_start == NULL) {
+        change_start = &unused_start;
+        change_end = &unused_end;
+    }
+    *change_start = 0;
+    *change_end = -1;
+
+    if (workspace->is_synced && workspace->edit_version == buffer->edit_version) {
+        return 0;
+    } else if (workspace->is_synced && workspace->edit_version + 1 == buffer->edit_version) {
+        highlighter_update_workspace(workspace, rule, buffer->edit_offset, buffer->edit_deleted, buffer->edit_inserted, change_start, change_end);
+    } else {
+        highlighter_update_workspace(workspace, rule, 0, workspace->char_count, buffer->char_count, change_start, change_end);
+    }
+
+    workspace->is_synced = TRUE;
+    workspace->edit_version = buffer->edit_version;
+    workspace->char_count = buffer->char_count;
+    return 0;
+}
+
+/**
+ * Patch workspace after edit_deleted chars at edit_offset were replaced by
+ * edit_inserted chars, then re-pair its start and end offsets
+ *
+ * @param syntax_rule_multi_workspace_t* workspace
+ * @param syntax_rule_multi_t* rule rule that owns workspace
+ * @param int edit_offset
+ * @param int edit_deleted
+ * @param int edit_inserted
+ * @param int* change_start set to the first offset whose range changed
+ * @param int* change_end set to the last offset whose range changed
+ */
+int highlighter_update_workspace(syntax_rule_multi_workspace_t* workspace, syntax_rule_multi_t* rule, int edit_offset, int edit_deleted, int edit_inserted, int* change_start, int* change_end) {
+
+    int line;
+    int window_start;
+    int window_end;
+    int delta = edit_inserted - edit_deleted;
+    int i;
+    int front;
+    int back;
+    int old_len;
+    int new_len;
+    int start;
+    int end;
+    UT_array* old_pairs;
+    syntax_rule_multi_pair_t* old_pair;
+    syntax_rule_multi_pair_t* new_pair;
+    buffer_t* buffer = workspace->buffer;
+
+    // Rescan whole lines from the start of the edit to the end of what was
+    // inserted
+    line = buffer_get_line_at_offset(buffer, edit_offset);
+    window_start = buffer_get_buffer_offset(buffer, line, 0);
+    line = buffer_get_line_at_offset(buffer, edit_offset + edit_inserted);
+    window_end = line + 1 < buffer->line_count ? buffer_get_buffer_offset(buffer, line + 1, 0) : buffer->char_count + 1;
+    highlighter_update_offsets(buffer, rule->regex_start, workspace->start_offsets, FALSE, window_start, window_end, window_end - delta, delta);
+    highlighter_update_offsets(buffer, rule->regex_end, workspace->end_offsets, TRUE, window_start, window_end, window_end - delta, delta);
+
+    // Re-pair, keeping the old pairs to see what changed
+    old_pairs = workspace->pairs;
+    utarray_new(workspace->pairs, &syntax_rule_multi_pair_icd);
+    highlighter_pair_offsets(workspace);
+
+    // Pairs that match (after shifting old ones past the edit) at the front
+    // and back did not change
+    old_len = utarray_len(old_pairs);
+    new_len = utarray_len(workspace->pairs);
+    #define HIGHLIGHTER_MAP_OFFSET(o) ((o) < edit_offset ? (o) : ((o) >= edit_offset + edit_deleted ? (o) + delta : -1))
+    #define HIGHLIGHTER_PAIRS_EQUAL(a, b) ( \
+        HIGHLIGHTER_MAP_OFFSET((a)->start_offset) == (b)->start_offset \
+        && HIGHLIGHTER_MAP_OFFSET((a)->end_offset) == (b)->end_offset)
+    for (front = 0; front < old_len && front < new_len; front++) {
+        old_pair = (syntax_rule_multi_pair_t*)utarray_eltptr(old_pairs, front);
+        new_pair = (syntax_rule_multi_pair_t*)utarray_eltptr(workspace->pairs, front);
+        if (!HIGHLIGHTER_PAIRS_EQUAL(old_pair, new_pair)) {
+            break;
+        }
+    }
+    for (back = 0; back < old_len - front && back < new_len - front; back++) {
+        old_pair = (syntax_rule_multi_pair_t*)utarray_eltptr(old_pairs, old_len - 1 - back);
+        new_pair = (syntax_rule_multi_pair_t*)utarray_eltptr(workspace->pairs, new_len - 1 - back);
+        if (!HIGHLIGHTER_PAIRS_EQUAL(old_pair, new_pair)) {
+            break;
         }
-        break;
     }
 
-    while (1) {
-        rc = pcre_exec(
+    // The rest changed; report the span they cover now
+    *change_start = INT_MAX;
+    *change_end = -1;
+    for (i = front; i < new_len - back; i++) {
+        new_pair = (syntax_rule_multi_pair_t*)utarray_eltptr(workspace->pairs, i);
+        *change_start = MIN(*change_start, new_pair->start_offset);
+        *change_end = MAX(*change_end, new_pair->end_offset);
+    }
+    for (i = front; i < old_len - back; i++) {
+        old_pair = (syntax_rule_multi_pair_t*)utarray_eltptr(old_pairs, i);
+        start = HIGHLIGHTER_MAP_OFFSET(old_pair->start_offset);
+        end = HIGHLIGHTER_MAP_OFFSET(old_pair->end_offset);
+        *change_start = MIN(*change_start, start < 0 ? edit_offset : start);
+        *change_end = MAX(*change_end, end < 0 ? edit_offset : end);
+    }
+    #undef HIGHLIGHTER_PAIRS_EQUAL
+    #undef HIGHLIGHTER_MAP_OFFSET
+
+    utarray_free(old_pairs);
+    return 0;
+}
+
+/**
+ * Replace the offsets of regex matches in the old window with those found
+ * in window_start thru window_end (exclusive), and shift the offsets after
+ * the window by delta
+ *
+ * @param buffer_t* buffer
+ * @param util_regex_t* regex
+ * @param UT_array* offsets sorted match offsets
+ * @param bool is_end_offset store the last char of each match if TRUE,
+ * else the first
+ * @param int window_start
+ * @param int window_end
+ * @param int old_window_end where window_end was before the edit
+ * @param int delta
+ */
+int highlighter_update_offsets(buffer_t* buffer, util_regex_t* regex, UT_array* offsets, bool is_end_offset, int window_start, int window_end, int old_window_end, int delta) {
+
+    static UT_array* found = NULL;
+    static int ovector[3];
+    int rc;
+    int look_offset;
+    int first;
+    int last;
+    int old_len;
+    int new_len;
+    int found_len;
+    int i;
+    int* elems;
+    int* found_elems;
+
+    if (found == NULL) {
+        utarray_new(found, &ut_int_icd);
+    }
+    utarray_clear(found);
+
+    // Find matches that start in the window
+    look_offset = window_start;
+    while (look_offset < window_end) {
+        rc = util_regex_exec(
             regex,
-            NULL,
             buffer->buffer->data,
             buffer->char_count,
             look_offset,
@@ -224,140 +647,321 @@ int highlighter_update_offsets(buffer_t* buffer, pcre* regex, int look_offset, U
             ovector,
             3
         );
-        if (rc < 1) {
+        if (rc < 1 || ovector[0] >= window_end) {
             break;
         }
+        i = is_end_offset ? ovector[1] - 1 : ovector[0];
+        utarray_push_back(found, &i);
+        look_offset = MAX(ovector[1], ovector[0] + 1);
+    }
 
-        if (offset_index >= offsets_len) {
-            utarray_resize(offsets, offset_index + 1);
-            offsets_len = offset_index + 1;
+    // Offsets first thru last-1 were in the old window
+    old_len = utarray_len(offsets);
+    elems = (int*)utarray_front(offsets);
+    for (first = 0; first < old_len && elems[first] < window_start; first++);
+    for (last = first; last < old_len && elems[last] < old_window_end; last++);
+
+    // Splice found in their place and shift the tail
+    found_len = utarray_len(found);
+    new_len = old_len - (last - first) + found_len;
+    if (new_len > old_len) {
+        utarray_resize(offsets, new_len);
+    }
+    elems = (int*)utarray_front(offsets);
+    if (elems != NULL) {
+        memmove(elems + first + found_len, elems + last, (old_len - last) * sizeof(int));
+    }
+    if (new_len < old_len) {
+        utarray_resize(offsets, new_len);
+        elems = (int*)utarray_front(offsets);
+    }
+    found_elems = (int*)utarray_front(found);
+    for (i = 0; i < found_len; i++) {
+        elems[first + i] = found_elems[i];
+    }
+    for (i = first + found_len; i < new_len; i++) {
+        elems[i] += delta;
+    }
+
+    return 0;
+}
+
+/**
+ * Pair up workspace->(start|end)_offsets into workspace->pairs. Each pair
+ * runs from a start to the first end after it; the next pair begins at the
+ * first start after that end.
+ *
+ * @param syntax_rule_multi_workspace_t* workspace
+ */
+int highlighter_pair_offsets(syntax_rule_multi_workspace_t* workspace) {
+
+    int start_offsets_i = 0;
+    int end_offsets_i = 0;
+    int start_offsets_len = utarray_len(workspace->start_offsets);
+    int end_offsets_len = utarray_len(workspace->end_offsets);
+    int* start_offsets = (int*)utarray_front(workspace->start_offsets);
+    int* end_offsets = (int*)utarray_front(workspace->end_offsets);
+    syntax_rule_multi_pair_t pair;
+
+    pair.end_offset = -1;
+    while (1) {
+        // Find next start offset greater than the last end offset
+        while (start_offsets_i < start_offsets_len && start_offsets[start_offsets_i] <= pair.end_offset) {
+            start_offsets_i += 1;
         }
-        offset = (int*)utarray_eltptr(offsets, offset_index);
-        if (is_end_offset) {
-            *offset = ovector[1] - 1;
-        } else {
-            *offset = ovector[0];
+        if (start_offsets_i >= start_offsets_len) {
+            break;
         }
+        pair.start_offset = start_offsets[start_offsets_i];
+        start_offsets_i += 1;
 
-        look_offset = ovector[1];
-        offset_index += 1;
+        // Find next end offset greater than that
+        while (end_offsets_i < end_offsets_len && end_offsets[end_offsets_i] <= pair.start_offset) {
+            end_offsets_i += 1;
+        }
+        if (end_offsets_i >= end_offsets_len) {
+            break;
+        }
+        pair.end_offset = end_offsets[end_offsets_i];
+        end_offsets_i += 1;
 
+        utarray_push_back(workspace->pairs, &pair);
     }
 
-    utarray_resize(offsets, offset_index);
-
+    return 0;
 }
 
 /**
- * Calculate workspace->ranges using workspace->(start|end)_offsets
+ * Return the index of the first pair in pairs that ends at or after offset
  *
- * @param syntax_rule_multi_workspace_t* workspace
+ * @param UT_array* pairs
+ * @param int offset
+ * @return int index, or the number of pairs if there is none
  */
-int highlighter_update_lines(syntax_rule_multi_workspace_t* workspace, int line_start, int line_end) { // TODO optimize
+int highlighter_find_pair(UT_array* pairs, int offset) {
 
-    int i;
-    int line;
-    int start_offsets_i;
-    int end_offsets_i;
-    int start_offsets_len;
-    int end_offsets_len;
-    int range_start_offset;
-    int range_end_offset;
-    int range_start_line;
-    int range_end_line;
-    int range_start_line_offset;
-    int range_end_line_offset;
-    int* temp;
-    bool found;
-    int line_length;
-    syntax_rule_multi_range_t* range;
-    bool was_active;
-    buffer_t* buffer = workspace->buffer;
+    int lo = 0;
+    int hi = utarray_len(pairs);
+    int mid;
+    syntax_rule_multi_pair_t* elems = (syntax_rule_multi_pair_t*)utarray_front(pairs);
 
-    // Reset ranges
-    utarray_resize(workspace->ranges, buffer->line_count);
-    for (i = 0; i < buffer->line_count; i++) {
-        range = (syntax_rule_multi_range_t*)utarray_eltptr(workspace->ranges, i);
-        was_active = range->active;
-        syntax_rule_multi_range_dtor((void*)range);
-        if (was_active) {
-            control_buffer_view_dirty_lines(control_get_active_buffer_view(), i, i, 0);
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (elems[mid].end_offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    // Find ranges using (start|end)_offsets
-    // This assumes that (start|end)_offsets are sorted
-    start_offsets_len = utarray_len(workspace->start_offsets);
-    start_offsets_i = 0;
-    end_offsets_len = utarray_len(workspace->end_offsets);
-    end_offsets_i = 0;
-    range_start_offset = -1;
-    range_end_offset = -1;
+/**
+ * Add the matches of the syntax's lexer rules on a line, exactly as
+ * applying each rule in turn would but in one pass over the line
+ *
+ * The line is scanned for offsets where any rule matches. Every rule that
+ * matches there, found last rule first, makes a match unless the offset is
+ * inside the rule's own previous match, same as when the rule is applied on
+ * its own. Matches are then added rule by rule so later rules win where
+ * they overlap.
+ *
+ * @param highlighter_t* self
+ * @param char* line
+ * @param int line_length
+ * @return int
+ */
+int highlighter_add_lexer_substrs(highlighter_t* self, char* line, int line_length) {
+
+    syntax_t* syntax = self->syntax;
+    int cursors[MAX_LEXER_RULES]; // Where each rule's next match may start
+    int heads[MAX_LEXER_RULES];
+    int tails[MAX_LEXER_RULES];
+    int tokens_len = 0;
+    int* token;
+    int rule;
+    int offset;
+    int start;
+    int end;
+    int i;
 
-    while (start_offsets_i < start_offsets_len && end_offsets_i < end_offsets_len) {
+    for (i = 0; i < syntax->lexer_rules_len; i++) {
+        cursors[i] = 0;
+        heads[i] = -1;
+        tails[i] = -1;
+    }
 
-        // Find next start_offsets value greater than range_end_offset
-        found = FALSE;
+    offset = 0;
+    while (offset < line_length
+        && (rule = syntax_lexer_exec(syntax, syntax->lexer_rules_len, line, line_length, offset, &start, &end)) >= 0
+    ) {
+        offset = start;
         do {
-            temp = (int*)utarray_eltptr(workspace->start_offsets, start_offsets_i);
-            start_offsets_i += 1;
-            if (*temp > range_end_offset) {
-                range_start_offset = *temp;
-                found = TRUE;
-                break;
+            if (offset < cursors[rule]) {
+                continue;
+            }
+            cursors[rule] = end;
+            if (tokens_len >= self->lexer_tokens_size) {
+                self->lexer_tokens_size = MAX(HIGHLIGHTER_SUBSTRS_INIT, self->lexer_tokens_size * 2);
+                self->lexer_tokens = (int*)realloc(self->lexer_tokens, self->lexer_tokens_size * 3 * sizeof(int));
             }
-        } while (start_offsets_i < start_offsets_len);
-        if (!found) {
-            break;
-        }
 
-        // Find next end_offsets value greater than range_start_offset
-        found = FALSE;
-        do {
-            temp = (int*)utarray_eltptr(workspace->end_offsets, end_offsets_i);
-            end_offsets_i += 1;
-            if (*temp > range_start_offset) {
-                range_end_offset = *temp;
-                found = TRUE;
-                break;
+            // Start offset, end offset, next token of the same rule
+            token = self->lexer_tokens + tokens_len * 3;
+            token[0] = offset;
+            token[1] = end;
+            token[2] = -1;
+            if (tails[rule] == -1) {
+                heads[rule] = tokens_len;
+            } else {
+                self->lexer_tokens[tails[rule] * 3 + 2] = tokens_len;
             }
-        } while (end_offsets_i < end_offsets_len);
-        if (!found) {
-            break;
+            tails[rule] = tokens_len;
+            tokens_len += 1;
+        } while (rule > 0 && (rule = syntax_lexer_exec(syntax, rule, line, line_length, offset, &start, &end)) >= 0);
+        offset += 1;
+    }
+
+    for (rule = 0; rule < syntax->lexer_rules_len; rule++) {
+        for (i = heads[rule]; i != -1; i = token[2]) {
+            token = self->lexer_tokens + i * 3;
+            highlighter_add_substr(self, syntax->lexer_rules[rule]->attrs, token[0], token[1] - 1);
         }
+    }
+    return 0;
+}
 
-        // Woohoo! range_start_offset thru range_end_offset should be highlighted
-        buffer_get_line_and_offset(buffer, range_start_offset, &range_start_line, &range_start_line_offset);
-        buffer_get_line_and_offset(buffer, range_end_offset, &range_end_line, &range_end_line_offset);
+/**
+ * Find a match of any of the syntax's first below lexer rules. With all of
+ * them, find the next match at or after offset; with fewer, only a match at
+ * offset. Of rules that match at the same offset, the last one is found.
+ *
+ * @param syntax_t* syntax
+ * @param int below
+ * @param char* line
+ * @param int line_length
+ * @param int offset
+ * @param int* ret_start set to the start offset of the match
+ * @param int* ret_end set to the end offset of the match, exclusive
+ * @return int index of the rule that matched, or -1 if none did
+ */
+int syntax_lexer_exec(syntax_t* syntax, int below, char* line, int line_length, int offset, int* ret_start, int* ret_end) {
 
-        // Add ranges
-        if (range_start_line == range_end_line) {
-            syntax_rule_multi_add_range(workspace, range_start_line, range_start_line_offset, range_end_line_offset);
-        } else { // range_start_line != range_end_line
-            for (line = range_start_line; line <= range_end_line; line++) {
-                if (line != range_end_line) {
-                    buffer_get_line_offset_and_length(buffer, line, temp, &line_length);
-                }
-                if (line == range_start_line) {
-                    syntax_rule_multi_add_range(workspace, line, range_start_line_offset, line_length - 1);
-                } else if (line == range_end_line) {
-                    syntax_rule_multi_add_range(workspace, line, 0, range_end_line_offset);
-                } else {
-                    syntax_rule_multi_add_range(workspace, line, 0, line_length - 1);
-                }
-            }
+    static int ovector[(MAX_LEXER_GROUPS + 1) * 3];
+    int* groups;
+    int i;
+
+    if (util_regex_exec(syntax->lexer_regexes[below], line, line_length, offset, 0, ovector, syntax->lexer_ovector_size) < 0) {
+        return -1;
+    }
+    *ret_start = ovector[0];
+    *ret_end = ovector[1];
+    groups = syntax->lexer_groups + below * (below - 1) / 2;
+    for (i = below - 1; i >= 0; i--) {
+        if (ovector[groups[i] * 2] != -1) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        // Trigger line refresh
-        for (line = range_start_line; line <= range_end_line; line++) {
-            if (line < line_start || line > line_end) {
-                // TODO this is broken; loop through all buffer_views associated with buffer and refresh them
-                control_buffer_view_dirty_lines(control_get_active_buffer_view(), line, line, 0);
-            }
+int syntax_update_lexer(syntax_t* syntax) {
+    // Combine the syntax's leading single-line rules into alternations,
+    // lexer_regexes[k] = (?<r{k-1}>rule k-1)|...|(?<r0>rule 0), later rules
+    // first so they win at the same offset. All but the last are anchored
+    // with \G, as PCRE_ANCHORED at exec time does not run JIT code.
+    // Appending a rule leaves the anchored ones unchanged, so they come
+    // from the regex cache. Rules whose matches depend on where matching
+    // starts end the lexer; they and the rules after them are applied one
+    // at a time.
+    syntax_rule_single_t* rule;
+    char* regex;
+    char* cur;
+    char group_name[16];
+    int capture_count;
+    int regex_len = 0;
+    int rules_len = 0;
+    int i;
+    int k;
+
+    syntax->lexer_is_dirty = FALSE;
+    if (syntax->lexer_rules != NULL) {
+        free(syntax->lexer_regexes);
+        free(syntax->lexer_rules);
+        free(syntax->lexer_groups);
+        syntax->lexer_regexes = NULL;
+        syntax->lexer_rules = NULL;
+        syntax->lexer_groups = NULL;
+    }
+    syntax->lexer_rules_len = 0;
+
+    LL_FOREACH(syntax->rule_single_head, rule) {
+        if (rules_len >= MAX_LEXER_RULES
+            || strstr(rule->regex_str, "\\G")
+            || strstr(rule->regex_str, "\\K")
+            || strstr(rule->regex_str, "(?R")
+        ) {
+            break;
         }
+        regex_len += strlen(rule->regex_str) + 16;
+        rules_len += 1;
+    }
+    if (rules_len < 2) {
+        return 0;
+    }
 
+    syntax->lexer_rules = calloc(rules_len, sizeof(syntax_rule_single_t*));
+    i = 0;
+    LL_FOREACH(syntax->rule_single_head, rule) {
+        if (i >= rules_len) {
+            break;
+        }
+        syntax->lexer_rules[i++] = rule;
     }
+    syntax->lexer_regexes = calloc(rules_len + 1, sizeof(util_regex_t*));
+    syntax->lexer_groups = calloc(rules_len * (rules_len + 1) / 2, sizeof(int));
+
+    regex = malloc(regex_len + 1);
+    for (k = 1; k <= rules_len; k++) {
+        cur = regex;
+        if (k < rules_len) {
+            cur += sprintf(cur, "\\G(?:");
+        }
+        for (i = k - 1; i >= 0; i--) {
+            cur += sprintf(cur, "%s(?<r%d>%s)", i < k - 1 ? "|" : "", i, syntax->lexer_rules[i]->regex_str);
+        }
+        if (k < rules_len) {
+            cur += sprintf(cur, ")");
+        }
+        syntax->lexer_regexes[k] = util_regex_get(regex, 0);
+        if (syntax->lexer_regexes[k] == NULL) {
+            break;
+        }
 
+        // Rules may have named groups of their own, so look up which group
+        // each rule is rather than counting
+        for (i = 0; i < k; i++) {
+            sprintf(group_name, "r%d", i);
+            syntax->lexer_groups[k * (k - 1) / 2 + i] = pcre_get_stringnumber(syntax->lexer_regexes[k]->re, group_name);
+        }
+    }
+    free(regex);
+
+    if (syntax->lexer_regexes[rules_len] == NULL
+        || pcre_fullinfo(syntax->lexer_regexes[rules_len]->re, NULL, PCRE_INFO_CAPTURECOUNT, &capture_count) != 0
+        || capture_count > MAX_LEXER_GROUPS
+    ) {
+        // Does not combine; apply rules one at a time
+        free(syntax->lexer_regexes);
+        free(syntax->lexer_rules);
+        free(syntax->lexer_groups);
+        syntax->lexer_regexes = NULL;
+        syntax->lexer_rules = NULL;
+        syntax->lexer_groups = NULL;
+        return 0;
+    }
+    syntax->lexer_rules_len = rules_len;
+    syntax->lexer_ovector_size = (capture_count + 1) * 3;
     return 0;
 }
 
@@ -370,25 +974,24 @@ syntax_rule_single_t* syntax_rule_single_new(char* regex, int attrs) {
 }
 
 int syntax_rule_single_edit(syntax_rule_single_t* rule, char* regex, int attrs) {
-    if (rule->regex) {
-        pcre_free(rule->regex);
-    }
     if (rule->regex_str) {
         free(rule->regex_str);
     }
-    rule->regex = util_pcre_compile(regex, NULL, NULL);
+    rule->regex = util_regex_get(regex, 0);
     rule->regex_str = strdup(regex);
     rule->attrs = attrs;
+    syntax_rule_generation += 1;
     return 0;
 }
 
 syntax_rule_multi_t* syntax_rule_multi_new(char* regex_start, char* regex_end, int attrs) {
     syntax_rule_multi_t* rule = calloc(1, sizeof(syntax_rule_multi_t));
-    rule->regex_start = util_pcre_compile(regex_start, NULL, NULL);
-    rule->regex_end = util_pcre_compile(regex_end, NULL, NULL);
+    rule->regex_start = util_regex_get(regex_start, 0);
+    rule->regex_end = util_regex_get(regex_end, 0);
     rule->attrs = attrs;
     rule->syntax_rule_id = syntax_rule_id;
     syntax_rule_id += 1;
+    syntax_rule_generation += 1;
     return rule;
 }
 
@@ -401,95 +1004,8 @@ syntax_rule_multi_workspace_t* syntax_rule_multi_workspace_find_or_new(syntax_ru
         workspace->buffer_key = buffer->key;
         utarray_new(workspace->start_offsets, &ut_int_icd);
         utarray_new(workspace->end_offsets, &ut_int_icd);
-        utarray_new(workspace->ranges, &syntax_rule_multi_range_icd);
+        utarray_new(workspace->pairs, &syntax_rule_multi_pair_icd);
         HASH_ADD_PTR(rule->workspaces, buffer_key, workspace);
     }
     return workspace;
 }
-
-int syntax_rule_multi_add_range(syntax_rule_multi_workspace_t* workspace, int line, int start_offset, int end_offset) {
-    syntax_rule_multi_range_t* range;
-    syntax_rule_multi_range_t** range_ref;
-    range = (syntax_rule_multi_range_t*)utarray_eltptr(workspace->ranges, line);
-    range_ref = &range;
-    while ((*range_ref)->active) {
-        range_ref = &((*range_ref)->next);
-        if (*range_ref == NULL) {
-            break;
-        }
-    }
-    return syntax_rule_multi_range_make(range_ref, start_offset, end_offset);
-}
-
-int syntax_rule_multi_range_make(syntax_rule_multi_range_t** range_ref, int start_offset, int end_offset) {
-    if (*range_ref == NULL) {
-        *range_ref = calloc(1, sizeof(syntax_rule_multi_range_t));
-    }
-    (*range_ref)->active = TRUE;
-    (*range_ref)->start_offset = start_offset;
-    (*range_ref)->end_offset = end_offset;
-    return 0;
-}
-
-void syntax_rule_multi_range_dtor(void* el) {
-
-    syntax_rule_multi_range_t* range;
-    syntax_rule_multi_range_t* temp;
-    bool is_first = TRUE;
-
-    range = (syntax_rule_multi_range_t*)el;
-
-    while (range != NULL) {
-        range->active = FALSE;
-        temp = range->next;
-        if (!is_first) {
-            //free(range); // TODO figure out seg fault
-        } else {
-            is_first = FALSE;
-        }
-        range = temp;
-    }
-}
-
-bool syntax_rule_multi_lines_contain_match(syntax_rule_multi_t* rule, buffer_t* buffer, int line_start, int line_end) {
-
-    int rc;
-    int line_length;
-    int end_offset;
-    int start_offset;
-    int ovector[3];
-
-    start_offset = buffer_get_buffer_offset(buffer, line_start, 0);
-    buffer_get_line_offset_and_length(buffer, line_end, &end_offset, &line_length);
-    end_offset += line_length;
-
-    rc = pcre_exec(
-        rule->regex_start,
-        NULL,
-        buffer->buffer->data + start_offset,
-        end_offset - start_offset,
-        0,
-        0,
-        NULL,
-        0
-    );
-    if (rc >= 0) {
-        return TRUE;
-    }
-
-    rc = pcre_exec(
-        rule->regex_end,
-        NULL,
-        buffer->buffer->data + start_offset,
-        end_offset - start_offset,
-        0,
-        0,
-        NULL,
-        0
-    );
-    if (rc >= 0) {
-        return TRUE;
-    }
-
-    return FALSE;
-}
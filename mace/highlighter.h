@@ -2,22 +2,54 @@
 #define _HIGHLIGHTER_H
 
 #include <string.h>
+#include <stdint.h>
 #include <pcre.h>
 
 #include "ext/uthash/uthash.h"
 
 #include "control.h"
 #include "buffer.h"
+#include "util.h"
 
-#define MAX_HIGHLIGHTED_SUBSTRS 256
+#define HIGHLIGHTER_SUBSTRS_INIT 64
+#define HIGHLIGHTER_CACHE_SIZE 512
+#define MAX_LEXER_RULES 128
+#define MAX_LEXER_GROUPS 256
 
 typedef struct highlighter_s {
     struct syntax_s* syntax;
     int* regex_ovector;
     struct highlighted_substr_s* highlighted_substrs;
+    int highlighted_substrs_size;
+    struct highlighted_substr_s* workspace_substrs;
+    int workspace_substrs_count;
+    int workspace_substrs_size;
+    int* sweep_order;
+    int* sweep_heap;
+    int sweep_size;
+    int* lexer_tokens;
+    int lexer_tokens_size;
+    struct highlighter_cache_entry_s* cache;
+    int cache_count;
     struct buffer_s* buffer;
 } highlighter_t;
 
+typedef struct highlighter_cache_key_s {
+    uint64_t hash;
+    int length;
+    unsigned int entry_state;
+    unsigned int exit_state;
+    int rule_generation;
+} highlighter_cache_key_t;
+
+typedef struct highlighter_cache_entry_s {
+    highlighter_cache_key_t key;
+    struct highlighted_substr_s* substrs;
+    int substr_count;
+    int substrs_size;
+    UT_hash_handle hh;
+} highlighter_cache_entry_t;
+
 typedef struct highlighted_substr_s {
     int attrs;
     char* substr;
@@ -28,14 +60,20 @@ typedef struct highlighted_substr_s {
 
 typedef struct syntax_s {
     char* name;
-    pcre* regex_file_pattern;
+    util_regex_t* regex_file_pattern;
     struct syntax_rule_single_s* rule_single_head;
     struct syntax_rule_multi_s* rule_multi_head;
+    util_regex_t** lexer_regexes; // [k] combines lexer_rules[0] thru [k - 1], last rule first; anchored unless k is lexer_rules_len
+    struct syntax_rule_single_s** lexer_rules; // Leading single-line rules, in order
+    int* lexer_groups; // Group of lexer_rules[i] in lexer_regexes[k] is lexer_groups[k * (k - 1) / 2 + i]
+    int lexer_rules_len;
+    int lexer_ovector_size;
+    bool lexer_is_dirty;
     UT_hash_handle hh;
 } syntax_t;
 
 typedef struct syntax_rule_single_s {
-    pcre* regex;
+    util_regex_t* regex;
     char* regex_str;
     int attrs;
     struct syntax_rule_single_s* next;
@@ -43,8 +81,8 @@ typedef struct syntax_rule_single_s {
 } syntax_rule_single_t;
 
 typedef struct syntax_rule_multi_s {
-    pcre* regex_start;
-    pcre* regex_end;
+    util_regex_t* regex_start;
+    util_regex_t* regex_end;
     char* regex_start_str;
     char* regex_end_str;
     int attrs;
@@ -58,32 +96,43 @@ typedef struct syntax_rule_multi_workspace_s {
     void* buffer_key;
     UT_array* start_offsets;
     UT_array* end_offsets;
-    UT_array* ranges;
+    UT_array* pairs;
+    bool is_synced;
+    unsigned int edit_version;
+    int char_count;
     UT_hash_handle hh;
 } syntax_rule_multi_workspace_t;
 
-typedef struct syntax_rule_multi_range_s {
-    bool active;
-    bool whole_line;
+typedef struct syntax_rule_multi_pair_s {
     int start_offset;
     int end_offset;
-    struct syntax_rule_multi_range_s* next;
-} syntax_rule_multi_range_t;
+} syntax_rule_multi_pair_t;
 
 highlighter_t* highlighter_new(struct buffer_s* buffer, syntax_t* syntax);
-highlighted_substr_t* highlighter_highlight(highlighter_t* self, char* line, int line_in_buffer, int* highlighted_substr_count);
+highlighted_substr_t* highlighter_highlight(highlighter_t* self, char* line, int line_length, int line_in_buffer, int* highlighted_substr_count);
+highlighted_substr_t* highlighter_cache_get(highlighter_t* self, highlighter_cache_key_t* key, char* line, int* substr_count);
+int highlighter_cache_put(highlighter_t* self, highlighter_cache_key_t* key, highlighted_substr_t* substrs, int substr_count);
+uint64_t highlighter_hash_line(char* line, int line_length);
+int highlighter_add_substr(highlighter_t* self, int attrs, int start_offset, int end_offset);
+int highlighter_flatten(highlighter_t* self, char* line, int line_length);
+int highlighter_compare_substrs(const void* a, const void* b);
+void highlighter_heap_push(int* heap, int* heap_len, int value);
+void highlighter_heap_pop(int* heap, int* heap_len);
 void highlighter_on_dirty_lines(struct buffer_s* buffer, void* listener, int line_start, int line_end, int line_delta);
-int highlighter_update_offsets(struct buffer_s* buffer, pcre* regex, int look_offset, UT_array* offsets, bool is_end_offset);
-int highlighter_update_lines(syntax_rule_multi_workspace_t* workspace, int line_start, int line_end);
+int highlighter_sync_workspace(syntax_rule_multi_workspace_t* workspace, syntax_rule_multi_t* rule, int* change_start, int* change_end);
+int highlighter_update_workspace(syntax_rule_multi_workspace_t* workspace, syntax_rule_multi_t* rule, int edit_offset, int edit_deleted, int edit_inserted, int* change_start, int* change_end);
+int highlighter_update_offsets(struct buffer_s* buffer, util_regex_t* regex, UT_array* offsets, bool is_end_offset, int window_start, int window_end, int old_window_end, int delta);
+int highlighter_pair_offsets(syntax_rule_multi_workspace_t* workspace);
+int highlighter_find_pair(UT_array* pairs, int offset);
+int highlighter_add_lexer_substrs(highlighter_t* self, char* line, int line_length);
+int syntax_lexer_exec(syntax_t* syntax, int below, char* line, int line_length, int offset, int* ret_start, int* ret_end);
+int syntax_update_lexer(syntax_t* syntax);
 syntax_rule_single_t* syntax_rule_single_new(char* regex, int attrs);
 int syntax_rule_single_edit(syntax_rule_single_t* rule, char* regex, int attrs);
 syntax_rule_multi_t* syntax_rule_multi_new(char* regex_start, char* regex_end, int attrs);
 syntax_rule_multi_workspace_t* syntax_rule_multi_workspace_find_or_new(syntax_rule_multi_t* rule, struct buffer_s* buffer);
-int syntax_rule_multi_add_range(syntax_rule_multi_workspace_t* workspace, int line, int start_offset, int end_offset);
-int syntax_rule_multi_range_make(syntax_rule_multi_range_t** range_ref, int start_offset, int end_offset);
-void syntax_rule_multi_range_dtor(void* el);
-bool syntax_rule_multi_lines_contain_match(syntax_rule_multi_t* rule, struct buffer_s* buffer, int line_start, int line_end);
 
 extern syntax_t* syntaxes;
+extern int syntax_rule_generation;
 
 #endif
@@ -1,53 +1,75 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+#include <ncurses.h>
 #include "input.h"
 
 key_trie_node_t* key_trie_root = NULL;
+int input_escape_timeout_ms = INPUT_ESCAPE_TIMEOUT_OFF;
 
 extern FILE* fdebug;
 
+/**
+ * Reads codes until they spell a keychord
+ *
+ * Each code is one lookup in the current node's transition table. If an
+ * escape timeout is set, a prefix that is a keychord of its own (e.g., a
+ * lone escape, "alt") is returned when no more codes arrive in time.
+ *
+ * @param int(*)() getch function to read a code with
+ * @return keychord_t* keychord read; name is "" if the codes spell nothing
+ */
 keychord_t* input_get_keychord(int(*getch)()) {
     int code;
-    key_trie_node_t* cur_node = key_trie_root->child;
+    int is_timed = 0;
+    key_trie_node_t* cur_node = key_trie_root;
+    key_trie_node_t* next_node;
     static keychord_t keychord;
     static int codes[MAX_INPUT_CODE_LEN];
     int code_index = 0;
 
     while (code_index < MAX_INPUT_CODE_LEN) {
+        if (code_index > 0 && !is_timed && input_escape_timeout_ms != INPUT_ESCAPE_TIMEOUT_OFF) {
+            timeout(input_escape_timeout_ms);
+            is_timed = 1;
+        }
         code = (*getch)();
-        while (cur_node != NULL && cur_node->code != code) {
-            cur_node = cur_node->sibling;
-            if (cur_node == NULL) {
-                break;
-            }
+        if (code == ERR && is_timed) {
+            break;
         }
-        if (cur_node == NULL) {
+        next_node = code >= 0 && code < INPUT_CODE_COUNT ? cur_node->next[code] : NULL;
+        if (next_node == NULL) {
+            cur_node = NULL;
             break;
         }
         codes[code_index] = code;
         code_index += 1;
-        if (cur_node->child == NULL) {
+        cur_node = next_node;
+        if (cur_node->next == NULL) {
             break;
         }
-        cur_node = cur_node->child;
+    }
+    if (is_timed) {
+        timeout(-1);
     }
 
     if (cur_node != NULL) {
         keychord.name = cur_node->keychord;
-        keychord.codes = &codes;
+        keychord.codes = codes;
         keychord.code_count = code_index;
         if (code_index == 1 && codes[0] >= 0x20 && codes[0] <= 0x7e) {
-            sprintf(&(keychord.ascii), "%c", (char)codes[0]);
+            keychord.ascii[0] = (char)codes[0];
         } else {
-            sprintf(&(keychord.ascii), "");
+            keychord.ascii[0] = '\0';
         }
     } else {
         keychord.name = "";
         keychord.codes = NULL;
         keychord.code_count = 0;
-        sprintf(&(keychord.ascii), "");
+        keychord.ascii[0] = '\0';
     }
+    keychord.ascii[1] = '\0';
 
     return &keychord;
 }
@@ -57,6 +79,7 @@ void input_init() {
     key_trie_node_t* meta_root;
     key_trie_node_t* bracket_root;
     key_trie_node_t* big_o_root;
+    key_trie_node_t* paste_root;
 
     key_trie_root = (key_trie_node_t*)calloc(1, sizeof(key_trie_node_t));
 
@@ -99,6 +122,10 @@ void input_init() {
             key_trie_add(bracket_root, 'H', "home");
             key_trie_add(bracket_root, 'M', "mouse");
             key_trie_add(bracket_root, 'Z', "shift-tab");
+            paste_root = key_trie_add(bracket_root, '2', "");
+            paste_root = key_trie_add(paste_root, '0', "");
+            paste_root = key_trie_add(paste_root, '0', "");
+            key_trie_add(paste_root, '~', "paste-start");
         big_o_root = key_trie_add(meta_root, 'O', "alt-O");
             key_trie_add(big_o_root, 'A', "up");
             key_trie_add(big_o_root, 'B', "down");
@@ -136,6 +163,73 @@ void input_init() {
     key_trie_add(key_trie_root, 350, "5");
     key_trie_add(key_trie_root, 360, "end");
     key_trie_add(key_trie_root, 410, "resize");
+
+    input_compile(key_trie_root);
+}
+
+/**
+ * Builds dense transition tables for node and its descendants so each code
+ * read is a single array lookup. Call after the last key_trie_add.
+ *
+ * @param key_trie_node_t* node root of the trie to compile
+ */
+void input_compile(key_trie_node_t* node) {
+    key_trie_node_t* cur;
+
+    if (node->child == NULL) {
+        return;
+    }
+    if (node->next == NULL) {
+        node->next = (key_trie_node_t**)calloc(INPUT_CODE_COUNT, sizeof(key_trie_node_t*));
+    }
+    for (cur = node->child; cur != NULL; cur = cur->sibling) {
+        // First sibling wins, as it did when siblings were walked in order
+        if (cur->code >= 0 && cur->code < INPUT_CODE_COUNT && node->next[cur->code] == NULL) {
+            node->next[cur->code] = cur;
+        }
+        input_compile(cur);
+    }
+}
+
+/**
+ * Reads a bracketed paste up to and excluding its end marker
+ *
+ * Codes are collected as bytes without any keychord decoding. Carriage
+ * returns become newlines.
+ *
+ * @param int(*)() getch function to read a code with
+ * @param bstring paste string to append the pasted text to
+ * @return int 0 on success, -1 if input ended before the end marker
+ */
+int input_read_paste(int(*getch)(), bstring paste) {
+    int code;
+    int len;
+
+    while ((code = (*getch)()) != ERR) {
+        if (code <= 0 || code > 0xff) {
+            continue;
+        }
+        bconchar(paste, code == '\r' ? '\n' : (char)code);
+        len = blength(paste);
+        if (code == '~'
+            && len >= INPUT_PASTE_END_LEN
+            && memcmp(paste->data + len - INPUT_PASTE_END_LEN, INPUT_PASTE_END, INPUT_PASTE_END_LEN) == 0
+        ) {
+            btrunc(paste, len - INPUT_PASTE_END_LEN);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Sets how long to wait for the rest of an escape sequence
+ *
+ * @param int timeout_ms milliseconds, or INPUT_ESCAPE_TIMEOUT_OFF to wait
+ * forever
+ */
+void input_set_escape_timeout(int timeout_ms) {
+    input_escape_timeout_ms = timeout_ms < 0 ? INPUT_ESCAPE_TIMEOUT_OFF : timeout_ms;
 }
 
 
@@ -145,10 +239,9 @@ key_trie_node_t* key_trie_add(key_trie_node_t* parent, int code, const char* key
     va_list args;
 
     va_start(args, keychord_format);
-    va_end(args);
-
     node->code = code;
-    vsprintf(node->keychord, keychord_format, args);
+    vsnprintf(node->keychord, sizeof(node->keychord), keychord_format, args);
+    va_end(args);
 
     if (parent->child == NULL) {
         parent->child = node;
@@ -2,12 +2,21 @@
 #define _INPUT_H
 
 #define MAX_INPUT_CODE_LEN 32
+#define INPUT_CODE_COUNT 512
+#define INPUT_ESCAPE_TIMEOUT_OFF -1
+#define INPUT_PASTE_ENABLE "\033[?2004h"
+#define INPUT_PASTE_DISABLE "\033[?2004l"
+#define INPUT_PASTE_END "\033[201~"
+#define INPUT_PASTE_END_LEN 6
+
+#include "ext/bstrlib/bstrlib.h"
 
 typedef struct key_trie_node_s {
     int code;
     char keychord[64];
     struct key_trie_node_s* child;
     struct key_trie_node_s* sibling;
+    struct key_trie_node_s** next;
 } key_trie_node_t;
 
 typedef struct keychord_s {
@@ -21,6 +30,12 @@ keychord_t* input_get_keychord(int(*getch)());
 
 void input_init();
 
+void input_compile(key_trie_node_t* node);
+
+void input_set_escape_timeout(int timeout_ms);
+
+int input_read_paste(int(*getch)(), bstring paste);
+
 key_trie_node_t* key_trie_add(key_trie_node_t* parent, int code, const char* keychord_format, ...);
 
 #endif
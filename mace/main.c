@@ -7,6 +7,7 @@
 #include <lauxlib.h>
 #include <lualib.h>
 #include <getopt.h>
+#include <time.h>
 
 #include "ext/bstrlib/bstrlib.h"
 #include "ext/uthash/uthash.h"
@@ -28,6 +29,7 @@ FILE* fdebug;
 
 /** Prototypes */
 int mace_init();
+int mace_bench(char* target_path);
 void usage();
 void exit_fn();
 
@@ -39,9 +41,11 @@ void exit_fn();
  * @return int exit status
  */
 int main(int argc, char** argv) {
-    char* target_path;
+    char* target_path = NULL;
     char* macerc_path;
+    bool is_bench = FALSE;
     keychord_t* keychord;
+    bstring paste;
     syntax_t* syntax_php;
     control_t* buffer_view;
 
@@ -49,8 +53,11 @@ int main(int argc, char** argv) {
     fdebug = fopen("/tmp/mace.log", "a");
 
     // Exec macerc
-    mace_init(argc, argv, &macerc_path, &target_path);
+    mace_init(argc, argv, &macerc_path, &target_path, &is_bench);
     //macerc_path = "macerc";
+    if (is_bench) {
+        exit(mace_bench(target_path));
+    }
 
     // Init sub systems
     command_init();
@@ -107,6 +114,11 @@ int main(int argc, char** argv) {
         // Respond to input
         if (0 == strcmp(keychord->name, "resize")) {
             control_resize(); // TODO resize doesn't work sometimes
+        } else if (0 == strcmp(keychord->name, "paste-start")) {
+            paste = bfromcstr("");
+            input_read_paste(&getch, paste);
+            command_handle_paste(paste);
+            bdestroy(paste);
         } else {
             command_handle_keychord(keychord);
         }
@@ -126,15 +138,17 @@ int main(int argc, char** argv) {
  * @param char** argv from main
  * @param char** macerc_path path of startup script
  * @param char** target_path path of file to edit
+ * @param bool* is_bench set if benchmarks were asked for instead of editing
  */
-int mace_init(int argc, char** argv, char** macerc_path, char** target_path) {
+int mace_init(int argc, char** argv, char** macerc_path, char** target_path, bool* is_bench) {
 
     char* home_dir;
     char* home_script_path_suffix = "/.mace/macerc";
     char* etc_script_path = "/etc/macerc";
-    char short_opts[] = "hs:";
+    char short_opts[] = "hbs:";
     struct option long_opts[] = {
         { "help", no_argument, NULL, 'h' },
+        { "bench", no_argument, NULL, 'b' },
         { "script", required_argument, NULL, 's' },
         { 0, 0, 0, 0 }
     };
@@ -156,6 +170,9 @@ int mace_init(int argc, char** argv, char** macerc_path, char** target_path) {
                 usage(stdout);
                 exit(EXIT_SUCCESS);
                 break;
+            case 'b':
+                *is_bench = TRUE;
+                break;
             case 's':
                 *macerc_path = strdup(optarg);
                 break;
@@ -199,6 +216,91 @@ int mace_init(int argc, char** argv, char** macerc_path, char** target_path) {
     return 0;
 }
 
+/**
+ * Time loading target_path into a buffer and searching it, and print
+ * throughput
+ *
+ * @param char* target_path file to load
+ * @return int exit status
+ */
+int mace_bench(char* target_path) {
+    buffer_t* buffer;
+    struct timespec start;
+    struct timespec end;
+    double elapsed = 0;
+    double mb;
+    int runs = 0;
+    char* needles[] = { "e", "mace", "buffer_find_next", NULL };
+    char** needle;
+    bstring bneedle;
+    int is_caseless;
+    int matches;
+    int offset;
+
+    if (!target_path) {
+        fprintf(stderr, "Usage: mace --bench FILE\n");
+        return EXIT_FAILURE;
+    }
+    buffer = buffer_new();
+
+    // Repeat for at least a second so small files time meaningfully
+    while (elapsed < 1.0 || runs < 3) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (buffer_load_from_file(buffer, target_path)) {
+            fprintf(stderr, "Could not read %s\n", target_path);
+            return EXIT_FAILURE;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        runs += 1;
+    }
+    mb = (double)buffer->char_count * runs / (1024 * 1024);
+    printf(
+        "load: %d bytes, %d lines, %d runs, %.3f ms/run, %.1f MB/s\n",
+        buffer->char_count,
+        buffer->line_count,
+        runs,
+        elapsed * 1000 / runs,
+        mb / elapsed
+    );
+
+    // Find every match of each needle, with buffer_find_next and with
+    // bstrlib for comparison
+    mb = (double)buffer->char_count / (1024 * 1024);
+    for (needle = needles; *needle; needle++) {
+        for (is_caseless = 0; is_caseless <= 1; is_caseless++) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            matches = 0;
+            offset = 0;
+            while ((offset = buffer_find_next(buffer, *needle, offset, is_caseless)) != -1) {
+                matches += 1;
+                offset += 1;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            printf(
+                "find%s \"%s\": %d matches, %.1f MB/s",
+                is_caseless ? " caseless" : "",
+                *needle,
+                matches,
+                mb / elapsed
+            );
+
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            bneedle = bfromcstr(*needle);
+            offset = 0;
+            while ((offset = (is_caseless ? binstrcaseless : binstr)(buffer->buffer, offset, bneedle)) != BSTR_ERR) {
+                offset += 1;
+            }
+            bdestroy(bneedle);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            printf(" (bstrlib %.1f MB/s)\n", mb / elapsed);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
 /**
  * Print usage to f
  */
@@ -209,6 +311,7 @@ void usage(FILE* f) {
         "\n"
         "Option     Long option     Description\n"
         "-h         --help          Show this help\n"
+        "-b         --bench         Time loading and searching FILE, then exit\n"
         "-s         --script        Startup script (default=~/.mace/macerc)\n"
         "\n"
     );
@@ -218,6 +321,8 @@ void usage(FILE* f) {
  * Exit function
  */
 void exit_fn() {
+    printf(INPUT_PASTE_DISABLE);
+    fflush(stdout);
     if (isendwin()) {
         clear();
         endwin();
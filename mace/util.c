@@ -2,12 +2,14 @@
 #include <lauxlib.h>
 #include <lualib.h>
 #include <string.h>
+#include <ctype.h>
 #include <ncurses.h>
 #include <pcre.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <stdint.h>
 
 #include "util.h"
 
@@ -16,6 +18,11 @@ extern FILE* fdebug;
 short ncurses_default_color_bg = -1;
 short ncurses_default_color_fg = -1;
 
+util_regex_t* regex_cache = NULL;
+pcre_jit_stack* regex_jit_stack = NULL;
+util_pair_t* pair_cache = NULL;
+short pair_count = 0;
+
 char* util_lua_table_getstr(lua_State* L, char* key) {
     // Assumes table is at stac k index -1
     size_t size_tmp;
@@ -62,54 +69,195 @@ short util_ncurses_getcolorbystr(char* color) {
 }
 
 int util_ncurses_getpair(char* fg_str, char* bg_str) {
-
-    static short pair_count = 0;
-    short pair_start = 2;
-    short pair_end = pair_start + pair_count - 1;
-    short pair;
+    // Pairs are cached by fg and bg. They are never redefined, since rules
+    // and highlighted lines keep the attrs they were given.
+    util_pair_t* cached;
     short fg_num = util_ncurses_getcolorbystr(fg_str);
     short bg_num = util_ncurses_getcolorbystr(bg_str);
-    short tmp_fg_num;
-    short tmp_bg_num;
+    int key = (int)(((unsigned int)fg_num & 0xffff) << 16 | ((unsigned int)bg_num & 0xffff));
 
-    for (pair = pair_start; pair <= pair_end; pair++) {
-        pair_content(pair, &tmp_fg_num, &tmp_bg_num);
-        if (tmp_fg_num == fg_num && tmp_bg_num == bg_num) {
-            return COLOR_PAIR(pair);
-        }
+    HASH_FIND_INT(pair_cache, &key, cached);
+    if (cached != NULL) {
+        return COLOR_PAIR(cached->pair);
     }
 
-    pair = pair_start + pair_count;
-    if (pair >= COLOR_PAIRS) {
-        // Too many pairs defined
+    if (UTIL_PAIR_START + pair_count >= MIN(COLOR_PAIRS, UTIL_PAIR_MAX)) {
+        // No color pairs available
         return 0;
     }
 
-    init_pair(pair, fg_num, bg_num);
+    cached = calloc(1, sizeof(util_pair_t));
+    cached->pair = UTIL_PAIR_START + pair_count;
     pair_count += 1;
-    return COLOR_PAIR(pair);
+    cached->key = key;
+    init_pair(cached->pair, fg_num, bg_num);
+    HASH_ADD_INT(pair_cache, key, cached);
+    return COLOR_PAIR(cached->pair);
 }
 
 int util_ncurses_init_default_colors() {
     return pair_content(0, &ncurses_default_color_fg, &ncurses_default_color_bg);
 }
 
-pcre* util_pcre_compile(char* regex, char* error, int* error_offset) {
-    pcre* re;
-    if (error == NULL) {
-        error = (char*)malloc(sizeof(char));
-    }
-    if (error_offset == NULL) {
-        error_offset = (int*)malloc(sizeof(int));
-    }
-    re = pcre_compile(
-        regex,
-        PCRE_NO_AUTO_CAPTURE,
-        &error,
-        error_offset,
-        NULL
-    );
-    return re;
+util_regex_t* util_regex_get(char* regex, int options) {
+    // Regexes are compiled and studied once per pattern and options, then
+    // shared by every rule that uses them
+    util_regex_t* cached;
+    char* key;
+    const char* error;
+    int error_offset;
+
+    options |= PCRE_NO_AUTO_CAPTURE;
+    key = malloc(strlen(regex) + 10);
+    sprintf(key, "%x/%s", options, regex);
+    HASH_FIND_STR(regex_cache, key, cached);
+    if (cached != NULL) {
+        free(key);
+        return cached;
+    }
+
+    cached = calloc(1, sizeof(util_regex_t));
+    cached->re = pcre_compile(regex, options, &error, &error_offset, NULL);
+    if (cached->re == NULL) {
+        free(cached);
+        free(key);
+        return NULL;
+    }
+#ifdef PCRE_STUDY_JIT_COMPILE
+    cached->extra = pcre_study(cached->re, PCRE_STUDY_JIT_COMPILE, &error);
+    if (cached->extra != NULL) {
+        if (regex_jit_stack == NULL) {
+            regex_jit_stack = pcre_jit_stack_alloc(UTIL_JIT_STACK_MIN, UTIL_JIT_STACK_MAX);
+        }
+        pcre_assign_jit_stack(cached->extra, NULL, regex_jit_stack);
+    }
+#else
+    cached->extra = pcre_study(cached->re, 0, &error);
+#endif
+    cached->key = key;
+    HASH_ADD_KEYPTR(hh, regex_cache, cached->key, strlen(cached->key), cached);
+    return cached;
+}
+
+int util_regex_exec(util_regex_t* regex, char* subject, int length, int start_offset, int options, int* ovector, int ovecsize) {
+    return pcre_exec(regex->re, regex->extra, subject, length, start_offset, options, ovector, ovecsize);
+}
+
+util_search_t* util_search_new(char* needle, int needle_length, int is_caseless) {
+    // Needles are compiled once into a Boyer-Moore-Horspool skip table so
+    // repeated searches for the same needle skip straight to exec
+    util_search_t* search;
+    int i;
+
+    search = calloc(1, sizeof(util_search_t));
+    search->needle = malloc(needle_length + 1);
+    search->needle_length = needle_length;
+    search->is_caseless = is_caseless;
+    for (i = 0; i < 256; i++) {
+        search->fold[i] = is_caseless ? tolower(i) : i;
+        search->skip[i] = needle_length;
+    }
+    for (i = 0; i < needle_length; i++) {
+        search->needle[i] = search->fold[(unsigned char)needle[i]];
+    }
+    search->needle[needle_length] = '\0';
+
+    // Bytes in the needle (but its last) skip to line up with their last
+    // occurrence; a caseless needle skips the same for either case
+    for (i = 0; i < needle_length - 1; i++) {
+        search->skip[search->needle[i]] = needle_length - 1 - i;
+        if (is_caseless) {
+            search->skip[toupper(search->needle[i])] = needle_length - 1 - i;
+        }
+    }
+    return search;
+}
+
+int util_search_exec(util_search_t* search, char* subject, int length, int start_offset) {
+    // Return the offset of the first match at or after start_offset, or -1
+    unsigned char* haystack = (unsigned char*)subject;
+    unsigned char* needle = search->needle;
+    unsigned char* fold = search->fold;
+    int last = search->needle_length - 1;
+    int end = length - search->needle_length;
+    int cur = MAX(start_offset, 0);
+    int i;
+
+    if (search->needle_length < 1) {
+        return cur <= length ? cur : -1;
+    }
+
+    if (search->needle_length < UTIL_SEARCH_BMH_MIN_LENGTH) {
+        // Short needles barely skip, so jump between first-byte matches and
+        // check the last byte before the rest
+        while (cur <= end) {
+            cur = util_search_first_byte(search, haystack, cur, end);
+            if (cur < 0) {
+                return -1;
+            }
+            if (fold[haystack[cur + last]] == needle[last]) {
+                for (i = 1; i < last && fold[haystack[cur + i]] == needle[i]; i++);
+                if (i >= last) {
+                    return cur;
+                }
+            }
+            cur += 1;
+        }
+        return -1;
+    }
+
+    while (cur <= end) {
+        if (fold[haystack[cur + last]] == needle[last]) {
+            for (i = 0; i < last && fold[haystack[cur + i]] == needle[i]; i++);
+            if (i == last) {
+                return cur;
+            }
+        }
+        cur += search->skip[haystack[cur + last]];
+    }
+    return -1;
+}
+
+int util_search_first_byte(util_search_t* search, unsigned char* haystack, int start, int end) {
+    // Return the first offset from start thru end whose byte matches the
+    // needle's first, or -1. Bytes without case go to libc's vectorized
+    // memchr. Letters are found 8 bytes at a time: OR-ing in 0x20 folds
+    // just the two cases of a letter together, then the word has a zero
+    // byte wherever it matched.
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t highs = 0x8080808080808080ULL;
+    unsigned char first = search->needle[0];
+    unsigned char* found;
+    uint64_t pattern;
+    uint64_t word;
+    int cur = start;
+
+    if (!search->is_caseless || !isalpha(first)) {
+        found = memchr(haystack + start, first, end - start + 1);
+        return found ? found - haystack : -1;
+    }
+
+    pattern = ones * first;
+    while (cur + 8 <= end + 1) {
+        memcpy(&word, haystack + cur, sizeof(word));
+        word = (word | (ones * 0x20)) ^ pattern;
+        if (((word - ones) & ~word & highs) != 0) {
+            break;
+        }
+        cur += 8;
+    }
+    for (; cur <= end; cur++) {
+        if (search->fold[haystack[cur]] == first) {
+            return cur;
+        }
+    }
+    return -1;
+}
+
+int util_search_free(util_search_t* search) {
+    free(search->needle);
+    free(search);
+    return 0;
 }
 
 int util_file_exists(char* path) {
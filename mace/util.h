@@ -6,14 +6,48 @@
 #include <lualib.h>
 #include <pcre.h>
 
+#include "ext/uthash/uthash.h"
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
+#define UTIL_JIT_STACK_MIN (32 * 1024)
+#define UTIL_JIT_STACK_MAX (512 * 1024)
+#define UTIL_PAIR_START 2
+#define UTIL_PAIR_MAX 256
+#define UTIL_SEARCH_BMH_MIN_LENGTH 8
+
+typedef struct util_regex_s {
+    char* key;
+    pcre* re;
+    pcre_extra* extra;
+    UT_hash_handle hh;
+} util_regex_t;
+
+typedef struct util_search_s {
+    unsigned char* needle;
+    int needle_length;
+    int is_caseless;
+    int skip[256];
+    unsigned char fold[256];
+} util_search_t;
+
+typedef struct util_pair_s {
+    int key;
+    short pair;
+    UT_hash_handle hh;
+} util_pair_t;
+
 char* util_lua_table_getstr(lua_State* L, char* key);
 short util_ncurses_getcolorbystr(char* color);
 int util_ncurses_getpair(char* fg_str, char* bg_str);
 int util_ncurses_init_default_colors();
-pcre* util_pcre_compile(char* regex, char* error, int* error_offset);
+util_regex_t* util_regex_get(char* regex, int options);
+int util_regex_exec(util_regex_t* regex, char* subject, int length, int start_offset, int options, int* ovector, int ovecsize);
+util_search_t* util_search_new(char* needle, int needle_length, int is_caseless);
+int util_search_exec(util_search_t* search, char* subject, int length, int start_offset);
+int util_search_first_byte(util_search_t* search, unsigned char* haystack, int start, int end);
+int util_search_free(util_search_t* search);
 int util_file_exists(char* path);
 
 #endif